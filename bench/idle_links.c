@@ -0,0 +1,138 @@
+/* idle_links.c
+ * Measures memory used per idle connection of a simple router
+ * 
+ * Copyright 2013 Akash Rawal
+ * This file is part of MTC-Standalone.
+ * 
+ * MTC-Standalone is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * MTC-Standalone is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MTC-Standalone.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Usage: idle_links [N]
+//Opens N connections (default 10000) as socket pairs, adds one end of 
+//each to a simple router with a libevent event manager, and prints 
+//the growth of resident memory divided by N. Socket buffers live in 
+//the kernel and are not counted.
+
+#include <mtc0-sta/mtc-sta.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+//Gets resident memory of the process in bytes
+static long get_rss(void)
+{
+	FILE *statm;
+	long size, resident;
+	
+	statm = fopen("/proc/self/statm", "r");
+	if (! statm)
+	{
+		perror("/proc/self/statm");
+		exit(1);
+	}
+	if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+	{
+		fprintf(stderr, "Cannot parse /proc/self/statm\n");
+		exit(1);
+	}
+	fclose(statm);
+	
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct rlimit lim;
+	struct event_base *base;
+	MtcEventMgr *mgr;
+	MtcRouter *router;
+	MtcPeer **peers;
+	int *other_ends;
+	int n_links = 10000, i;
+	long rss_before, rss_after;
+	
+	if (argc > 1)
+		n_links = atoi(argv[1]);
+	if (n_links <= 0)
+	{
+		fprintf(stderr, "Usage: %s [N]\n", argv[0]);
+		return 1;
+	}
+	
+	//Each link takes two file descriptors
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0)
+	{
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+	
+	base = event_base_new();
+	mgr = mtc_lev_event_mgr_new(base, 1);
+	router = mtc_simple_router_new();
+	mtc_router_set_event_mgr(router, mgr);
+	
+	peers = (MtcPeer **) malloc(sizeof(MtcPeer *) * n_links);
+	other_ends = (int *) malloc(sizeof(int) * n_links);
+	if (! peers || ! other_ends)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	
+	//Count only what the links add
+	rss_before = get_rss();
+	
+	for (i = 0; i < n_links; i++)
+	{
+		int fds[2];
+		
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		{
+			perror("socketpair()");
+			fprintf(stderr, "Opened %d links\n", i);
+			return 1;
+		}
+		
+		peers[i] = mtc_simple_router_add(router, fds[0], 1);
+		other_ends[i] = fds[1];
+	}
+	
+	//One loop iteration, as a real server would run
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	
+	rss_after = get_rss();
+	
+	printf("links: %d\n", n_links);
+	printf("rss growth: %ld bytes\n", rss_after - rss_before);
+	printf("per link: %.1f bytes\n", 
+		(double) (rss_after - rss_before) / n_links);
+	
+	//Clean up
+	for (i = 0; i < n_links; i++)
+	{
+		mtc_simple_peer_disconnect(peers[i]);
+		mtc_peer_unref(peers[i]);
+		close(other_ends[i]);
+	}
+	free(peers);
+	free(other_ends);
+	
+	mtc_router_set_event_mgr(router, NULL);
+	mtc_router_unref(router);
+	mtc_event_mgr_unref(mgr);
+	
+	return 0;
+}
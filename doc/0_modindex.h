@@ -5,7 +5,15 @@
  * 
  * \defgroup mtc_fd_link MtcFDLink: An MtcLink implementation using file descriptors
  * 
+ * \defgroup mtc_dispatcher MtcDispatcher: Handling received mails in a pool of threads
+ * 
  * \defgroup mtc_simple_router MtcSimpleRouter: A simple MtcRouter implementation using socket connection to peers
  * 
  * \defgroup mtc_simple_server Support functions to setup a simple server
+ * 
+ * \defgroup mtc_connector MtcConnector: Asynchronous outgoing connections with a connection pool
+ * 
+ * \defgroup mtc_peer_group MtcPeerGroup: Load balancing among equivalent peers
+ * 
+ * \defgroup mtc_sharded_server Multi-threaded server with one event loop per thread
  */
@@ -21,6 +21,7 @@
 //Common header files
 #include <mtc0/mtc.h>
 #include <sys/socket.h>
+#include <poll.h>
 #include <event2/event.h>
 
 #ifndef _MTC_PUBLIC
@@ -36,7 +37,11 @@
 #endif
 #include "event.h"
 #include "fd_link.h"
+#include "dispatcher.h"
 #include "simple_router.h"
 #include "simple_server.h"
+#include "connector.h"
+#include "peer_group.h"
+#include "sharded_server.h"
 
 #undef _MTC_HEADER
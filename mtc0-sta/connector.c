@@ -0,0 +1,563 @@
+/* connector.c
+ * Asynchronous outgoing connections with a connection pool
+ * 
+ * Copyright 2013 Akash Rawal
+ * This file is part of MTC-Standalone.
+ * 
+ * MTC-Standalone is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * MTC-Standalone is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MTC-Standalone.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+typedef struct _MtcConnectRequest MtcConnectRequest;
+struct _MtcConnectRequest
+{
+	MtcConnectRequest *next;
+	MtcConnectFunc func;
+	void *data;
+};
+
+typedef struct _MtcConnectorEntry MtcConnectorEntry;
+struct _MtcConnectorEntry
+{
+	MtcEventSource parent;
+	
+	MtcConnector *connector;
+	MtcConnectorEntry *next, *prev;
+	char *addr;
+	
+	//While connecting
+	MtcEventTestPollFD test;
+	MtcEventBackend *backend;
+	MtcConnectRequest *requests, **requests_tail;
+	
+	//Addresses of the host, and the ones left to try
+	struct addrinfo *addrs, *next_addr;
+	
+	//When connected
+	MtcPeer *peer;
+	MtcPeerResetNotify notify;
+};
+
+struct _MtcConnector
+{
+	int refcount;
+	
+	MtcRouter *simple_router;
+	
+	//Pool, and connection attempts in progress
+	MtcConnectorEntry *entries;
+};
+
+//Address parsing
+
+//Unix socket addresses are stored in sa, for tcp *addrs is set 
+//to all addresses of the host.
+static int mtc_connector_resolve(const char *addr,
+	struct sockaddr_storage *sa, socklen_t *sa_len, 
+	struct addrinfo **addrs)
+{
+	*addrs = NULL;
+	
+	if (strncmp(addr, "unix:", 5) == 0)
+	{
+		struct sockaddr_un *sun = (struct sockaddr_un *) sa;
+		const char *path = addr + 5;
+		
+		if (strlen(path) >= sizeof(sun->sun_path) || (! path[0]))
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		
+		memset(sun, 0, sizeof(struct sockaddr_un));
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, path);
+		*sa_len = sizeof(struct sockaddr_un);
+		
+		return 0;
+	}
+	else if (strncmp(addr, "tcp:", 4) == 0)
+	{
+		struct addrinfo hints, *res;
+		const char *host = addr + 4, *port;
+		char *host_copy;
+		size_t host_len;
+		int status;
+		
+		//Port follows the last colon, IPv6 hosts are in brackets
+		port = strrchr(host, ':');
+		if (! port)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		host_len = port - host;
+		port++;
+		if (host_len >= 2 && host[0] == '[' && host[host_len - 1] == ']')
+		{
+			host++;
+			host_len -= 2;
+		}
+		if ((! host_len) || (! port[0]))
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		
+		host_copy = (char *) mtc_alloc(host_len + 1);
+		memcpy(host_copy, host, host_len);
+		host_copy[host_len] = 0;
+		
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_NUMERICSERV;
+		
+		status = getaddrinfo(host_copy, port, &hints, &res);
+		mtc_free(host_copy);
+		if (status != 0)
+		{
+			mtc_warn("getaddrinfo(): %s", gai_strerror(status));
+			errno = EHOSTUNREACH;
+			return -1;
+		}
+		
+		*addrs = res;
+		
+		return 0;
+	}
+	
+	errno = EINVAL;
+	return -1;
+}
+
+//Starts a nonblocking connection to a socket address, 
+//returns the socket or -1
+static int mtc_connector_start_sa(const struct sockaddr *sa, socklen_t sa_len)
+{
+	int fd;
+	
+	fd = socket(sa->sa_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	mtc_fd_set_blocking(fd, 0);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	
+	while (connect(fd, sa, sa_len) < 0)
+	{
+		//Completion is reported as the socket becoming writable
+		if (errno == EINPROGRESS)
+			break;
+		if (errno == EINTR)
+			continue;
+		
+		{
+			int saved_errno = errno;
+			
+			close(fd);
+			errno = saved_errno;
+			return -1;
+		}
+	}
+	
+	return fd;
+}
+
+//Starts a nonblocking connection to the first address in the list 
+//that can be tried, advancing the list past it.
+static int mtc_connector_start_next(struct addrinfo **next)
+{
+	struct addrinfo *ai;
+	int fd = -1;
+	
+	while ((ai = *next))
+	{
+		*next = ai->ai_next;
+		fd = mtc_connector_start_sa(ai->ai_addr, ai->ai_addrlen);
+		if (fd >= 0)
+			break;
+	}
+	
+	return fd;
+}
+
+//Starts a nonblocking connection, returns the socket or -1. 
+//For tcp, *addrs is set to the addresses of the host 
+//and *next to the ones not tried yet.
+static int mtc_connector_start(const char *addr, 
+	struct addrinfo **addrs, struct addrinfo **next)
+{
+	struct sockaddr_storage sa;
+	socklen_t sa_len;
+	int fd;
+	
+	*next = NULL;
+	if (mtc_connector_resolve(addr, &sa, &sa_len, addrs) < 0)
+		return -1;
+	if (! *addrs)
+		return mtc_connector_start_sa((struct sockaddr *) &sa, sa_len);
+	
+	*next = *addrs;
+	fd = mtc_connector_start_next(next);
+	if (fd < 0)
+	{
+		int saved_errno = errno;
+		
+		freeaddrinfo(*addrs);
+		*addrs = *next = NULL;
+		errno = saved_errno;
+	}
+	
+	return fd;
+}
+
+//Pool entries
+
+static void mtc_connector_entry_remove(MtcConnectorEntry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		entry->connector->entries = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	entry->next = entry->prev = NULL;
+}
+
+static void mtc_connector_entry_free_requests(MtcConnectRequest *requests)
+{
+	MtcConnectRequest *iter, *next;
+	
+	for (iter = requests; iter; iter = next)
+	{
+		next = iter->next;
+		mtc_free(iter);
+	}
+}
+
+//Frees an entry already removed from the connector
+static void mtc_connector_entry_destroy(MtcConnectorEntry *entry)
+{
+	if (entry->backend)
+	{
+		mtc_event_backend_destroy(entry->backend);
+		close(entry->test.fd);
+	}
+	if (entry->addrs)
+		freeaddrinfo(entry->addrs);
+	if (entry->peer)
+	{
+		mtc_peer_reset_notify_remove(&(entry->notify));
+		mtc_peer_unref(entry->peer);
+	}
+	mtc_connector_entry_free_requests(entry->requests);
+	
+	mtc_event_source_destroy((MtcEventSource *) entry);
+	mtc_free(entry->addr);
+	mtc_free(entry);
+}
+
+static void mtc_connector_entry_reset_notify(MtcPeerResetNotify *notify)
+{
+	MtcConnectorEntry *entry = mtc_encl_struct
+		(notify, MtcConnectorEntry, notify);
+	
+	mtc_connector_entry_remove(entry);
+	mtc_connector_entry_destroy(entry);
+}
+
+//Waits for the connection on the socket to complete
+static void mtc_connector_entry_watch
+	(MtcConnectorEntry *entry, MtcEventMgr *mgr, int fd)
+{
+	mtc_event_test_pollfd_init(&(entry->test), fd, MTC_POLLOUT);
+	mtc_event_source_prepare
+		((MtcEventSource *) entry, (MtcEventTest *) &(entry->test));
+	entry->backend = mtc_event_mgr_back(mgr, (MtcEventSource *) entry);
+}
+
+static MtcConnectorEntry *mtc_connector_find
+	(MtcConnector *connector, const char *addr)
+{
+	MtcConnectorEntry *iter;
+	
+	for (iter = connector->entries; iter; iter = iter->next)
+	{
+		if (strcmp(iter->addr, addr) == 0)
+			return iter;
+	}
+	
+	return NULL;
+}
+
+//Calls the functions of the requests and frees them
+static void mtc_connector_entry_complete(MtcConnector *connector,
+	const char *addr, MtcConnectRequest *requests,
+	MtcPeer *peer, int error)
+{
+	MtcConnectRequest *iter, *next;
+	
+	for (iter = requests; iter; iter = next)
+	{
+		next = iter->next;
+		(* iter->func)(connector, addr, peer, error, iter->data);
+		mtc_free(iter);
+	}
+}
+
+static void mtc_connector_entry_event
+	(MtcEventSource *source, MtcEventFlags event)
+{
+	MtcConnectorEntry *entry = (MtcConnectorEntry *) source;
+	MtcConnector *connector = entry->connector;
+	MtcConnectRequest *requests;
+	MtcPeer *peer = NULL;
+	char *addr;
+	int fd, error = 0;
+	socklen_t error_len = sizeof(int);
+	
+	if (! ((event & MTC_EVENT_CHECK) && entry->test.revents))
+		return;
+	
+	fd = entry->test.fd;
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+		error = errno;
+	
+	//Stop watching the socket
+	mtc_event_source_prepare(source, NULL);
+	mtc_event_backend_destroy(entry->backend);
+	entry->backend = NULL;
+	
+	//Try the next address of the host, 
+	//e.g. an IPv4 one when the server does not listen on IPv6
+	if (error && entry->next_addr)
+	{
+		MtcEventMgr *mgr = mtc_router_get_event_mgr
+			(connector->simple_router);
+		int next_fd = -1;
+		
+		if (mgr)
+			next_fd = mtc_connector_start_next(&(entry->next_addr));
+		if (next_fd >= 0)
+		{
+			close(fd);
+			mtc_connector_entry_watch(entry, mgr, next_fd);
+			return;
+		}
+	}
+	if (entry->addrs)
+	{
+		freeaddrinfo(entry->addrs);
+		entry->addrs = entry->next_addr = NULL;
+	}
+	
+	//Detach the requests, functions may connect again
+	requests = entry->requests;
+	entry->requests = NULL;
+	entry->requests_tail = &(entry->requests);
+	
+	//Functions may drop the last reference
+	mtc_connector_ref(connector);
+	
+	if (error)
+	{
+		close(fd);
+		addr = entry->addr;
+		entry->addr = NULL;
+		mtc_connector_entry_remove(entry);
+		mtc_event_source_destroy((MtcEventSource *) entry);
+		mtc_free(entry);
+		
+		mtc_connector_entry_complete
+			(connector, addr, requests, NULL, error);
+		mtc_free(addr);
+	}
+	else
+	{
+		peer = mtc_simple_router_add_nonblocking
+			(connector->simple_router, fd);
+		entry->peer = peer;
+		entry->notify.cb = mtc_connector_entry_reset_notify;
+		mtc_peer_add_reset_notify(peer, &(entry->notify));
+		
+		//Entry may be forgotten by the functions
+		mtc_peer_ref(peer);
+		addr = (char *) mtc_alloc(strlen(entry->addr) + 1);
+		strcpy(addr, entry->addr);
+		
+		mtc_connector_entry_complete
+			(connector, addr, requests, peer, 0);
+		
+		mtc_free(addr);
+		mtc_peer_unref(peer);
+	}
+	
+	mtc_connector_unref(connector);
+}
+
+static MtcEventSourceVTable mtc_connector_entry_vtable =
+{
+	mtc_connector_entry_event,
+	MTC_EVENT_CHECK
+};
+
+//Public API
+
+MtcConnector *mtc_connector_new(MtcRouter *simple_router)
+{
+	MtcConnector *connector;
+	
+	connector = (MtcConnector *) mtc_alloc(sizeof(MtcConnector));
+	
+	connector->refcount = 1;
+	connector->simple_router = simple_router;
+	mtc_router_ref(simple_router);
+	connector->entries = NULL;
+	
+	return connector;
+}
+
+void mtc_connector_ref(MtcConnector *connector)
+{
+	connector->refcount++;
+}
+
+void mtc_connector_unref(MtcConnector *connector)
+{
+	connector->refcount--;
+	if (connector->refcount <= 0)
+	{
+		MtcConnectorEntry *iter;
+		
+		//Tell callers waiting for connection attempts in progress
+		while ((iter = connector->entries))
+		{
+			MtcConnectRequest *requests = iter->requests;
+			
+			iter->requests = NULL;
+			mtc_connector_entry_remove(iter);
+			mtc_connector_entry_complete
+				(connector, iter->addr, requests, NULL, ECANCELED);
+			mtc_connector_entry_destroy(iter);
+		}
+		
+		mtc_router_unref(connector->simple_router);
+		mtc_free(connector);
+	}
+}
+
+MtcPeer *mtc_connector_lookup(MtcConnector *connector, const char *addr)
+{
+	MtcConnectorEntry *entry;
+	
+	entry = mtc_connector_find(connector, addr);
+	if (! entry)
+		return NULL;
+	if (! entry->peer)
+		return NULL;
+	if (! mtc_simple_peer_is_connected(entry->peer))
+		return NULL;
+	
+	return entry->peer;
+}
+
+int mtc_connector_connect(MtcConnector *connector, const char *addr,
+	MtcConnectFunc func, void *data)
+{
+	MtcConnectorEntry *entry;
+	MtcConnectRequest *request;
+	MtcEventMgr *mgr;
+	struct addrinfo *addrs, *next_addr;
+	int fd;
+	
+	entry = mtc_connector_find(connector, addr);
+	
+	//Reuse the pooled connection
+	if (entry && entry->peer)
+	{
+		if (mtc_simple_peer_is_connected(entry->peer))
+		{
+			(* func)(connector, addr, entry->peer, 0, data);
+			return 0;
+		}
+		
+		//Stale, will be replaced
+		mtc_connector_entry_remove(entry);
+		mtc_connector_entry_destroy(entry);
+		entry = NULL;
+	}
+	
+	//Start a new connection
+	if (! entry)
+	{
+		mgr = mtc_router_get_event_mgr(connector->simple_router);
+		if (! mgr)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		
+		fd = mtc_connector_start(addr, &addrs, &next_addr);
+		if (fd < 0)
+			return -1;
+		
+		entry = (MtcConnectorEntry *) mtc_alloc(sizeof(MtcConnectorEntry));
+		mtc_event_source_init
+			((MtcEventSource *) entry, &mtc_connector_entry_vtable);
+		
+		entry->connector = connector;
+		entry->addr = (char *) mtc_alloc(strlen(addr) + 1);
+		strcpy(entry->addr, addr);
+		entry->requests = NULL;
+		entry->requests_tail = &(entry->requests);
+		entry->peer = NULL;
+		entry->addrs = addrs;
+		entry->next_addr = next_addr;
+		
+		mtc_connector_entry_watch(entry, mgr, fd);
+		
+		entry->prev = NULL;
+		entry->next = connector->entries;
+		if (entry->next)
+			entry->next->prev = entry;
+		connector->entries = entry;
+	}
+	
+	//Wait for the connection
+	request = (MtcConnectRequest *) mtc_alloc(sizeof(MtcConnectRequest));
+	request->next = NULL;
+	request->func = func;
+	request->data = data;
+	*(entry->requests_tail) = request;
+	entry->requests_tail = &(request->next);
+	
+	return 0;
+}
+
+void mtc_connector_forget(MtcConnector *connector, const char *addr)
+{
+	MtcConnectorEntry *entry;
+	
+	entry = mtc_connector_find(connector, addr);
+	if (entry && entry->peer)
+	{
+		mtc_connector_entry_remove(entry);
+		mtc_connector_entry_destroy(entry);
+	}
+}
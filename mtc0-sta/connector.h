@@ -0,0 +1,116 @@
+/* connector.h
+ * Asynchronous outgoing connections with a connection pool
+ * 
+ * Copyright 2013 Akash Rawal
+ * This file is part of MTC-Standalone.
+ * 
+ * MTC-Standalone is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * MTC-Standalone is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MTC-Standalone.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \addtogroup mtc_connector
+ * \{
+ * 
+ * A connector connects to other processes without blocking the
+ * event loop, and adds the connections to a simple router as peers.
+ * 
+ * Addresses are strings of the following forms:
+ * - `tcp:host:port`, host may be an IPv4 address, an IPv6 address
+ *   in square brackets or a host name. Host names are resolved
+ *   using getaddrinfo(), which may block, so numeric addresses
+ *   should be preferred. The addresses of the host are tried in 
+ *   turn until one accepts the connection, so e.g. `localhost` 
+ *   works whether the server listens on IPv4 or IPv6.
+ * - `unix:path`, for a unix domain socket.
+ * 
+ * Connected peers are kept in a pool keyed by address, so connecting
+ * again to the same address reuses the connection. A peer leaves
+ * the pool when it is reset.
+ */
+
+///An object that creates and pools outgoing connections
+typedef struct _MtcConnector MtcConnector;
+
+/**Function called when a connection attempt completes.
+ * \param connector The connector
+ * \param addr The address that was connected to
+ * \param peer The connected peer, or NULL on failure. No reference is
+ *        added, use mtc_peer_ref() to keep it.
+ * \param error 0 on success, an errno value on failure
+ * \param data User data
+ */
+typedef void (*MtcConnectFunc)(MtcConnector *connector, const char *addr,
+	MtcPeer *peer, int error, void *data);
+
+/**Creates a new connector.
+ * \param simple_router A simple router to add connected peers to.
+ *        An event manager must be set on it
+ *        (see mtc_router_set_event_mgr()) before connecting.
+ * \return A new connector
+ */
+MtcConnector *mtc_connector_new(MtcRouter *simple_router);
+
+/**Increments the reference count by 1
+ * \param connector A connector
+ */
+void mtc_connector_ref(MtcConnector *connector);
+
+/**Decrements the reference count by 1. When the reference count
+ * drops to zero, connection attempts in progress are cancelled, 
+ * calling their functions with ECANCELED, and pooled peers are 
+ * released. The functions must not use the connector then.
+ * \param connector A connector
+ */
+void mtc_connector_unref(MtcConnector *connector);
+
+/**Gets a connected peer for the address from the pool.
+ * \param connector A connector
+ * \param addr Address of the peer
+ * \return A connected peer, or NULL if there is none.
+ *         No reference is added.
+ */
+MtcPeer *mtc_connector_lookup(MtcConnector *connector, const char *addr);
+
+/**Connects to an address asynchronously.
+ * 
+ * If a connected peer for the address is in the pool, it is reused
+ * and func is called before returning. If a connection attempt to
+ * the address is already in progress, func is called when it
+ * completes. Otherwise a new connection is started and func is called
+ * from the event loop when it completes.
+ * \param connector A connector
+ * \param addr Address to connect to
+ * \param func Function to call when the connection completes
+ * \param data User data for func
+ * \return 0 on success, -1 if the connection could not be started,
+ *         with errno set. func is not called in that case.
+ */
+int mtc_connector_connect(MtcConnector *connector, const char *addr,
+	MtcConnectFunc func, void *data);
+
+/**Removes the peer for the address from the pool, without
+ * disconnecting it. 
+ * 
+ * A connection attempt still in progress for the address is not 
+ * affected, and its peer enters the pool when it completes. 
+ * To keep such a peer out of the pool, call this function from 
+ * the function passed to mtc_connector_connect().
+ * \param connector A connector
+ * \param addr Address of the peer
+ */
+void mtc_connector_forget(MtcConnector *connector, const char *addr);
+
+/**
+ * \}
+ */
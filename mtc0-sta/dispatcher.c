@@ -0,0 +1,440 @@
+/* dispatcher.c
+ * Pool of handler threads for mails received by routers
+ * 
+ * Copyright 2013 Akash Rawal
+ * This file is part of MTC-Standalone.
+ * 
+ * MTC-Standalone is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * MTC-Standalone is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MTC-Standalone.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <mtc0-sta/simple_router_declares.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+typedef struct _MtcDispatchItem MtcDispatchItem;
+struct _MtcDispatchItem
+{
+	MtcDispatchItem *next;
+	MtcMsg *mail_msg;
+};
+
+struct _MtcDispatchStrand
+{
+	atomic_int refcount;
+	
+	MtcDispatcher *dispatcher;
+	MtcFDLinkRemote *remote;
+	
+	//Next strand in the run queue of a thread
+	MtcDispatchStrand *next;
+	
+	//Pushed mails, protected by lock
+	pthread_mutex_t lock;
+	MtcDispatchItem *head, *tail;
+	int scheduled;
+};
+
+typedef struct
+{
+	MtcDispatcher *dispatcher;
+	pthread_t thread;
+	
+	//Run queue, protected by lock
+	pthread_mutex_t lock;
+	MtcDispatchStrand *head, *tail;
+} MtcDispatchThread;
+
+struct _MtcDispatcher
+{
+	atomic_int refcount;
+	
+	MtcDispatchFunc func;
+	void *data;
+	
+	//Round robin counter for strands scheduled from outside
+	atomic_uint next;
+	
+	//No. of strands in run queues not yet claimed by any thread
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int n_ready;
+	int stop;
+	
+	int n_threads;
+	MtcDispatchThread threads[];
+};
+
+//Thread that is running a dispatcher's handler, if any
+static __thread MtcDispatchThread *mtc_dispatch_current = NULL;
+
+//Run queues
+
+static void mtc_dispatch_thread_push
+	(MtcDispatchThread *thread, MtcDispatchStrand *strand)
+{
+	MtcDispatcher *dispatcher = thread->dispatcher;
+	
+	strand->next = NULL;
+	
+	pthread_mutex_lock(&(thread->lock));
+	if (thread->tail)
+		thread->tail->next = strand;
+	else
+		thread->head = strand;
+	thread->tail = strand;
+	pthread_mutex_unlock(&(thread->lock));
+	
+	pthread_mutex_lock(&(dispatcher->lock));
+	dispatcher->n_ready++;
+	pthread_cond_signal(&(dispatcher->cond));
+	pthread_mutex_unlock(&(dispatcher->lock));
+}
+
+static MtcDispatchStrand *mtc_dispatch_thread_pop(MtcDispatchThread *thread)
+{
+	MtcDispatchStrand *strand;
+	
+	pthread_mutex_lock(&(thread->lock));
+	strand = thread->head;
+	if (strand)
+	{
+		thread->head = strand->next;
+		if (! thread->head)
+			thread->tail = NULL;
+	}
+	pthread_mutex_unlock(&(thread->lock));
+	
+	return strand;
+}
+
+//Waits for a strand to become ready and claims it.
+//Returns NULL when the dispatcher is stopping and nothing is left.
+static MtcDispatchStrand *mtc_dispatch_thread_claim
+	(MtcDispatchThread *thread)
+{
+	MtcDispatcher *dispatcher = thread->dispatcher;
+	MtcDispatchStrand *strand;
+	int idx, i;
+	
+	pthread_mutex_lock(&(dispatcher->lock));
+	while ((dispatcher->n_ready == 0) && (! dispatcher->stop))
+		pthread_cond_wait(&(dispatcher->cond), &(dispatcher->lock));
+	if (dispatcher->n_ready == 0)
+	{
+		pthread_mutex_unlock(&(dispatcher->lock));
+		return NULL;
+	}
+	dispatcher->n_ready--;
+	pthread_mutex_unlock(&(dispatcher->lock));
+	
+	//A strand is now reserved for us in some run queue.
+	//Look in our own queue first, then steal from others.
+	idx = thread - dispatcher->threads;
+	while (1)
+	{
+		for (i = 0; i < dispatcher->n_threads; i++)
+		{
+			strand = mtc_dispatch_thread_pop
+				(dispatcher->threads + ((idx + i) % dispatcher->n_threads));
+			if (strand)
+				return strand;
+		}
+		
+		//The strand is being pushed right now
+		sched_yield();
+	}
+}
+
+//Strands
+
+static void mtc_dispatch_strand_schedule
+	(MtcDispatchStrand *strand, MtcDispatchThread *thread)
+{
+	MtcDispatcher *dispatcher = strand->dispatcher;
+	
+	//Threads of the dispatcher keep the strands they run,
+	//others spread them over all threads
+	if ((! thread) || (thread->dispatcher != dispatcher))
+	{
+		thread = dispatcher->threads
+			+ (atomic_fetch_add(&(dispatcher->next), 1)
+				% dispatcher->n_threads);
+	}
+	
+	mtc_dispatch_thread_push(thread, strand);
+}
+
+MtcDispatchStrand *mtc_dispatch_strand_new
+	(MtcDispatcher *dispatcher, MtcFDLinkRemote *remote)
+{
+	MtcDispatchStrand *strand;
+	
+	strand = (MtcDispatchStrand *) mtc_alloc(sizeof(MtcDispatchStrand));
+	
+	atomic_init(&(strand->refcount), 1);
+	strand->dispatcher = dispatcher;
+	strand->remote = remote;
+	if (remote)
+		mtc_fd_link_remote_ref(remote);
+	strand->next = NULL;
+	
+	pthread_mutex_init(&(strand->lock), NULL);
+	strand->head = strand->tail = NULL;
+	strand->scheduled = 0;
+	
+	return strand;
+}
+
+void mtc_dispatch_strand_ref(MtcDispatchStrand *strand)
+{
+	atomic_fetch_add(&(strand->refcount), 1);
+}
+
+void mtc_dispatch_strand_unref(MtcDispatchStrand *strand)
+{
+	if (atomic_fetch_sub(&(strand->refcount), 1) == 1)
+	{
+		//A strand with pending mails is referenced by its run queue,
+		//so nothing is pending here.
+		if (strand->remote)
+			mtc_fd_link_remote_unref(strand->remote);
+		pthread_mutex_destroy(&(strand->lock));
+		mtc_free(strand);
+	}
+}
+
+void mtc_dispatch_strand_push(MtcDispatchStrand *strand, MtcMsg *mail_msg)
+{
+	MtcDispatchItem *item;
+	int schedule;
+	
+	item = (MtcDispatchItem *) mtc_alloc(sizeof(MtcDispatchItem));
+	item->next = NULL;
+	item->mail_msg = mail_msg;
+	
+	pthread_mutex_lock(&(strand->lock));
+	if (strand->tail)
+		strand->tail->next = item;
+	else
+		strand->head = item;
+	strand->tail = item;
+	schedule = ! strand->scheduled;
+	strand->scheduled = 1;
+	pthread_mutex_unlock(&(strand->lock));
+	
+	if (schedule)
+	{
+		//The run queue holds a reference
+		mtc_dispatch_strand_ref(strand);
+		mtc_dispatch_strand_schedule(strand, mtc_dispatch_current);
+	}
+}
+
+//Handles all mails pushed so far,
+//returns whether more mails were pushed meanwhile
+static int mtc_dispatch_strand_run(MtcDispatchStrand *strand)
+{
+	MtcDispatcher *dispatcher = strand->dispatcher;
+	MtcDispatchItem *iter, *next;
+	MtcSimpleMail simple_mail;
+	MtcDispatchMail mail;
+	int more;
+	
+	pthread_mutex_lock(&(strand->lock));
+	iter = strand->head;
+	strand->head = strand->tail = NULL;
+	pthread_mutex_unlock(&(strand->lock));
+	
+	for (; iter; iter = next)
+	{
+		next = iter->next;
+		
+		if (MtcSimpleMail__deserialize(iter->mail_msg, &simple_mail) >= 0)
+		{
+			mail.strand = strand;
+			mail.dest = simple_mail.dest;
+			mail.ret = simple_mail.ret;
+			mail.payload = simple_mail.payload;
+			
+			(* dispatcher->func)(&mail, dispatcher->data);
+			
+			MtcSimpleMail__free(&simple_mail);
+		}
+		else
+		{
+			mtc_warn("Dropping malformed mail");
+		}
+		
+		mtc_msg_unref(iter->mail_msg);
+		mtc_free(iter);
+	}
+	
+	pthread_mutex_lock(&(strand->lock));
+	more = strand->head ? 1 : 0;
+	strand->scheduled = more;
+	pthread_mutex_unlock(&(strand->lock));
+	
+	return more;
+}
+
+//Threads
+
+static void *mtc_dispatch_thread_main(void *arg)
+{
+	MtcDispatchThread *thread = (MtcDispatchThread *) arg;
+	MtcDispatchStrand *strand;
+	
+	mtc_dispatch_current = thread;
+	
+	while ((strand = mtc_dispatch_thread_claim(thread)))
+	{
+		if (mtc_dispatch_strand_run(strand))
+			mtc_dispatch_thread_push(thread, strand);
+		else
+			mtc_dispatch_strand_unref(strand);
+	}
+	
+	mtc_dispatch_current = NULL;
+	mtc_fd_link_iov_pool_clear();
+	
+	return NULL;
+}
+
+MtcDispatcher *mtc_dispatcher_new
+	(int n_threads, MtcDispatchFunc func, void *data)
+{
+	MtcDispatcher *dispatcher;
+	MtcDispatchThread *thread;
+	int i, res;
+	
+	if (n_threads <= 0)
+		mtc_error("Invalid number of threads %d", n_threads);
+	
+	dispatcher = (MtcDispatcher *) mtc_alloc
+		(sizeof(MtcDispatcher) + sizeof(MtcDispatchThread) * n_threads);
+	
+	atomic_init(&(dispatcher->refcount), 1);
+	dispatcher->func = func;
+	dispatcher->data = data;
+	atomic_init(&(dispatcher->next), 0);
+	pthread_mutex_init(&(dispatcher->lock), NULL);
+	pthread_cond_init(&(dispatcher->cond), NULL);
+	dispatcher->n_ready = 0;
+	dispatcher->stop = 0;
+	dispatcher->n_threads = n_threads;
+	
+	for (i = 0; i < n_threads; i++)
+	{
+		thread = dispatcher->threads + i;
+		
+		thread->dispatcher = dispatcher;
+		pthread_mutex_init(&(thread->lock), NULL);
+		thread->head = thread->tail = NULL;
+	}
+	
+	for (i = 0; i < n_threads; i++)
+	{
+		thread = dispatcher->threads + i;
+		
+		res = pthread_create(&(thread->thread), NULL,
+			mtc_dispatch_thread_main, thread);
+		if (res != 0)
+			mtc_error("pthread_create(): %s", strerror(res));
+	}
+	
+	return dispatcher;
+}
+
+void mtc_dispatcher_ref(MtcDispatcher *dispatcher)
+{
+	atomic_fetch_add(&(dispatcher->refcount), 1);
+}
+
+void mtc_dispatcher_unref(MtcDispatcher *dispatcher)
+{
+	int i;
+	
+	if (atomic_fetch_sub(&(dispatcher->refcount), 1) == 1)
+	{
+		if (mtc_dispatch_current
+			&& (mtc_dispatch_current->dispatcher == dispatcher))
+			mtc_error("Dispatcher destroyed from its own thread");
+		
+		//Threads exit after running all ready strands
+		pthread_mutex_lock(&(dispatcher->lock));
+		dispatcher->stop = 1;
+		pthread_cond_broadcast(&(dispatcher->cond));
+		pthread_mutex_unlock(&(dispatcher->lock));
+		
+		for (i = 0; i < dispatcher->n_threads; i++)
+		{
+			pthread_join(dispatcher->threads[i].thread, NULL);
+			pthread_mutex_destroy(&(dispatcher->threads[i].lock));
+		}
+		
+		pthread_cond_destroy(&(dispatcher->cond));
+		pthread_mutex_destroy(&(dispatcher->lock));
+		
+		mtc_free(dispatcher);
+	}
+}
+
+//Replies
+
+int mtc_dispatch_mail_sendto
+	(MtcDispatchMail *mail, MtcMBlock addr, MtcMsg *payload)
+{
+	MtcSimpleMail simple_mail;
+	MtcMsg *mail_msg, *copy;
+	
+	if (! mail->strand->remote)
+		return -1;
+	
+	//Serialize
+	simple_mail.dest = addr;
+	mtc_rcmem_ref(addr.mem);
+	simple_mail.ret.mem = NULL;
+	simple_mail.ret.size = 0;
+	simple_mail.payload = payload;
+	mtc_msg_ref(payload);
+	
+	mail_msg = MtcSimpleMail__serialize(&simple_mail);
+	
+	MtcSimpleMail__free(&simple_mail);
+	
+	//The serialized mail may share memory with the payload,
+	//send a private copy to the IO thread.
+	copy = mtc_sta_msg_dup(mail_msg);
+	mtc_msg_unref(mail_msg);
+	
+	if (mtc_fd_link_remote_queue(mail->strand->remote, copy, 0) < 0)
+	{
+		mtc_msg_unref(copy);
+		return -1;
+	}
+	
+	return 0;
+}
+
+int mtc_dispatch_mail_reply(MtcDispatchMail *mail, MtcMsg *payload)
+{
+	if (mail->ret.size == 0)
+		return -1;
+	
+	return mtc_dispatch_mail_sendto(mail, mail->ret, payload);
+}
@@ -0,0 +1,147 @@
+/* dispatcher.h
+ * Pool of handler threads for mails received by routers
+ * 
+ * Copyright 2013 Akash Rawal
+ * This file is part of MTC-Standalone.
+ * 
+ * MTC-Standalone is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * MTC-Standalone is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MTC-Standalone.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \addtogroup mtc_dispatcher
+ * \{
+ * 
+ * A dispatcher runs a pool of handler threads so that mails can be
+ * processed without blocking the thread doing the IO.
+ * 
+ * Mails are pushed to strands. Mails of a strand are handled one
+ * at a time in the order they were pushed, while different strands
+ * are handled in parallel. A simple router with a dispatcher
+ * (see mtc_simple_router_set_dispatcher()) uses one strand per peer.
+ * 
+ * Every handler thread has its own queue of strands ready to run,
+ * and idle threads steal strands from queues of other threads.
+ * 
+ * Replies are sent back through the queue of the link
+ * (see mtc_fd_link_get_remote()), so the handler threads never touch
+ * objects belonging to the IO thread.
+ */
+
+///A pool of handler threads
+typedef struct _MtcDispatcher MtcDispatcher;
+
+///A queue of mails that are handled in order
+typedef struct _MtcDispatchStrand MtcDispatchStrand;
+
+///A mail being handled by a handler thread
+typedef struct
+{
+	///The strand the mail was pushed to
+	MtcDispatchStrand *strand;
+	///Destination address of the mail
+	MtcMBlock dest;
+	///Address to send the reply to, may be empty
+	MtcMBlock ret;
+	///The payload
+	MtcMsg *payload;
+} MtcDispatchMail;
+
+/**Function called in a handler thread for every mail.
+ * 
+ * The mail and everything it refers to belong to the handler thread
+ * and are freed when the function returns. References taken on the
+ * payload must not be passed to other threads.
+ * \param mail The mail
+ * \param data User data
+ */
+typedef void (*MtcDispatchFunc)(MtcDispatchMail *mail, void *data);
+
+/**Creates a new dispatcher and starts its threads.
+ * \param n_threads No. of handler threads
+ * \param func Function to handle the mails
+ * \param data User data for func
+ * \return A new dispatcher
+ */
+MtcDispatcher *mtc_dispatcher_new
+	(int n_threads, MtcDispatchFunc func, void *data);
+
+/**Increments the reference count by 1. Can be called from any thread.
+ * \param dispatcher A dispatcher
+ */
+void mtc_dispatcher_ref(MtcDispatcher *dispatcher);
+
+/**Decrements the reference count by 1. Can be called from any thread.
+ * When the reference count drops to zero, the pending mails are handled
+ * and the threads are stopped.
+ * \param dispatcher A dispatcher
+ */
+void mtc_dispatcher_unref(MtcDispatcher *dispatcher);
+
+/**Creates a new strand.
+ * \param dispatcher The dispatcher whose threads will handle the mails.
+ *        The dispatcher must be kept alive as long as mails are pushed
+ *        to the strand.
+ * \param remote Queue through which replies are sent, or NULL.
+ *        A reference is taken.
+ * \return A new strand
+ */
+MtcDispatchStrand *mtc_dispatch_strand_new
+	(MtcDispatcher *dispatcher, MtcFDLinkRemote *remote);
+
+/**Increments the reference count by 1. Can be called from any thread.
+ * \param strand A strand
+ */
+void mtc_dispatch_strand_ref(MtcDispatchStrand *strand);
+
+/**Decrements the reference count by 1. Can be called from any thread.
+ * Mails already pushed are still handled.
+ * \param strand A strand
+ */
+void mtc_dispatch_strand_unref(MtcDispatchStrand *strand);
+
+/**Pushes a serialized MtcSimpleMail to the strand.
+ * 
+ * The reference held by the caller is handed over to the handler
+ * thread, so the message must not share memory with anything else
+ * (see mtc_sta_msg_dup()).
+ * \param strand A strand
+ * \param mail_msg The serialized mail
+ */
+void mtc_dispatch_strand_push(MtcDispatchStrand *strand, MtcMsg *mail_msg);
+
+/**Sends a mail back over the link the mail was received from.
+ * Must be called from the handler thread.
+ * \param mail The mail being handled
+ * \param addr Destination address
+ * \param payload The payload. It is copied, the caller keeps
+ *        its reference.
+ * \return 0 on success, -1 if the strand has no link or the link
+ *         has been destroyed.
+ */
+int mtc_dispatch_mail_sendto
+	(MtcDispatchMail *mail, MtcMBlock addr, MtcMsg *payload);
+
+/**Sends a reply to the return address of the mail.
+ * Same as mtc_dispatch_mail_sendto() with mail->ret as address.
+ * \param mail The mail being handled
+ * \param payload The payload. It is copied, the caller keeps
+ *        its reference.
+ * \return 0 on success, -1 if the mail has no return address or
+ *         it could not be sent.
+ */
+int mtc_dispatch_mail_reply(MtcDispatchMail *mail, MtcMsg *payload);
+
+/**
+ * \}
+ */
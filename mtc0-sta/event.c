@@ -48,6 +48,16 @@ static int mtc_poll_from_lev(short events)
 	return res;
 }
 
+//Timer wheel: MTC_LEV_WHEEL_LEVELS levels of 64 slots each, 
+//every slot of a level spans all slots of the level below.
+#define MTC_LEV_WHEEL_BITS 6
+#define MTC_LEV_WHEEL_SIZE (1 << MTC_LEV_WHEEL_BITS)
+#define MTC_LEV_WHEEL_MASK (MTC_LEV_WHEEL_SIZE - 1)
+#define MTC_LEV_WHEEL_LEVELS 4
+
+//Length of a tick in microseconds
+#define MTC_LEV_TICK 1000
+
 //Structures
 typedef struct
 {
@@ -55,6 +65,16 @@ typedef struct
 	
 	struct event_base *base;
 	int destroy_base;
+	
+	//Timer wheel
+	struct
+	{
+		MtcRing slots[MTC_LEV_WHEEL_LEVELS][MTC_LEV_WHEEL_SIZE];
+		int64_t cur;
+		int len, len0;
+		int running;
+		struct event *ev;
+	} wheel;
 } MtcLevEventMgr;
 
 typedef struct _MtcLevTest MtcLevTest;
@@ -75,17 +95,35 @@ struct _MtcLevTest
 	MtcEventTest *test;
 	MtcLevEventBackend *backend;
 	
+	//For pollfd tests
 	struct event *ev;
+	
+	//For timer tests
+	MtcRing wheel_ring;
+	int level;
 };
 
+#define mtc_lev_test_from_wheel_ring(ring) \
+	((MtcLevTest *) \
+		(MTC_PTR_ADD((ring), - offsetof(MtcLevTest, wheel_ring))))
+
+static void mtc_lev_wheel_remove(MtcLevEventMgr *lmgr, MtcLevTest *lev_test);
+
 //MtcLevTest
 
 static void mtc_lev_test_dispose(MtcLevTest *lev_test)
 {
 	if (lev_test->test)
 	{
-		event_del(lev_test->ev);
-		event_free(lev_test->ev);
+		if (lev_test->ev)
+		{
+			event_del(lev_test->ev);
+			event_free(lev_test->ev);
+		}
+		else
+		{
+			mtc_lev_wheel_remove(lev_test->backend->lmgr, lev_test);
+		}
 		lev_test->test = NULL;
 		lev_test->ev = NULL;
 	}
@@ -126,6 +164,202 @@ static void mtc_lev_test_cb(evutil_socket_t fd, short events, void *arg)
 	mtc_lev_test_unref(lev_test);
 }
 
+//Timer wheel
+
+static void mtc_lev_wheel_insert(MtcLevEventMgr *lmgr, MtcLevTest *lev_test)
+{
+	MtcEventTestTimer *timer = (MtcEventTestTimer *) lev_test->test;
+	MtcRing *sentinel, *ring = &(lev_test->wheel_ring);
+	int64_t expires, delta, span;
+	int level;
+	
+	//The wheel stops turning when empty
+	if (! lmgr->wheel.len)
+		lmgr->wheel.cur = mtc_sta_get_time() / MTC_LEV_TICK;
+	
+	//Round up, timers never fire early
+	expires = (timer->expires + MTC_LEV_TICK - 1) / MTC_LEV_TICK;
+	delta = expires - lmgr->wheel.cur;
+	
+	//Already expired, fire on next tick
+	if (delta <= 0)
+	{
+		expires = lmgr->wheel.cur + 1;
+		delta = 1;
+	}
+	
+	//Timers beyond the last level wait in its farthest slot
+	span = ((int64_t) 1) << (MTC_LEV_WHEEL_BITS * MTC_LEV_WHEEL_LEVELS);
+	if (delta >= span)
+	{
+		expires = lmgr->wheel.cur + span - 1;
+		delta = span - 1;
+	}
+	
+	//Pick the lowest level that spans the delay
+	for (level = 0; level < MTC_LEV_WHEEL_LEVELS - 1; level++)
+	{
+		if (delta < ((int64_t) 1) << (MTC_LEV_WHEEL_BITS * (level + 1)))
+			break;
+	}
+	
+	sentinel = &(lmgr->wheel.slots[level]
+		[(expires >> (MTC_LEV_WHEEL_BITS * level)) & MTC_LEV_WHEEL_MASK]);
+	ring->next = sentinel;
+	ring->prev = sentinel->prev;
+	ring->next->prev = ring;
+	ring->prev->next = ring;
+	
+	lev_test->level = level;
+	lmgr->wheel.len++;
+	if (level == 0)
+		lmgr->wheel.len0++;
+}
+
+static void mtc_lev_wheel_remove(MtcLevEventMgr *lmgr, MtcLevTest *lev_test)
+{
+	MtcRing *ring = &(lev_test->wheel_ring);
+	
+	//Not in the wheel
+	if (ring->next == ring)
+		return;
+	
+	ring->next->prev = ring->prev;
+	ring->prev->next = ring->next;
+	ring->next = ring->prev = ring;
+	
+	lmgr->wheel.len--;
+	if (lev_test->level == 0)
+		lmgr->wheel.len0--;
+}
+
+//Arms the libevent timer for the next tick having something to do
+static void mtc_lev_wheel_arm(MtcLevEventMgr *lmgr)
+{
+	struct timeval tv;
+	int64_t cur = lmgr->wheel.cur, ticks, wait;
+	int i;
+	
+	if (lmgr->wheel.running)
+		return;
+	
+	if (! lmgr->wheel.len)
+	{
+		event_del(lmgr->wheel.ev);
+		return;
+	}
+	
+	//Next cascade from higher levels
+	ticks = MTC_LEV_WHEEL_SIZE - (cur & MTC_LEV_WHEEL_MASK);
+	
+	//Nearest timer on the first level
+	if (lmgr->wheel.len0)
+	{
+		for (i = 1; i < ticks; i++)
+		{
+			MtcRing *sentinel = &(lmgr->wheel.slots[0]
+				[(cur + i) & MTC_LEV_WHEEL_MASK]);
+			
+			if (sentinel->next != sentinel)
+				break;
+		}
+		ticks = i;
+	}
+	
+	wait = (cur + ticks) * MTC_LEV_TICK - mtc_sta_get_time();
+	if (wait < 0)
+		wait = 0;
+	tv.tv_sec = wait / 1000000;
+	tv.tv_usec = wait % 1000000;
+	evtimer_add(lmgr->wheel.ev, &tv);
+}
+
+//Calls the event source of a timer already removed from the wheel
+static void mtc_lev_wheel_fire(MtcLevEventMgr *lmgr, MtcLevTest *lev_test)
+{
+	MtcEventTestTimer *timer = (MtcEventTestTimer *) lev_test->test;
+	
+	mtc_lev_test_ref(lev_test);
+	timer->fired = 1;
+	mtc_event_backend_event
+		((MtcEventBackend *) lev_test->backend, MTC_EVENT_CHECK);
+	if (! mtc_lev_test_is_disposed(lev_test))
+	{
+		timer->fired = 0;
+		
+		//Reschedule periodic timers, skipping missed periods
+		if (timer->interval > 0)
+		{
+			int64_t now = mtc_sta_get_time();
+			
+			timer->expires += timer->interval;
+			if (timer->expires <= now)
+				timer->expires = now + timer->interval;
+			mtc_lev_wheel_insert(lmgr, lev_test);
+		}
+		else
+		{
+			timer->expires = -1;
+		}
+	}
+	mtc_lev_test_unref(lev_test);
+}
+
+static void mtc_lev_wheel_cb(evutil_socket_t fd, short events, void *arg)
+{
+	MtcLevEventMgr *lmgr = (MtcLevEventMgr *) arg;
+	int64_t now = mtc_sta_get_time() / MTC_LEV_TICK;
+	MtcRing *sentinel;
+	int level;
+	
+	//Callbacks may drop the last reference
+	mtc_event_mgr_ref((MtcEventMgr *) lmgr);
+	lmgr->wheel.running = 1;
+	
+	while (lmgr->wheel.cur < now && lmgr->wheel.len)
+	{
+		lmgr->wheel.cur++;
+		
+		//Cascade timers from higher levels when lower levels wrap
+		for (level = 1; level < MTC_LEV_WHEEL_LEVELS; level++)
+		{
+			if (lmgr->wheel.cur 
+				& ((((int64_t) 1) << (MTC_LEV_WHEEL_BITS * level)) - 1))
+				break;
+			
+			sentinel = &(lmgr->wheel.slots[level]
+				[(lmgr->wheel.cur >> (MTC_LEV_WHEEL_BITS * level)) 
+				& MTC_LEV_WHEEL_MASK]);
+			while (sentinel->next != sentinel)
+			{
+				MtcLevTest *lev_test 
+					= mtc_lev_test_from_wheel_ring(sentinel->next);
+				
+				mtc_lev_wheel_remove(lmgr, lev_test);
+				mtc_lev_wheel_insert(lmgr, lev_test);
+			}
+		}
+		
+		//Fire timers of current tick, 
+		//rescheduled timers always go to a later slot
+		sentinel = &(lmgr->wheel.slots[0]
+			[lmgr->wheel.cur & MTC_LEV_WHEEL_MASK]);
+		while (sentinel->next != sentinel)
+		{
+			MtcLevTest *lev_test 
+				= mtc_lev_test_from_wheel_ring(sentinel->next);
+			
+			mtc_lev_wheel_remove(lmgr, lev_test);
+			mtc_lev_wheel_fire(lmgr, lev_test);
+		}
+	}
+	
+	lmgr->wheel.running = 0;
+	mtc_lev_wheel_arm(lmgr);
+	
+	mtc_event_mgr_unref((MtcEventMgr *) lmgr);
+}
+
 static MtcLevTest *mtc_lev_test_new
 	(MtcLevEventBackend *backend, MtcEventTest *test)
 {
@@ -149,6 +383,28 @@ static MtcLevTest *mtc_lev_test_new
 		
 		fd_test->revents = 0;
 	}
+	else if (mtc_event_test_check_name(test, MTC_EVENT_TEST_TIMER))
+	{
+		MtcEventTestTimer *timer = (MtcEventTestTimer *) test;
+		
+		lev_test = (MtcLevTest *) mtc_alloc(sizeof(MtcLevTest));
+		
+		lev_test->refcount = 1;
+		lev_test->next = NULL;
+		lev_test->test = test;
+		lev_test->backend = backend;
+		lev_test->ev = NULL;
+		lev_test->wheel_ring.next = lev_test->wheel_ring.prev 
+			= &(lev_test->wheel_ring);
+		lev_test->level = 0;
+		
+		timer->fired = 0;
+		if (timer->expires >= 0)
+		{
+			mtc_lev_wheel_insert(backend->lmgr, lev_test);
+			mtc_lev_wheel_arm(backend->lmgr);
+		}
+	}
 	else
 	{
 		mtc_error("Event test \"%s\" not supported", test->name);
@@ -212,6 +468,8 @@ static void mtc_lev_event_mgr_destroy(MtcEventMgr *mgr)
 {
 	MtcLevEventMgr *lmgr = (MtcLevEventMgr *) mgr;
 	
+	event_free(lmgr->wheel.ev);
+	
 	if (lmgr->destroy_base)
 	{
 		event_base_free(lmgr->base);
@@ -232,10 +490,23 @@ MtcEventBackendVTable mtc_lev_event_vtable =
 	mtc_lev_event_mgr_destroy
 };
 
+//Timer tests
+
+void mtc_event_test_timer_init
+	(MtcEventTestTimer *test, int64_t expires, int64_t interval)
+{
+	test->parent.next = NULL;
+	test->parent.name = MTC_EVENT_TEST_TIMER;
+	test->expires = expires;
+	test->interval = interval > 0 ? interval : 0;
+	test->fired = 0;
+}
+
 MtcEventMgr *mtc_lev_event_mgr_new
 	(struct event_base *base, int destroy_base)
 {
 	MtcLevEventMgr *lmgr;
+	int i, j;
 	
 	lmgr = (MtcLevEventMgr *) mtc_alloc(sizeof(MtcLevEventMgr));
 	
@@ -244,5 +515,15 @@ MtcEventMgr *mtc_lev_event_mgr_new
 	lmgr->base = base;
 	lmgr->destroy_base = destroy_base;
 	
+	for (i = 0; i < MTC_LEV_WHEEL_LEVELS; i++)
+		for (j = 0; j < MTC_LEV_WHEEL_SIZE; j++)
+			lmgr->wheel.slots[i][j].next = lmgr->wheel.slots[i][j].prev 
+				= &(lmgr->wheel.slots[i][j]);
+	lmgr->wheel.cur = mtc_sta_get_time() / MTC_LEV_TICK;
+	lmgr->wheel.len = 0;
+	lmgr->wheel.len0 = 0;
+	lmgr->wheel.running = 0;
+	lmgr->wheel.ev = evtimer_new(base, mtc_lev_wheel_cb, lmgr);
+	
 	return (MtcEventMgr *) lmgr;
 }
@@ -24,6 +24,41 @@
  * A libevent based implementation for MTC event-driven framework.
  */
 
+///Name of timer tests
+#define MTC_EVENT_TEST_TIMER "mtc_lev_timer"
+
+/**An event test that fires at a given time, 
+ * supported by libevent based event managers. 
+ * 
+ * Timers are kept on a hierarchical timer wheel with a resolution of 
+ * one millisecond, so adding, removing and firing a timer take 
+ * constant time however many there are. Timers may fire up to 
+ * a millisecond late, never early.
+ */
+typedef struct
+{
+	///Parent
+	MtcEventTest parent;
+	///Time to fire at, in microseconds of the monotonic clock used by
+	///mtc_simple_get_time(). Negative if not armed. 
+	///One-shot timers are disarmed after they fire, 
+	///periodic timers are advanced by interval.
+	int64_t expires;
+	///Period in microseconds for periodic timers, 0 for one-shot
+	int64_t interval;
+	///Set while the event source is called because the timer fired
+	int fired;
+} MtcEventTestTimer;
+
+/**Initializes a timer test. 
+ * Changes take effect when the test is prepared again.
+ * \param test The timer test
+ * \param expires Time to fire at, negative to not fire
+ * \param interval Period for periodic timers, 0 for one-shot timers
+ */
+void mtc_event_test_timer_init
+	(MtcEventTestTimer *test, int64_t expires, int64_t interval);
+
 /**Creates a new libevent based event backend manager.
  * \param base As returned from event_base_new()
  * \param destroy_base 1 to destroy base when event manager is
@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/uio.h>
+#include <stdatomic.h>
 
 //Internals
 
@@ -143,12 +144,103 @@ struct _MtcFDLinkSendJob
 	int stop_flag;
 	unsigned int n_blocks;
 	
+	//Time after which the job is dropped, negative for never
+	int64_t expires;
+	//Coalescing key, 0 for none
+	uint32_t key;
+	
+	//Completion notification, and how the message left the queue
+	MtcFDLinkDoneFunc done;
+	void *done_data;
+	MtcFDLinkDoneStatus sent;
+	
 	//The header data
 	MtcHeaderBuf hdr;
 };
 
+//Queue through which other threads can send messages over the link
+typedef struct _MtcFDLinkRemoteItem MtcFDLinkRemoteItem;
+struct _MtcFDLinkRemoteItem
+{
+	MtcFDLinkRemoteItem *next;
+	
+	MtcMsg *msg;
+	int stop;
+};
+
+struct _MtcFDLinkRemote
+{
+	atomic_int refcount;
+	atomic_int closed;
+	
+	//Pushed items, most recent first
+	_Atomic(MtcFDLinkRemoteItem *) head;
+	
+	MtcWakeup wakeup;
+};
+
 #define MTC_IOV_MIN 16
 
+//IO vectors of MTC_IOV_MIN entries released by idle links, 
+//linked through iov_base of first entry. 
+//Per thread so that no locking is needed.
+#define MTC_IOV_POOL_MAX 64
+static _Thread_local struct
+{
+	struct iovec *head;
+	int len;
+} mtc_fd_link_iov_pool = {NULL, 0};
+
+static struct iovec *mtc_fd_link_iov_pool_get(void)
+{
+	struct iovec *res = mtc_fd_link_iov_pool.head;
+	
+	if (! res)
+		return (struct iovec *) mtc_alloc
+			(sizeof(struct iovec) * MTC_IOV_MIN);
+	
+	mtc_fd_link_iov_pool.head = (struct iovec *) res->iov_base;
+	mtc_fd_link_iov_pool.len--;
+	
+	return res;
+}
+
+static void mtc_fd_link_iov_pool_put(struct iovec *mem)
+{
+	if (mtc_fd_link_iov_pool.len >= MTC_IOV_POOL_MAX)
+	{
+		mtc_free(mem);
+		return;
+	}
+	
+	mem->iov_base = mtc_fd_link_iov_pool.head;
+	mtc_fd_link_iov_pool.head = mem;
+	mtc_fd_link_iov_pool.len++;
+}
+
+void mtc_fd_link_iov_pool_clear(void)
+{
+	struct iovec *iter, *next;
+	
+	for (iter = mtc_fd_link_iov_pool.head; iter; iter = next)
+	{
+		next = (struct iovec *) iter->iov_base;
+		mtc_free(iter);
+	}
+	mtc_fd_link_iov_pool.head = NULL;
+	mtc_fd_link_iov_pool.len = 0;
+}
+
+//Total no. of unsent bytes on all links of the process
+static atomic_size_t mtc_fd_link_total_unsent = 0;
+
+#define mtc_fd_link_count_unsent(op, n) \
+	atomic_fetch_ ## op ## _explicit \
+		(&mtc_fd_link_total_unsent, (n), memory_order_relaxed)
+
+//Maximum no. of packets to send in one sendmmsg() call
+#define MTC_MMSG_MAX 16
+
 //A link that operates on file descriptor
 typedef struct
 {
@@ -160,15 +252,59 @@ typedef struct
 	//Whether to close file descriptors
 	int close_fd;
 	
+	//Whether the socket preserves message boundaries
+	int packet;
+	
+	//Time of last IO
+	int64_t last_active;
+	
+	//Nesting count of mtc_fd_link_cork(), no sending while nonzero
+	int corked;
+	//Set by synchronous IO steps to send despite the cork, 
+	//until the queue is empty
+	int cork_bypass;
+	
+	//Micro-batching, see mtc_fd_link_set_batching()
+	struct
+	{
+		int64_t max_delay;
+		size_t max_bytes;
+		
+		//Average time between queued messages, and last queue time
+		int64_t avg_gap, last_queued;
+		
+		//Whether sending is held back by an open window
+		int holding;
+		
+		//Whether the tests need to be prepared again
+		int rearm;
+		
+		//Fires when the window closes
+		MtcEventTestTimer timer;
+	} batch;
+	
 	//Stuff for sending
 	struct
 	{
 		struct iovec *mem;
 		int alen, start, len, ulim, clip;
+		size_t size;
 	} iov;
 	struct
 	{
 		MtcFDLinkSendJob *head, *tail;
+		
+		//See mtc_fd_link_set_queue_policy()
+		MtcFDLinkQueuePolicy policy;
+		size_t limit;
+		
+		//Earliest expiry of queued jobs, negative if none expire
+		int64_t next_expiry;
+		
+		//Finished jobs waiting for their done functions to be called
+		MtcFDLinkSendJob *done_head, *done_tail;
+		
+		MtcFDLinkQueueStats stats;
 	} jobs;
 	
 	//Stuff for receiving
@@ -178,9 +314,14 @@ typedef struct
 	MtcHeaderData header_data;
 	void *mem; //< buffer for BSI and IO vector
 	MtcMsg *msg; //< Message structure
+	MtcMsg *received; //< Message being passed to received callback
+	
+	//Queue for other threads
+	MtcFDLinkRemote *remote;
 	
 	//Event loop integration
-	MtcEventTestPollFD tests[2];
+	//tests[2] is used for the wakeup of remote queue.
+	MtcEventTestPollFD tests[3];
 	
 	//Preallocated buffers
 	MtcHeaderBuf header;
@@ -192,6 +333,14 @@ static struct iovec *mtc_fd_link_alloc_iov
 {
 	struct iovec *res;
 	
+	//Allocated on first use
+	if (! self->iov.mem)
+	{
+		self->iov.mem = mtc_fd_link_iov_pool_get();
+		self->iov.alen = MTC_IOV_MIN;
+		self->iov.start = 0;
+	}
+	
 	if (self->iov.start + self->iov.len + n_blocks > self->iov.alen)
 	{
 		//Resize if IO vector is not sufficiently large.
@@ -219,8 +368,23 @@ static struct iovec *mtc_fd_link_alloc_iov
 	return res;
 }
 
+static void mtc_fd_link_release_iov(MtcFDLink *self)
+{
+	if (self->iov.mem)
+	{
+		if (self->iov.alen == MTC_IOV_MIN)
+			mtc_fd_link_iov_pool_put(self->iov.mem);
+		else
+			mtc_free(self->iov.mem);
+	}
+	self->iov.mem = NULL;
+	self->iov.alen = 0;
+	self->iov.start = 0;
+}
+
 static int mtc_fd_link_pop_iov(MtcFDLink *self, int n_bytes)
 {
+	int n_bytes_total = n_bytes;
 	int n_blocks = 0;
 	struct iovec *vector;
 	
@@ -240,6 +404,8 @@ static int mtc_fd_link_pop_iov(MtcFDLink *self, int n_bytes)
 	}
 	
 	//Update IO vector
+	self->iov.size -= n_bytes_total;
+	mtc_fd_link_count_unsent(sub, n_bytes_total);
 	self->iov.start += n_blocks;
 	self->iov.len -= n_blocks;
 	if (self->iov.clip >= 0)
@@ -249,8 +415,13 @@ static int mtc_fd_link_pop_iov(MtcFDLink *self, int n_bytes)
 			mtc_error("Assertion failure");
 	}
 	
+	//Release IO vector when everything is sent
+	if (! self->iov.len)
+	{
+		mtc_fd_link_release_iov(self);
+	}
 	//Collapse IO vector if necessary
-	if (self->iov.alen > MTC_IOV_MIN
+	else if (self->iov.alen > MTC_IOV_MIN
 		&& self->iov.len <= self->iov.alen * 0.25)
 	{
 		int new_alen, i;
@@ -286,35 +457,297 @@ static int mtc_fd_link_pop_iov(MtcFDLink *self, int n_bytes)
 
 static void mtc_fd_link_init_iov(MtcFDLink *self)
 {
-	self->iov.mem = (struct iovec *) 
-		mtc_alloc(sizeof(struct iovec) * MTC_IOV_MIN);
-	self->iov.alen = MTC_IOV_MIN;
+	self->iov.mem = NULL;
+	self->iov.alen = 0;
 	self->iov.start = 0;
 	self->iov.len = 0;
 	self->iov.clip = -1;
+	self->iov.size = 0;
 }
 
-//Schedules a message to be sent through the link.
-static void mtc_fd_link_queue
-	(MtcLink *link, MtcMsg *msg, int stop)
-{	
-	MtcFDLink *self = (MtcFDLink *) link;
+//Micro-batching
+
+//Closes the batching window. The caller must run the action hook.
+static void mtc_fd_link_batch_end(MtcFDLink *self)
+{
+	self->batch.holding = 0;
+	self->batch.timer.expires = -1;
+	self->batch.rearm = 1;
+}
+
+//Called after a message is queued, 
+//was_empty tells whether the queue was empty before.
+static void mtc_fd_link_batch_update(MtcFDLink *self, int was_empty)
+{
+	int64_t now = mtc_sta_get_time();
+	int64_t gap = now - self->batch.last_queued;
+	size_t max_bytes = self->batch.max_bytes;
+	
+	//Exponentially weighted average with weight 1/8. 
+	//Long pauses are clipped so that a burst reopens windows quickly.
+	if (gap > 2 * self->batch.max_delay)
+		gap = 2 * self->batch.max_delay;
+	self->batch.avg_gap += (gap - self->batch.avg_gap) / 8;
+	self->batch.last_queued = now;
+	
+	if (self->batch.holding)
+	{
+		if (max_bytes && self->iov.size >= max_bytes)
+			mtc_fd_link_batch_end(self);
+	}
+	else if (was_empty && (self->batch.avg_gap < self->batch.max_delay)
+		&& ((! max_bytes) || (self->iov.size < max_bytes)))
+	{
+		//Messages arrive often enough that more are likely to follow 
+		//within the window, hold this one back for them.
+		self->batch.holding = 1;
+		self->batch.timer.expires = now + self->batch.max_delay;
+		self->batch.rearm = 1;
+	}
+}
+
+//Completion of jobs
+
+//Releases a job that is sent or dropped. Jobs having a done function 
+//are kept until mtc_fd_link_notify_done(), as it can reenter the link.
+static void mtc_fd_link_job_finish
+	(MtcFDLink *self, MtcFDLinkSendJob *job, MtcFDLinkDoneStatus sent)
+{
+	if (! job->done)
+	{
+		mtc_msg_unref(job->msg);
+		mtc_free(job);
+		return;
+	}
+	
+	job->sent = sent;
+	job->next = NULL;
+	if (self->jobs.done_head)
+		self->jobs.done_tail->next = job;
+	else
+		self->jobs.done_head = job;
+	self->jobs.done_tail = job;
+}
+
+//Calls done functions of finished jobs
+static void mtc_fd_link_notify_done(MtcFDLink *self)
+{
+	MtcLink *link = (MtcLink *) self;
+	MtcFDLinkSendJob *job;
+	
+	if (! self->jobs.done_head)
+		return;
+	
+	mtc_link_ref(link);
+	while ((job = self->jobs.done_head))
+	{
+		self->jobs.done_head = job->next;
+		if (! job->next)
+			self->jobs.done_tail = NULL;
+		
+		(* job->done)(link, job->msg, job->sent, job->done_data);
+		mtc_msg_unref(job->msg);
+		mtc_free(job);
+	}
+	mtc_link_unref(link);
+}
+
+//Dropping queued jobs
+
+/* A job can be dropped only while none of it is sent. The head job may 
+ * be partially sent, and is never dropped. Jobs with stop flag are 
+ * never dropped either, as the other side waits for them.
+ */
+#define mtc_fd_link_job_can_drop(self, job) \
+	(((job) != (self)->jobs.head) && (! (job)->stop_flag))
+
+//Removes a job that can be dropped. prev is the job before it, 
+//offset is the position of its first block in the IO vector.
+static void mtc_fd_link_drop_job(MtcFDLink *self, 
+	MtcFDLinkSendJob *prev, MtcFDLinkSendJob *job, int offset)
+{
+	struct iovec *vector = self->iov.mem + self->iov.start + offset;
+	int n_blocks = job->n_blocks;
+	int i;
+	size_t size = 0;
+	
+	//Remove the blocks from the IO vector
+	for (i = 0; i < n_blocks; i++)
+		size += vector[i].iov_len;
+	for (i = offset + n_blocks; i < self->iov.len; i++)
+		self->iov.mem[self->iov.start + i - n_blocks] 
+			= self->iov.mem[self->iov.start + i];
+	self->iov.len -= n_blocks;
+	self->iov.size -= size;
+	mtc_fd_link_count_unsent(sub, size);
+	if (self->iov.clip > offset)
+		self->iov.clip -= n_blocks;
+	
+	//Unlink the job
+	prev->next = job->next;
+	if (self->jobs.tail == job)
+		self->jobs.tail = prev;
+	
+	mtc_fd_link_job_finish(self, job, MTC_FD_LINK_DONE_DROPPED);
+}
+
+//Drops the oldest job that can be dropped. Returns 0 if there is none.
+static int mtc_fd_link_drop_oldest(MtcFDLink *self)
+{
+	MtcFDLinkSendJob *prev, *iter;
+	int offset;
+	
+	if (! self->jobs.head)
+		return 0;
+	
+	prev = self->jobs.head;
+	offset = prev->n_blocks;
+	for (iter = prev->next; iter; prev = iter, iter = iter->next)
+	{
+		if (mtc_fd_link_job_can_drop(self, iter))
+		{
+			mtc_fd_link_drop_job(self, prev, iter, offset);
+			self->jobs.stats.n_dropped++;
+			return 1;
+		}
+		offset += iter->n_blocks;
+	}
+	
+	return 0;
+}
+
+//Drops the job with the given key, if any
+static void mtc_fd_link_drop_key(MtcFDLink *self, uint32_t key)
+{
+	MtcFDLinkSendJob *prev, *iter;
+	int offset;
+	
+	if (! self->jobs.head)
+		return;
+	
+	prev = self->jobs.head;
+	offset = prev->n_blocks;
+	for (iter = prev->next; iter; prev = iter, iter = iter->next)
+	{
+		if (iter->key == key && mtc_fd_link_job_can_drop(self, iter))
+		{
+			mtc_fd_link_drop_job(self, prev, iter, offset);
+			self->jobs.stats.n_coalesced++;
+			return;
+		}
+		offset += iter->n_blocks;
+	}
+}
+
+//Drops all expired jobs and recalculates next_expiry
+static void mtc_fd_link_drop_expired(MtcFDLink *self, int64_t now)
+{
+	MtcFDLinkSendJob *prev, *iter, *next;
+	int offset;
+	
+	self->jobs.next_expiry = -1;
+	if (! self->jobs.head)
+		return;
 	
+	prev = self->jobs.head;
+	offset = prev->n_blocks;
+	for (iter = prev->next; iter; iter = next)
+	{
+		next = iter->next;
+		
+		if (iter->expires >= 0 && iter->expires <= now 
+			&& mtc_fd_link_job_can_drop(self, iter))
+		{
+			mtc_fd_link_drop_job(self, prev, iter, offset);
+			self->jobs.stats.n_expired++;
+			continue;
+		}
+		
+		if (iter->expires >= 0 && (self->jobs.next_expiry < 0 
+			|| iter->expires < self->jobs.next_expiry))
+			self->jobs.next_expiry = iter->expires;
+		
+		offset += iter->n_blocks;
+		prev = iter;
+	}
+}
+
+//Drops expired jobs if any has expired. 
+//Cheap when none has, as the earliest expiry is kept.
+static void mtc_fd_link_check_expiry(MtcFDLink *self)
+{
+	if (self->jobs.next_expiry >= 0)
+	{
+		int64_t now = mtc_sta_get_time();
+		
+		if (now >= self->jobs.next_expiry)
+			mtc_fd_link_drop_expired(self, now);
+	}
+}
+
+//Schedules a message to be sent through the link.
+static void mtc_fd_link_queue_full
+	(MtcFDLink *self, MtcMsg *msg, int stop, 
+	const MtcFDLinkQueueOpts *opts)
+{
 	MtcFDLinkSendJob *job;
 	MtcMBlock *blocks;
 	uint32_t n_blocks;
 	uint32_t hdr_len; 
 	uint32_t i;
 	struct iovec *iov;
-	
-	mtc_msg_ref(msg);
+	size_t size = 0;
+	int was_empty = ! self->iov.len;
 	
 	//Get the data to be sent
 	n_blocks = mtc_msg_get_n_blocks(msg);
 	blocks = mtc_msg_get_blocks(msg);
+	hdr_len = mtc_header_sizeof(n_blocks);
+	
+	//Also prune here, a stalled link never gets to send
+	mtc_fd_link_check_expiry(self);
+	
+	//Apply queue policy
+	if (! stop)
+	{
+		if (self->jobs.policy == MTC_FD_LINK_QUEUE_COALESCE)
+		{
+			if (opts && opts->key)
+				mtc_fd_link_drop_key(self, opts->key);
+		}
+		else if (self->jobs.policy != MTC_FD_LINK_QUEUE_KEEP_ALL)
+		{
+			size_t msg_size = hdr_len;
+			
+			for (i = 0; i < n_blocks; i++)
+				msg_size += blocks[i].size;
+			
+			if (self->jobs.policy == MTC_FD_LINK_QUEUE_DROP_NEWEST)
+			{
+				if (self->iov.size && self->iov.size + msg_size 
+					> self->jobs.limit)
+				{
+					self->jobs.stats.n_dropped++;
+					if (opts && opts->done)
+						(* opts->done)((MtcLink *) self, msg, 
+							MTC_FD_LINK_DONE_DROPPED, opts->data);
+					return;
+				}
+			}
+			else
+			{
+				while (self->iov.size + msg_size > self->jobs.limit)
+				{
+					if (! mtc_fd_link_drop_oldest(self))
+						break;
+				}
+			}
+		}
+	}
+	
+	mtc_msg_ref(msg);
 	
 	//Allocate a new structure...
-	hdr_len = mtc_header_sizeof(n_blocks);
 	job = (MtcFDLinkSendJob *) mtc_alloc
 		(sizeof(MtcFDLinkSendJob) - sizeof(MtcHeaderBuf) + hdr_len);
 	
@@ -328,18 +761,40 @@ static void mtc_fd_link_queue
 	job->msg = msg;
 	job->stop_flag = stop ? 1 : 0;
 	job->n_blocks = n_blocks + 1;
+	job->expires = -1;
+	job->key = 0;
+	job->done = NULL;
+	job->done_data = NULL;
+	job->sent = MTC_FD_LINK_DONE_DROPPED;
+	if (opts)
+	{
+		if (opts->ttl > 0)
+		{
+			job->expires = mtc_sta_get_time() + opts->ttl;
+			if (self->jobs.next_expiry < 0 
+				|| job->expires < self->jobs.next_expiry)
+				self->jobs.next_expiry = job->expires;
+		}
+		job->key = opts->key;
+		job->done = opts->done;
+		job->done_data = opts->data;
+	}
 	mtc_header_write(&(job->hdr), blocks, n_blocks, stop);
 	
 	//Fill data into IOV
 	iov = mtc_fd_link_alloc_iov(self, n_blocks + 1);
 	iov[0].iov_base = &(job->hdr);
 	iov[0].iov_len = hdr_len;
+	size += hdr_len;
 	iov++;
 	for (i = 0; i < n_blocks; i++)
 	{
 		iov[i].iov_base = blocks[i].mem;
 		iov[i].iov_len = blocks[i].size;
+		size += blocks[i].size;
 	}
+	self->iov.size += size;
+	mtc_fd_link_count_unsent(add, size);
 	
 	//Setup stop
 	if (stop)
@@ -347,6 +802,18 @@ static void mtc_fd_link_queue
 		if (self->iov.clip < 0)
 			self->iov.clip = self->iov.len;
 	}
+	
+	if (self->batch.max_delay > 0)
+		mtc_fd_link_batch_update(self, was_empty);
+	
+	//For jobs dropped to make room
+	mtc_fd_link_notify_done(self);
+}
+
+static void mtc_fd_link_queue
+	(MtcLink *link, MtcMsg *msg, int stop)
+{
+	mtc_fd_link_queue_full((MtcFDLink *) link, msg, stop, NULL);
 }
 
 //Determines whether link has any unsent data.
@@ -360,12 +827,11 @@ static int mtc_fd_link_has_unsent_data(MtcLink *link)
 		return 0;
 }
 
-//Tries to send all queued data
-static MtcLinkIOStatus mtc_fd_link_send(MtcLink *link)
+//Writes queued data to a stream. Returns MTC_LINK_IO_OK if some data 
+//could be written.
+static MtcLinkIOStatus mtc_fd_link_write_stream
+	(MtcFDLink *self, int *blocks_out)
 {
-	MtcFDLink *self = (MtcFDLink *) link;
-	
-	int blocks_out = 0;
 	ssize_t bytes_out;
 	int repeat_count;
 	
@@ -404,12 +870,118 @@ static MtcLinkIOStatus mtc_fd_link_send(MtcLink *link)
 			}
 		}
 		else
-			blocks_out += mtc_fd_link_pop_iov(self, bytes_out);
+			*blocks_out += mtc_fd_link_pop_iov(self, bytes_out);
 		
 		if (! repeat)
 			break;
 	}
 	
+	return MTC_LINK_IO_OK;
+}
+
+//Writes queued messages as one packet each. The socket sends each 
+//packet atomically, so jobs are never partially sent.
+static MtcLinkIOStatus mtc_fd_link_write_packets
+	(MtcFDLink *self, int *blocks_out)
+{
+	MtcFDLinkSendJob *job = self->jobs.head;
+	int n_blocks, offset = 0, repeat_count;
+	
+	n_blocks = self->iov.clip >= 0 ? self->iov.clip : self->iov.len;
+	
+	for (repeat_count = 0; job && offset < n_blocks; repeat_count++)
+	{
+		struct iovec *vector = self->iov.mem + self->iov.start;
+		size_t bytes_out = 0;
+		int n_packets = 0, n_popped, res;
+		
+#ifdef HAVE_SENDMMSG
+		struct mmsghdr packets[MTC_MMSG_MAX];
+		int i;
+		
+		//Collect as many packets as we can send at once
+		for (; job && offset < n_blocks && n_packets < MTC_MMSG_MAX; 
+			job = job->next, n_packets++)
+		{
+			memset(packets + n_packets, 0, sizeof(struct mmsghdr));
+			packets[n_packets].msg_hdr.msg_iov = vector + offset;
+			packets[n_packets].msg_hdr.msg_iovlen = job->n_blocks;
+			offset += job->n_blocks;
+		}
+		
+		res = sendmmsg(self->out_fd, packets, n_packets, 0);
+		
+		for (i = 0; i < res; i++)
+			bytes_out += packets[i].msg_len;
+#else
+		struct msghdr packet;
+		ssize_t packet_len;
+		
+		memset(&packet, 0, sizeof(struct msghdr));
+		packet.msg_iov = vector + offset;
+		packet.msg_iovlen = job->n_blocks;
+		offset += job->n_blocks;
+		job = job->next;
+		n_packets = 1;
+		
+		packet_len = sendmsg(self->out_fd, &packet, 0);
+		res = packet_len < 0 ? -1 : 1;
+		if (packet_len > 0)
+			bytes_out = packet_len;
+#endif
+		
+		//Handle errors
+		if (res < 0)
+		{
+			if (! repeat_count)
+			{
+				if (MTC_IO_TEMP_ERROR(errno))
+					return MTC_LINK_IO_TEMP;
+				else
+					return MTC_LINK_IO_FAIL;
+			}
+			break;
+		}
+		
+		//Sent packets occupy whole jobs, so the IO vector 
+		//stays in sync with the job list.
+		n_popped = mtc_fd_link_pop_iov(self, bytes_out);
+		*blocks_out += n_popped;
+		
+		//Popped blocks are gone from the front of the IO vector
+		n_blocks -= n_popped;
+		offset = 0;
+		
+		if (res < n_packets)
+			break;
+	}
+	
+	return MTC_LINK_IO_OK;
+}
+
+//Tries to send all queued data
+static MtcLinkIOStatus mtc_fd_link_send(MtcLink *link)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	
+	int blocks_out = 0;
+	MtcLinkIOStatus write_res;
+	
+	//Do not send stale data
+	mtc_fd_link_check_expiry(self);
+	
+	//Write out the data
+	if (self->packet)
+		write_res = mtc_fd_link_write_packets(self, &blocks_out);
+	else
+		write_res = mtc_fd_link_write_stream(self, &blocks_out);
+	
+	if (write_res != MTC_LINK_IO_OK)
+	{
+		mtc_fd_link_notify_done(self);
+		return write_res;
+	}
+	
 	//Garbage collection
 	{
 		MtcFDLinkSendJob *iter, *next;
@@ -421,8 +993,7 @@ static MtcLinkIOStatus mtc_fd_link_send(MtcLink *link)
 				break;
 			
 			blocks_out -= iter->n_blocks;
-			mtc_msg_unref(iter->msg);
-			mtc_free(iter);
+			mtc_fd_link_job_finish(self, iter, MTC_FD_LINK_DONE_SENT);
 		}
 		
 		self->jobs.head = iter;
@@ -454,15 +1025,196 @@ static MtcLinkIOStatus mtc_fd_link_send(MtcLink *link)
 		else
 			self->iov.clip = -1;
 		
-		return MTC_LINK_IO_STOP;
+		write_res = MTC_LINK_IO_STOP;
 	}
 	else if (self->jobs.head)
-		return MTC_LINK_IO_TEMP;
+		write_res = MTC_LINK_IO_TEMP;
 	else
-		return MTC_LINK_IO_OK;
+	{
+		//Queue flushed, a cork holds off sending again
+		self->cork_bypass = 0;
+		write_res = MTC_LINK_IO_OK;
+	}
+	
+	mtc_fd_link_notify_done(self);
+	
+	return write_res;
 }
 
-//Tries to receive a message or a signal.
+//Peeks at the next packet, returns its size.
+static ssize_t mtc_fd_link_peek_packet(MtcFDLink *self, void *mem, size_t len)
+{
+	struct msghdr packet;
+	struct iovec vector;
+	
+	vector.iov_base = mem;
+	vector.iov_len = len;
+	memset(&packet, 0, sizeof(struct msghdr));
+	packet.msg_iov = &vector;
+	packet.msg_iovlen = 1;
+	
+	return recvmsg(self->in_fd, &packet, MSG_PEEK | MSG_TRUNC);
+}
+
+//Receives a whole message in one packet. The packet is sized by peeking 
+//at it, so that it can be read straight into the message blocks.
+static MtcLinkIOStatus mtc_fd_link_receive_packet
+	(MtcFDLink *self, MtcLinkInData *data)
+{
+	MtcHeaderData *header = &(self->header_data);
+	struct iovec single_vector[2], *vector;
+	struct msghdr packet;
+	uint32_t *sizes = NULL;
+	size_t hdr_len, msg_len;
+	ssize_t packet_len;
+	MtcMBlock *blocks;
+	uint32_t i;
+	
+	//Peek at the header, and get size of the packet
+	packet_len = mtc_fd_link_peek_packet
+		(self, &(self->header), sizeof(MtcHeaderBuf));
+	if (packet_len < 0)
+	{
+		if (MTC_IO_TEMP_ERROR(errno))
+			return MTC_LINK_IO_TEMP;
+		else
+			return MTC_LINK_IO_FAIL;
+	}
+	else if (packet_len == 0)
+		return MTC_LINK_IO_FAIL;
+	
+	if (packet_len < mtc_header_min_size 
+		|| (! mtc_header_read(&(self->header), header)))
+	{
+		mtc_warn("Invalid header on link %p, breaking the link.",
+		         self);
+		return MTC_LINK_IO_FAIL;
+	}
+	
+	if (! header->data_1)
+	{
+		mtc_warn("Size of main memory block is zero "
+				 "for message received on link %p, breaking link",
+				 self);
+		return MTC_LINK_IO_FAIL;
+	}
+	
+	hdr_len = mtc_header_sizeof(header->size);
+	if (hdr_len > (size_t) packet_len
+		|| (self->iov.ulim > 0 
+			&& header->size >= (uint32_t) self->iov.ulim))
+	{
+		mtc_warn("Block count %ld in header received on link %p "
+		         "does not fit the packet, breaking link.",
+		         (long) header->size, self);
+		return MTC_LINK_IO_FAIL;
+	}
+	msg_len = hdr_len + header->data_1;
+	vector = single_vector;
+	
+	if (header->size != 1)
+	{
+		//Allocate memory for the IO vector followed by the header
+		size_t alloc_size = (header->size + 1) * sizeof(struct iovec)
+			+ hdr_len;
+		self->mem = mtc_tryalloc(alloc_size);
+		if (! self->mem)
+		{
+			mtc_warn("Memory allocation failed for %ld bytes "
+					 "for message received on link %p, breaking link",
+					 (long) alloc_size, self);
+			return MTC_LINK_IO_FAIL;
+		}
+		vector = (struct iovec *) self->mem;
+		
+		//Peek again to get the block size index
+		vector->iov_base = vector + header->size + 1;
+		vector->iov_len = hdr_len;
+		if (mtc_fd_link_peek_packet(self, vector->iov_base, hdr_len)
+			!= packet_len)
+			goto fail;
+		
+		//Byte order conversion
+		sizes = (uint32_t *) MTC_PTR_ADD(vector->iov_base, 
+			mtc_header_sizeof(1));
+		for (i = 0; i < header->size - 1; i++)
+		{
+			sizes[i] = mtc_uint32_from_le(sizes[i]);
+			if (! sizes[i])
+			{
+				mtc_warn("In block size index received on link %p, "
+				         "element %ld has value 0, breaking link.",
+				         self, (long) i);
+				goto fail;
+			}
+			msg_len += sizes[i];
+		}
+	}
+	else
+	{
+		vector->iov_base = &(self->header);
+		vector->iov_len = hdr_len;
+	}
+	
+	if (msg_len != (size_t) packet_len)
+	{
+		mtc_warn("Packet size does not match message size "
+		         "on link %p, breaking link.", self);
+		goto fail;
+	}
+	
+	//Create the message
+	self->msg = mtc_msg_try_new_allocd
+		(header->data_1, header->size - 1, sizes);
+	if (! self->msg)
+	{
+		mtc_warn("Failed to allocate message structure "
+		         "for message received on link %p, breaking link.",
+		         self);
+		goto fail;
+	}
+	
+	//Receive the packet straight into message blocks
+	blocks = mtc_msg_get_blocks(self->msg);
+	for (i = 0; i < header->size; i++)
+	{
+		vector[i + 1].iov_base = blocks[i].mem;
+		vector[i + 1].iov_len = blocks[i].size;
+	}
+	memset(&packet, 0, sizeof(struct msghdr));
+	packet.msg_iov = vector;
+	packet.msg_iovlen = header->size + 1;
+	
+	if (recvmsg(self->in_fd, &packet, 0) != packet_len)
+		goto fail;
+	
+	//Return data
+	if (self->mem)
+	{
+		mtc_free(self->mem);
+		self->mem = NULL;
+	}
+	data->msg = self->msg;
+	data->stop = header->stop;
+	self->msg = NULL;
+	
+	return MTC_LINK_IO_OK;
+	
+fail:
+	if (self->mem)
+	{
+		mtc_free(self->mem);
+		self->mem = NULL;
+	}
+	if (self->msg)
+	{
+		mtc_msg_unref(self->msg);
+		self->msg = NULL;
+	}
+	return MTC_LINK_IO_FAIL;
+}
+
+//Tries to receive a message or a signal.
 static MtcLinkIOStatus mtc_fd_link_receive
 	(MtcLink *link, MtcLinkInData *data)
 {
@@ -471,6 +1223,9 @@ static MtcLinkIOStatus mtc_fd_link_receive
 	MtcHeaderData *header = &(self->header_data);
 	MtcMBlock *blocks;
 	
+	if (self->packet)
+		return mtc_fd_link_receive_packet(self, data);
+	
 	switch (self->read_status)
 	{
 	case MTC_FD_LINK_INIT_READ:
@@ -680,6 +1435,107 @@ static MtcLinkIOStatus mtc_fd_link_receive
 		return MTC_LINK_IO_TEMP;
 }
 
+//Queue for other threads
+
+static MtcFDLinkRemote *mtc_fd_link_remote_new(void)
+{
+	MtcFDLinkRemote *remote;
+	
+	remote = (MtcFDLinkRemote *) mtc_alloc(sizeof(MtcFDLinkRemote));
+	
+	atomic_init(&(remote->refcount), 1);
+	atomic_init(&(remote->closed), 0);
+	atomic_init(&(remote->head), NULL);
+	mtc_wakeup_init(&(remote->wakeup));
+	
+	return remote;
+}
+
+//Takes all pushed items, in the order they were pushed.
+static MtcFDLinkRemoteItem *mtc_fd_link_remote_take
+	(MtcFDLinkRemote *remote)
+{
+	MtcFDLinkRemoteItem *iter, *next, *res = NULL;
+	
+	iter = atomic_exchange(&(remote->head), NULL);
+	
+	//Reverse the list
+	for (; iter; iter = next)
+	{
+		next = iter->next;
+		iter->next = res;
+		res = iter;
+	}
+	
+	return res;
+}
+
+void mtc_fd_link_remote_ref(MtcFDLinkRemote *remote)
+{
+	atomic_fetch_add(&(remote->refcount), 1);
+}
+
+void mtc_fd_link_remote_unref(MtcFDLinkRemote *remote)
+{
+	if (atomic_fetch_sub(&(remote->refcount), 1) == 1)
+	{
+		MtcFDLinkRemoteItem *iter, *next;
+		
+		for (iter = mtc_fd_link_remote_take(remote); iter; iter = next)
+		{
+			next = iter->next;
+			mtc_msg_unref(iter->msg);
+			mtc_free(iter);
+		}
+		
+		mtc_wakeup_destroy(&(remote->wakeup));
+		
+		mtc_free(remote);
+	}
+}
+
+int mtc_fd_link_remote_queue
+	(MtcFDLinkRemote *remote, MtcMsg *msg, int stop)
+{
+	MtcFDLinkRemoteItem *item, *head;
+	
+	if (atomic_load(&(remote->closed)))
+		return -1;
+	
+	item = (MtcFDLinkRemoteItem *) mtc_alloc(sizeof(MtcFDLinkRemoteItem));
+	item->msg = msg;
+	item->stop = stop;
+	
+	head = atomic_load(&(remote->head));
+	do
+	{
+		item->next = head;
+	} while (! atomic_compare_exchange_weak(&(remote->head), &head, item));
+	
+	//Only the first item after the queue is drained wakes up the loop
+	if (! head)
+		mtc_wakeup_notify(&(remote->wakeup));
+	
+	return 0;
+}
+
+//Moves all messages from remote queue to the send queue
+static void mtc_fd_link_drain_remote(MtcFDLink *self)
+{
+	MtcFDLinkRemoteItem *iter, *next;
+	
+	mtc_wakeup_drain(&(self->remote->wakeup));
+	
+	for (iter = mtc_fd_link_remote_take(self->remote); iter; iter = next)
+	{
+		next = iter->next;
+		
+		mtc_link_queue((MtcLink *) self, iter->msg, iter->stop);
+		mtc_msg_unref(iter->msg);
+		mtc_free(iter);
+	}
+}
+
 //Event management
 
 /*RULES: 
@@ -691,6 +1547,9 @@ static MtcLinkIOStatus mtc_fd_link_receive
 #define define_out_idx \
 	int out_idx = (self->in_fd == self->out_fd ? 0 : 1)
 
+static void mtc_fd_link_action_hook(MtcLink *link);
+const static MtcLinkVTable mtc_fd_link_vtable;
+
 
 static void mtc_fd_link_calc_events
 	(MtcFDLink *self, int *events)
@@ -705,7 +1564,9 @@ static void mtc_fd_link_calc_events
 		events[0] |= MTC_POLLIN;
 	
 	if ((mtc_link_get_out_status(link) == MTC_LINK_STATUS_OPEN) 
-		&& (mtc_fd_link_has_unsent_data(link)))
+		&& (mtc_fd_link_has_unsent_data(link)) 
+		&& ((! self->corked) || self->cork_bypass) 
+		&& (! self->batch.holding))
 		events[out_idx] |= MTC_POLLOUT;
 }
 
@@ -724,6 +1585,21 @@ static void mtc_fd_link_event_source_event
 	
 	if (flags & MTC_EVENT_CHECK)
 	{	
+		if (self->tests[0].revents || self->tests[out_idx].revents)
+			self->last_active = mtc_sta_get_time();
+		
+		//End of batching window
+		if (self->batch.timer.fired && self->batch.holding)
+		{
+			mtc_fd_link_batch_end(self);
+			mtc_fd_link_action_hook(link);
+		}
+		
+		//Messages from other threads
+		if (self->remote && (self->tests[2].revents & MTC_POLLIN))
+			mtc_fd_link_drain_remote(self);
+		
+
 		//Sending
 		if (self->tests[out_idx].revents & (MTC_POLLOUT))
 		{
@@ -758,11 +1634,14 @@ static void mtc_fd_link_event_source_event
 				
 				if (status == MTC_LINK_IO_OK)
 				{
+					self->received = in_data.msg;
 					if (mtc_link_get_events_enabled(link))
 						if (ev->received)
 							(* ev->received) 
 								((MtcLink *) self, in_data, ev->data);
-					mtc_msg_unref(in_data.msg);
+					if (self->received)
+						mtc_msg_unref(self->received);
+					self->received = NULL;
 				}
 				else if (status == MTC_LINK_IO_FAIL)
 				{
@@ -825,8 +1704,9 @@ static void mtc_fd_link_action_hook(MtcLink *link)
 	mtc_fd_link_calc_events(self, events);
 	
 	if ((events[0] != self->tests[0].events) 
-		|| (events[1] != self->tests[1].events))
+		|| (events[1] != self->tests[1].events) || self->batch.rearm)
 	{
+		self->batch.rearm = 0;
 		if (mtc_link_get_events_enabled(link))
 		{
 			mtc_event_source_prepare((MtcEventSource *) source, NULL);
@@ -842,9 +1722,135 @@ static void mtc_fd_link_action_hook(MtcLink *link)
 	}
 }
 
-static void mtc_fd_link_init_event(MtcFDLink *self)
+//Links the tests in use into a list
+static void mtc_fd_link_chain_tests(MtcFDLink *self)
 {
 	define_out_idx;
+	MtcEventTest *last = (MtcEventTest *) (self->tests + out_idx);
+	
+	self->tests[0].parent.next = NULL;
+	self->tests[1].parent.next = NULL;
+	self->tests[2].parent.next = NULL;
+	
+	if (out_idx == 1)
+	{
+		self->tests[0].parent.next = (MtcEventTest *) (self->tests + 1);
+	}
+	
+	if (self->remote)
+	{
+		last->next = (MtcEventTest *) (self->tests + 2);
+		last = last->next;
+	}
+	
+	self->batch.timer.parent.next = NULL;
+	if (self->batch.max_delay > 0)
+	{
+		last->next = (MtcEventTest *) &(self->batch.timer);
+	}
+}
+
+//Polling without an event manager
+
+int mtc_fd_link_poll_fill(MtcLink *link, struct pollfd *fds)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	MtcEventTestPollFD *iter;
+	int n_fds = 0;
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	if (mtc_link_is_broken(link) || (! mtc_link_get_events_enabled(link)))
+		return 0;
+	
+	//Nobody else waits for this link, do not hold data back
+	if (self->batch.holding)
+	{
+		mtc_fd_link_batch_end(self);
+		mtc_fd_link_action_hook(link);
+	}
+	if (self->corked && (! self->cork_bypass))
+	{
+		self->cork_bypass = 1;
+		mtc_fd_link_action_hook(link);
+	}
+	
+	for (iter = self->tests; iter; 
+		iter = (MtcEventTestPollFD *) iter->parent.next)
+	{
+		if (! mtc_event_test_check_name
+			((MtcEventTest *) iter, MTC_EVENT_TEST_POLLFD))
+			continue;
+		if (! iter->events)
+			continue;
+		
+		fds[n_fds].fd = iter->fd;
+		fds[n_fds].events = 0;
+		if (iter->events & MTC_POLLIN)
+			fds[n_fds].events |= POLLIN;
+		if (iter->events & MTC_POLLOUT)
+			fds[n_fds].events |= POLLOUT;
+		fds[n_fds].revents = 0;
+		n_fds++;
+	}
+	
+	return n_fds;
+}
+
+void mtc_fd_link_poll_dispatch(MtcLink *link, struct pollfd *fds)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	MtcEventTestPollFD *iter;
+	int i = 0, any = 0;
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	if (mtc_link_is_broken(link) || (! mtc_link_get_events_enabled(link)))
+		return;
+	
+	//Same order as mtc_fd_link_poll_fill(), 
+	//errors are reported as readiness like libevent does
+	for (iter = self->tests; iter; 
+		iter = (MtcEventTestPollFD *) iter->parent.next)
+	{
+		short revents;
+		
+		if (! mtc_event_test_check_name
+			((MtcEventTest *) iter, MTC_EVENT_TEST_POLLFD))
+			continue;
+		if (! iter->events)
+			continue;
+		
+		revents = fds[i].revents;
+		if (revents & (POLLERR | POLLHUP | POLLNVAL))
+			revents |= POLLIN | POLLOUT;
+		
+		iter->revents = 0;
+		if ((revents & POLLIN) && (iter->events & MTC_POLLIN))
+			iter->revents |= MTC_POLLIN;
+		if ((revents & POLLOUT) && (iter->events & MTC_POLLOUT))
+			iter->revents |= MTC_POLLOUT;
+		if (iter->revents)
+			any = 1;
+		i++;
+	}
+	
+	if (! any)
+		return;
+	
+	mtc_link_ref(link);
+	mtc_fd_link_event_source_event
+		((MtcEventSource *) mtc_link_get_event_source(link), 
+		MTC_EVENT_CHECK);
+	for (i = 0; i < 3; i++)
+		self->tests[i].revents = 0;
+	mtc_link_unref(link);
+}
+
+static void mtc_fd_link_init_event(MtcFDLink *self)
+{
 	int events[2];
 	
 	//Initialize test data
@@ -853,12 +1859,9 @@ static void mtc_fd_link_init_event(MtcFDLink *self)
 		(self->tests + 0, self->in_fd, events[0]);
 	mtc_event_test_pollfd_init
 		(self->tests + 1, self->out_fd, events[1]);
-
+	mtc_event_test_timer_init(&(self->batch.timer), -1, 0);
 	
-	if (out_idx == 1)
-	{
-		self->tests[0].parent.next = (MtcEventTest *) self->tests + 1;
-	}
+	mtc_fd_link_chain_tests(self);
 }
 
 static void mtc_fd_link_finalize(MtcLink *link)
@@ -867,11 +1870,23 @@ static void mtc_fd_link_finalize(MtcLink *link)
 	MtcFDLinkSendJob *iter, *next;
 	
 	//Destroy IO vector and all jobs.
-	mtc_free(self->iov.mem);
+	mtc_fd_link_count_unsent(sub, self->iov.size);
+	mtc_fd_link_release_iov(self);
+	for (iter = self->jobs.done_head; iter; iter = next)
+	{
+		next = iter->next;
+		
+		(* iter->done)(link, iter->msg, iter->sent, iter->done_data);
+		mtc_msg_unref(iter->msg);
+		mtc_free(iter);
+	}
 	for (iter = self->jobs.head; iter; iter = next)
 	{
 		next = iter->next;
 		
+		//Exported jobs are marked as handed over
+		if (iter->done)
+			(* iter->done)(link, iter->msg, iter->sent, iter->done_data);
 		mtc_msg_unref(iter->msg);
 		mtc_free(iter);
 	}
@@ -890,6 +1905,14 @@ static void mtc_fd_link_finalize(MtcLink *link)
 		self->msg = NULL;
 	}
 	
+	//Detach the queue for other threads
+	if (self->remote)
+	{
+		atomic_store(&(self->remote->closed), 1);
+		mtc_fd_link_remote_unref(self->remote);
+		self->remote = NULL;
+	}
+	
 	//Close file descriptors
 	if (self->close_fd)
 	{
@@ -926,23 +1949,50 @@ MtcLink *mtc_fd_link_new(int out_fd, int in_fd)
 	self->out_fd = out_fd;
 	self->in_fd = in_fd;
 	self->close_fd = 0;
+	self->packet = 0;
+	self->last_active = mtc_sta_get_time();
+	self->corked = 0;
+	self->cork_bypass = 0;
+	self->batch.max_delay = 0;
+	self->batch.max_bytes = 0;
+	self->batch.avg_gap = 0;
+	self->batch.last_queued = self->last_active;
+	self->batch.holding = 0;
+	self->batch.rearm = 0;
 	
 	//Initialize sending data
 	mtc_fd_link_init_iov(self);
 	self->jobs.head = NULL;
 	self->jobs.tail = NULL;
+	self->jobs.policy = MTC_FD_LINK_QUEUE_KEEP_ALL;
+	self->jobs.limit = 0;
+	self->jobs.next_expiry = -1;
+	self->jobs.done_head = NULL;
+	self->jobs.done_tail = NULL;
+	memset(&(self->jobs.stats), 0, sizeof(MtcFDLinkQueueStats));
 	self->iov.ulim = sysconf(_SC_IOV_MAX);
 	
 	//Initialize reading data
 	self->read_status = MTC_FD_LINK_INIT_READ;
 	self->mem = self->msg = NULL;
+	self->received = NULL;
 	
 	//Initialize events
+	self->remote = NULL;
 	mtc_fd_link_init_event(self);
 	
 	return (MtcLink *) self;
 }
 
+MtcLink *mtc_fd_link_new_seqpacket(int fd)
+{
+	MtcFDLink *self = (MtcFDLink *) mtc_fd_link_new(fd, fd);
+	
+	self->packet = 1;
+	
+	return (MtcLink *) self;
+}
+
 int mtc_fd_link_get_out_fd(MtcLink *link)
 {
 	MtcFDLink *self = (MtcFDLink *) link;
@@ -983,3 +2033,618 @@ void mtc_fd_link_set_close_fd(MtcLink *link, int val)
 	self->close_fd = (val ? 1 : 0);
 }
 
+size_t mtc_fd_link_get_unsent_size(MtcLink *link)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	return self->iov.size;
+}
+
+void mtc_fd_link_cork(MtcLink *link)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	self->corked++;
+	if (self->corked == 1)
+		mtc_fd_link_action_hook(link);
+}
+
+void mtc_fd_link_uncork(MtcLink *link)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	if (self->corked <= 0)
+		mtc_error("mtc_fd_link_uncork() called on a link not corked");
+	
+	self->corked--;
+	if (! self->corked)
+		mtc_fd_link_action_hook(link);
+}
+
+void mtc_fd_link_set_batching
+	(MtcLink *link, int64_t max_delay, size_t max_bytes)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	MtcEventSource *source = (MtcEventSource *) 
+		mtc_link_get_event_source(link);
+	int enabled = mtc_link_get_events_enabled(link) 
+		&& (! mtc_link_is_broken(link));
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	if (enabled)
+		mtc_event_source_prepare(source, NULL);
+	
+	self->batch.max_delay = max_delay > 0 ? max_delay : 0;
+	self->batch.max_bytes = max_bytes;
+	self->batch.avg_gap = self->batch.max_delay;
+	mtc_fd_link_batch_end(self);
+	mtc_fd_link_chain_tests(self);
+	
+	if (enabled)
+		mtc_event_source_prepare(source, (MtcEventTest *) self->tests);
+	self->batch.rearm = 0;
+	
+	//Send anything that was held back
+	mtc_fd_link_action_hook(link);
+}
+
+void mtc_fd_link_queue_opts_init(MtcFDLinkQueueOpts *opts)
+{
+	memset(opts, 0, sizeof(MtcFDLinkQueueOpts));
+}
+
+void mtc_fd_link_queue_with_opts
+	(MtcLink *link, MtcMsg *msg, const MtcFDLinkQueueOpts *opts)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	mtc_fd_link_queue_full(self, msg, 0, opts);
+	mtc_fd_link_action_hook(link);
+}
+
+void mtc_fd_link_set_queue_policy
+	(MtcLink *link, MtcFDLinkQueuePolicy policy, size_t limit)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	self->jobs.policy = policy;
+	self->jobs.limit = limit;
+	
+	//Bring the queue within the new limit
+	if (policy == MTC_FD_LINK_QUEUE_DROP_OLDEST 
+		|| policy == MTC_FD_LINK_QUEUE_DROP_NEWEST)
+	{
+		while (self->iov.size > limit)
+		{
+			if (! mtc_fd_link_drop_oldest(self))
+				break;
+		}
+	}
+	
+	mtc_fd_link_notify_done(self);
+}
+
+void mtc_fd_link_get_queue_stats
+	(MtcLink *link, MtcFDLinkQueueStats *stats)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	*stats = self->jobs.stats;
+}
+
+int64_t mtc_fd_link_get_last_active(MtcLink *link)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	return self->last_active;
+}
+
+MtcMsg *mtc_fd_link_take_received(MtcLink *link)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	MtcMsg *res;
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	res = self->received;
+	self->received = NULL;
+	
+	return res;
+}
+
+size_t mtc_fd_link_get_total_unsent_size(void)
+{
+	return atomic_load_explicit
+		(&mtc_fd_link_total_unsent, memory_order_relaxed);
+}
+
+MtcFDLinkRemote *mtc_fd_link_get_remote(MtcLink *link)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	if (! self->remote)
+	{
+		MtcEventSource *source = (MtcEventSource *) 
+			mtc_link_get_event_source(link);
+		int enabled = mtc_link_get_events_enabled(link) 
+			&& (! mtc_link_is_broken(link));
+		
+		if (enabled)
+			mtc_event_source_prepare(source, NULL);
+		
+		self->remote = mtc_fd_link_remote_new();
+		mtc_event_test_pollfd_init
+			(self->tests + 2, self->remote->wakeup.fds[0], MTC_POLLIN);
+		mtc_fd_link_chain_tests(self);
+		
+		if (enabled)
+			mtc_event_source_prepare(source, (MtcEventTest *) self->tests);
+	}
+	
+	mtc_fd_link_remote_ref(self->remote);
+	
+	return self->remote;
+}
+
+void mtc_fd_link_privatize(MtcLink *link)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	MtcFDLinkSendJob *job;
+	struct iovec *vector;
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	vector = self->iov.mem + self->iov.start;
+	for (job = self->jobs.head; job; job = job->next)
+	{
+		MtcMsg *copy = mtc_sta_msg_dup(job->msg);
+		MtcMBlock *blocks = mtc_msg_get_blocks(job->msg);
+		MtcMBlock *copy_blocks = mtc_msg_get_blocks(copy);
+		unsigned int n_blocks = mtc_msg_get_n_blocks(job->msg);
+		unsigned int i, first;
+		
+		//Unsent blocks are at the end of the job, 
+		//the header is the first block and lives in the job itself.
+		first = n_blocks + 1 - job->n_blocks;
+		for (i = first; i <= n_blocks; i++, vector++)
+		{
+			size_t offset;
+			
+			if (i == 0)
+				continue;
+			
+			offset = (char *) vector->iov_base 
+				- (char *) blocks[i - 1].mem;
+			vector->iov_base = MTC_PTR_ADD(copy_blocks[i - 1].mem, offset);
+		}
+		
+		//The producer is told at once, the copy has no done function
+		if (job->done)
+		{
+			MtcFDLinkSendJob *orig = (MtcFDLinkSendJob *) mtc_alloc
+				(sizeof(MtcFDLinkSendJob) - sizeof(MtcHeaderBuf));
+			
+			orig->msg = job->msg;
+			orig->done = job->done;
+			orig->done_data = job->done_data;
+			mtc_fd_link_job_finish
+				(self, orig, MTC_FD_LINK_DONE_HANDED_OVER);
+			job->done = NULL;
+			job->done_data = NULL;
+		}
+		else
+			mtc_msg_unref(job->msg);
+		job->msg = copy;
+	}
+	
+	mtc_fd_link_notify_done(self);
+}
+
+//Exporting and importing state
+
+//Magic value for exported state
+#define MTC_FD_LINK_STATE_MAGIC "MTCL"
+
+//Size of fixed part of exported state
+#define MTC_FD_LINK_STATE_HDR_SIZE 16
+
+//Flags for exported state
+#define MTC_FD_LINK_STATE_PACKET 1
+#define MTC_FD_LINK_STATE_SPLIT 2
+
+static char *mtc_fd_link_put_u32(char *iter, uint32_t val)
+{
+	mtc_uint32_copy_to_le(iter, &val);
+	return iter + 4;
+}
+
+//Gets no. of bytes of the incoming message that are already read
+static size_t mtc_fd_link_get_prefix_len(MtcFDLink *self)
+{
+	MtcHeaderData *header = &(self->header_data);
+	MtcMBlock *blocks;
+	size_t res;
+	int i;
+	
+	switch (self->read_status)
+	{
+	case MTC_FD_LINK_HDR:
+		return mtc_header_min_size - self->reader.len;
+	case MTC_FD_LINK_SIMPLE:
+		return mtc_header_min_size + header->data_1 - self->reader.len;
+	case MTC_FD_LINK_IDX:
+		return mtc_header_sizeof(header->size) - self->reader.len;
+	case MTC_FD_LINK_DATA:
+		blocks = mtc_msg_get_blocks(self->msg);
+		res = mtc_header_sizeof(header->size);
+		for (i = 0; i < header->size; i++)
+			res += blocks[i].size;
+		for (i = 0; i < self->reader_v.n_blocks; i++)
+			res -= self->reader_v.blocks[i].iov_len;
+		return res;
+	default:
+		return 0;
+	}
+}
+
+//Writes the bytes of the incoming message that are already read
+static void mtc_fd_link_write_prefix
+	(MtcFDLink *self, char *dest, size_t len)
+{
+	MtcHeaderData *header = &(self->header_data);
+	MtcMBlock *blocks;
+	uint32_t i;
+	size_t part;
+	
+	//The header as it was read
+	part = len < mtc_header_min_size ? len : mtc_header_min_size;
+	memcpy(dest, &(self->header), part);
+	dest += part;
+	len -= part;
+	
+	if (self->read_status == MTC_FD_LINK_IDX)
+	{
+		//Block size index is still in little endian
+		memcpy(dest, self->mem, len);
+		return;
+	}
+	
+	if (! self->msg)
+		return;
+	
+	blocks = mtc_msg_get_blocks(self->msg);
+	if (self->read_status == MTC_FD_LINK_DATA)
+	{
+		//Block size index, from the message
+		for (i = 1; i < header->size; i++)
+		{
+			dest = mtc_fd_link_put_u32(dest, blocks[i].size);
+			len -= 4;
+		}
+	}
+	
+	//Message data read so far
+	for (i = 0; len > 0; i++)
+	{
+		part = len < blocks[i].size ? len : blocks[i].size;
+		memcpy(dest, blocks[i].mem, part);
+		dest += part;
+		len -= part;
+	}
+}
+
+void *mtc_fd_link_export(MtcLink *link, size_t *len)
+{
+	MtcFDLink *self = (MtcFDLink *) link;
+	MtcFDLinkSendJob *job;
+	struct iovec *vector;
+	size_t prefix_len, res_len;
+	uint32_t n_jobs = 0, flags = 0;
+	char *res, *iter;
+	unsigned int i;
+	
+	if (link->vtable != &mtc_fd_link_vtable)
+		mtc_error("%p is not MtcFDLink", link);
+	
+	if (mtc_link_is_broken(link)
+		|| (mtc_link_get_in_status(link) != MTC_LINK_STATUS_OPEN)
+		|| (mtc_link_get_out_status(link) != MTC_LINK_STATUS_OPEN))
+		return NULL;
+	
+	//Messages from other threads go with the link
+	if (self->remote)
+		mtc_fd_link_drain_remote(self);
+	
+	//Calculate size
+	prefix_len = self->packet ? 0 : mtc_fd_link_get_prefix_len(self);
+	res_len = MTC_FD_LINK_STATE_HDR_SIZE + prefix_len;
+	vector = self->iov.mem + self->iov.start;
+	for (job = self->jobs.head; job; job = job->next)
+	{
+		res_len += 8;
+		for (i = 0; i < job->n_blocks; i++, vector++)
+			res_len += vector->iov_len;
+		n_jobs++;
+	}
+	
+	if (self->packet)
+		flags |= MTC_FD_LINK_STATE_PACKET;
+	if (self->in_fd != self->out_fd)
+		flags |= MTC_FD_LINK_STATE_SPLIT;
+	
+	//Write
+	iter = res = (char *) mtc_alloc(res_len);
+	memcpy(iter, MTC_FD_LINK_STATE_MAGIC, 4);
+	iter += 4;
+	iter = mtc_fd_link_put_u32(iter, flags);
+	iter = mtc_fd_link_put_u32(iter, prefix_len);
+	iter = mtc_fd_link_put_u32(iter, n_jobs);
+	
+	mtc_fd_link_write_prefix(self, iter, prefix_len);
+	iter += prefix_len;
+	
+	vector = self->iov.mem + self->iov.start;
+	for (job = self->jobs.head; job; job = job->next)
+	{
+		uint32_t job_len = 0;
+		
+		for (i = 0; i < job->n_blocks; i++)
+			job_len += vector[i].iov_len;
+		
+		iter = mtc_fd_link_put_u32(iter, job->stop_flag);
+		iter = mtc_fd_link_put_u32(iter, job_len);
+		for (i = 0; i < job->n_blocks; i++, vector++)
+		{
+			memcpy(iter, vector->iov_base, vector->iov_len);
+			iter += vector->iov_len;
+		}
+		
+		//Sent by the importing process, reported when destroyed
+		job->sent = MTC_FD_LINK_DONE_HANDED_OVER;
+	}
+	
+	*len = res_len;
+	return res;
+}
+
+//Queues data that already contains the header.
+static void mtc_fd_link_queue_raw
+	(MtcFDLink *self, const void *data, size_t len, int stop)
+{
+	MtcFDLinkSendJob *job;
+	MtcMBlock *blocks;
+	struct iovec *iov;
+	
+	job = (MtcFDLinkSendJob *) mtc_alloc
+		(sizeof(MtcFDLinkSendJob) - sizeof(MtcHeaderBuf));
+	job->msg = mtc_msg_try_new_allocd(len, 0, NULL);
+	if (! job->msg)
+		mtc_error("Failed to allocate message structure");
+	blocks = mtc_msg_get_blocks(job->msg);
+	memcpy(blocks->mem, data, len);
+	
+	if (self->jobs.head)
+		self->jobs.tail->next = job;
+	else 
+		self->jobs.head = job;
+	self->jobs.tail = job;
+	job->next = NULL;
+	job->stop_flag = stop ? 1 : 0;
+	job->n_blocks = 1;
+	job->expires = -1;
+	job->key = 0;
+	job->done = NULL;
+	job->done_data = NULL;
+	job->sent = MTC_FD_LINK_DONE_DROPPED;
+	
+	iov = mtc_fd_link_alloc_iov(self, 1);
+	iov->iov_base = blocks->mem;
+	iov->iov_len = len;
+	self->iov.size += len;
+	mtc_fd_link_count_unsent(add, len);
+	
+	if (stop)
+	{
+		if (self->iov.clip < 0)
+			self->iov.clip = self->iov.len;
+	}
+}
+
+//Restores the reading state from the bytes of the incoming message 
+//that are already read. Returns -1 if they are invalid.
+static int mtc_fd_link_restore_prefix
+	(MtcFDLink *self, const char *prefix, size_t len)
+{
+	MtcHeaderData *header = &(self->header_data);
+	MtcMBlock *blocks;
+	struct iovec *vector;
+	uint32_t *sizes, i;
+	size_t bsi_len;
+	
+	if (len == 0)
+		return 0;
+	
+	//Header
+	if (len < mtc_header_min_size)
+	{
+		memcpy(&(self->header), prefix, len);
+		mtc_reader_init(&(self->reader),
+			MTC_PTR_ADD(&(self->header), len), 
+			mtc_header_min_size - len, self->in_fd);
+		self->read_status = MTC_FD_LINK_HDR;
+		return 0;
+	}
+	
+	memcpy(&(self->header), prefix, mtc_header_min_size);
+	if ((! mtc_header_read(&(self->header), header)) || (! header->data_1))
+		return -1;
+	prefix += mtc_header_min_size;
+	len -= mtc_header_min_size;
+	
+	//Message with only main block
+	if (header->size == 1)
+	{
+		if (len >= header->data_1)
+			return -1;
+		
+		self->msg = mtc_msg_try_new_allocd(header->data_1, 0, NULL);
+		if (! self->msg)
+			return -1;
+		
+		blocks = mtc_msg_get_blocks(self->msg);
+		memcpy(blocks->mem, prefix, len);
+		mtc_reader_init(&(self->reader), 
+			MTC_PTR_ADD(blocks->mem, len), blocks->size - len, 
+			self->in_fd);
+		self->read_status = MTC_FD_LINK_SIMPLE;
+		return 0;
+	}
+	
+	//Block size index
+	self->mem = mtc_tryalloc(header->size * sizeof(struct iovec));
+	if (! self->mem)
+		return -1;
+	
+	bsi_len = sizeof(uint32_t) * (header->size - 1);
+	if (len < bsi_len)
+	{
+		memcpy(self->mem, prefix, len);
+		mtc_reader_init(&(self->reader), 
+			MTC_PTR_ADD(self->mem, len), bsi_len - len, self->in_fd);
+		self->read_status = MTC_FD_LINK_IDX;
+		return 0;
+	}
+	
+	memcpy(self->mem, prefix, bsi_len);
+	sizes = (uint32_t *) self->mem;
+	for (i = 0; i < header->size - 1; i++)
+	{
+		sizes[i] = mtc_uint32_from_le(sizes[i]);
+		if (! sizes[i])
+			return -1;
+	}
+	prefix += bsi_len;
+	len -= bsi_len;
+	
+	//Message data
+	self->msg = mtc_msg_try_new_allocd
+		(header->data_1, header->size - 1, sizes);
+	if (! self->msg)
+		return -1;
+	
+	vector = (struct iovec *) self->mem;
+	blocks = mtc_msg_get_blocks(self->msg);
+	for (i = 0; i < header->size; i++)
+	{
+		vector[i].iov_base = blocks[i].mem;
+		vector[i].iov_len = blocks[i].size;
+	}
+	
+	//Skip over the data already read
+	for (i = 0; len >= vector->iov_len; i++, vector++)
+	{
+		if (i == header->size - 1)
+			return -1;
+		
+		memcpy(vector->iov_base, prefix, vector->iov_len);
+		prefix += vector->iov_len;
+		len -= vector->iov_len;
+	}
+	memcpy(vector->iov_base, prefix, len);
+	vector->iov_base = MTC_PTR_ADD(vector->iov_base, len);
+	vector->iov_len -= len;
+	
+	mtc_reader_v_init(&(self->reader_v), vector, header->size - i, 
+		self->in_fd);
+	self->read_status = MTC_FD_LINK_DATA;
+	
+	return 0;
+}
+
+MtcLink *mtc_fd_link_import
+	(const void *state, size_t len, int out_fd, int in_fd)
+{
+	const char *iter = (const char *) state, *lim = iter + len;
+	uint32_t flags, prefix_len, n_jobs, stop, job_len, i;
+	MtcFDLink *self;
+	
+	if (len < MTC_FD_LINK_STATE_HDR_SIZE 
+		|| memcmp(iter, MTC_FD_LINK_STATE_MAGIC, 4) != 0)
+		return NULL;
+	
+	mtc_uint32_copy_from_le(iter + 4, &flags);
+	mtc_uint32_copy_from_le(iter + 8, &prefix_len);
+	mtc_uint32_copy_from_le(iter + 12, &n_jobs);
+	iter += MTC_FD_LINK_STATE_HDR_SIZE;
+	
+	if (((flags & MTC_FD_LINK_STATE_SPLIT) ? 1 : 0) != (in_fd != out_fd))
+		return NULL;
+	if (prefix_len > lim - iter)
+		return NULL;
+	
+	if (flags & MTC_FD_LINK_STATE_PACKET)
+		self = (MtcFDLink *) mtc_fd_link_new_seqpacket(in_fd);
+	else
+		self = (MtcFDLink *) mtc_fd_link_new(out_fd, in_fd);
+	
+	//Reading state
+	if (prefix_len && (self->packet 
+		|| mtc_fd_link_restore_prefix(self, iter, prefix_len) < 0))
+		goto fail;
+	iter += prefix_len;
+	
+	//Unsent data
+	for (i = 0; i < n_jobs; i++)
+	{
+		if (lim - iter < 8)
+			goto fail;
+		mtc_uint32_copy_from_le(iter, &stop);
+		mtc_uint32_copy_from_le(iter + 4, &job_len);
+		iter += 8;
+		
+		if ((! job_len) || job_len > lim - iter)
+			goto fail;
+		mtc_fd_link_queue_raw(self, iter, job_len, stop);
+		iter += job_len;
+	}
+	
+	if (iter != lim)
+		goto fail;
+	
+	mtc_fd_link_action_hook((MtcLink *) self);
+	self->close_fd = 1;
+	
+	return (MtcLink *) self;
+	
+fail:
+	mtc_link_unref((MtcLink *) self);
+	return NULL;
+}
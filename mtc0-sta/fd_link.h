@@ -42,6 +42,16 @@ int mtc_fd_set_blocking(int fd, int val);
  */
 MtcLink *mtc_fd_link_new(int out_fd, int in_fd);
 
+/**Creates a new link that works with a socket preserving message 
+ * boundaries, such as a SOCK_SEQPACKET Unix domain socket.
+ * Every message is sent as a single packet and received with 
+ * a single read, instead of reading the header and the data separately.
+ * The peer must be using this kind of link too.
+ * \param fd The socket
+ * \return A new link.
+ */
+MtcLink *mtc_fd_link_new_seqpacket(int fd);
+
 /**Gets the file descriptor used for sending.
  * \param link The link
  * \return a file descriptor
@@ -70,6 +80,319 @@ int mtc_fd_link_get_close_fd(MtcLink *link);
  */
 void mtc_fd_link_set_close_fd(MtcLink *link, int val);
 
+/**Gets the amount of data queued on the link that is 
+ * not yet sent.
+ * \param link The link
+ * \return No. of bytes not yet sent
+ */
+size_t mtc_fd_link_get_unsent_size(MtcLink *link);
+
+/**Holds off sending, so that a burst of messages queued meanwhile 
+ * goes out in as few system calls as possible once the link is 
+ * uncorked. Calls may be nested.
+ * 
+ * Messages are still queued and counted as unsent data. 
+ * Sending starts on the next event loop iteration after the last 
+ * mtc_fd_link_uncork().
+ * 
+ * Without a cork, messages queued during one event loop iteration 
+ * already go out together, since links only write from the event 
+ * loop. A cork is for bursts spanning several iterations.
+ * 
+ * A synchronous IO step (see mtc_fd_link_poll_fill()) sends corked 
+ * data anyway, as the caller waits for the reply to it. The cork takes 
+ * effect again once the queue is empty.
+ * \param link The link
+ */
+void mtc_fd_link_cork(MtcLink *link);
+
+/**Undoes one mtc_fd_link_cork().
+ * \param link The link
+ */
+void mtc_fd_link_uncork(MtcLink *link);
+
+/**Enables coalescing of outgoing messages into batches. 
+ * 
+ * When a message is queued on an idle link, sending is held back for 
+ * up to max_delay microseconds, or until max_bytes are queued, so that 
+ * messages queued meanwhile go out together. The window is only 
+ * opened while messages are queued more often than once every 
+ * max_delay on average, so low-rate traffic is sent without delay. 
+ * The delay has a resolution of one millisecond.
+ * 
+ * Synchronous IO steps close the window at once.
+ * \param link The link
+ * \param max_delay Longest time to hold a message in microseconds, 
+ *        0 to disable batching (the default)
+ * \param max_bytes Amount of unsent data that closes the window early, 
+ *        0 for no limit
+ */
+void mtc_fd_link_set_batching
+	(MtcLink *link, int64_t max_delay, size_t max_bytes);
+
+///How a message left the queue, see MtcFDLinkDoneFunc
+typedef enum
+{
+	///The message was dropped, or the link was destroyed before 
+	///sending it
+	MTC_FD_LINK_DONE_DROPPED = 0,
+	///The last byte of the message was handed to the kernel
+	MTC_FD_LINK_DONE_SENT = 1,
+	///The message was copied, and the copy is sent instead: 
+	///by the same link after mtc_fd_link_privatize(), 
+	///or by the importing process after mtc_fd_link_export()
+	MTC_FD_LINK_DONE_HANDED_OVER = 2
+} MtcFDLinkDoneStatus;
+
+/**Function called when a message queued with 
+ * mtc_fd_link_queue_with_opts() leaves the queue.
+ * 
+ * mtc_fd_link_privatize() calls it at once with 
+ * MTC_FD_LINK_DONE_HANDED_OVER for each queued message, as the link 
+ * then sends a copy and no longer calls it for that message. 
+ * After mtc_fd_link_export(), it is called with 
+ * MTC_FD_LINK_DONE_HANDED_OVER when the link is destroyed.
+ * In both cases the buffer of the message can be reused.
+ * \param link The link. When the link is being destroyed, it must 
+ *        not be used for anything but identification.
+ * \param msg The message. The link releases its reference after 
+ *        the function returns.
+ * \param sent How the message left the queue, 
+ *        one of MtcFDLinkDoneStatus
+ * \param data User data
+ */
+typedef void (*MtcFDLinkDoneFunc)
+	(MtcLink *link, MtcMsg *msg, int sent, void *data);
+
+///Options for mtc_fd_link_queue_with_opts()
+typedef struct
+{
+	///Time in microseconds after which the message is dropped if it 
+	///has not started to go out, 0 for no limit
+	int64_t ttl;
+	///With MTC_FD_LINK_QUEUE_COALESCE, a queued message not yet sent 
+	///is replaced by a later one with the same key. 0 for no key.
+	uint32_t key;
+	///Function to call when the message leaves the queue, or NULL
+	MtcFDLinkDoneFunc done;
+	///User data for done
+	void *data;
+} MtcFDLinkQueueOpts;
+
+///What to do with queued messages that have not started to go out
+typedef enum
+{
+	///Never drop messages (the default)
+	MTC_FD_LINK_QUEUE_KEEP_ALL = 0,
+	///Drop the oldest messages to keep unsent data within the limit
+	MTC_FD_LINK_QUEUE_DROP_OLDEST = 1,
+	///Drop new messages that would take unsent data over the limit
+	MTC_FD_LINK_QUEUE_DROP_NEWEST = 2,
+	///Replace queued messages having the same key
+	MTC_FD_LINK_QUEUE_COALESCE = 3
+} MtcFDLinkQueuePolicy;
+
+///Counts of messages dropped from the queue of a link
+typedef struct
+{
+	///Dropped because of their time to live
+	uint64_t n_expired;
+	///Dropped to stay within the limit
+	uint64_t n_dropped;
+	///Replaced by a message with the same key
+	uint64_t n_coalesced;
+} MtcFDLinkQueueStats;
+
+/**Initializes queue options to defaults: no time to live, no key, 
+ * no done function.
+ * \param opts The options
+ */
+void mtc_fd_link_queue_opts_init(MtcFDLinkQueueOpts *opts);
+
+/**Queues a message like mtc_link_queue() does, with options. 
+ * 
+ * A message may be dropped only while none of it is sent, and the 
+ * message at the front of the queue is never dropped as it may be 
+ * partly sent. Expired messages are dropped when the link sends 
+ * or another message is queued, so they do not pile up on a link 
+ * that cannot send.
+ * 
+ * The done function is called once for the message, from the call 
+ * that sent or dropped it, after the link is consistent again, so it 
+ * may queue more messages. If the message is dropped right away 
+ * because of MTC_FD_LINK_QUEUE_DROP_NEWEST it is called before this 
+ * function returns.
+ * \param link The link
+ * \param msg The message to send
+ * \param opts Options, or NULL for defaults
+ */
+void mtc_fd_link_queue_with_opts
+	(MtcLink *link, MtcMsg *msg, const MtcFDLinkQueueOpts *opts);
+
+/**Sets how the link drops queued messages that have not started to 
+ * go out. Messages queued with the stop flag are never dropped.
+ * \param link The link
+ * \param policy The policy
+ * \param limit Max. amount of unsent data in bytes for 
+ *        MTC_FD_LINK_QUEUE_DROP_OLDEST and MTC_FD_LINK_QUEUE_DROP_NEWEST, 
+ *        ignored otherwise
+ */
+void mtc_fd_link_set_queue_policy
+	(MtcLink *link, MtcFDLinkQueuePolicy policy, size_t limit);
+
+/**Gets counts of messages dropped from the queue of the link.
+ * \param link The link
+ * \param stats Location to store the counts
+ */
+void mtc_fd_link_get_queue_stats
+	(MtcLink *link, MtcFDLinkQueueStats *stats);
+
+/**Gets when the link last did IO, i.e. when the event loop last 
+ * found it ready for receiving or sending.
+ * \param link The link
+ * \return Time in microseconds, see mtc_simple_get_time()
+ */
+int64_t mtc_fd_link_get_last_active(MtcLink *link);
+
+/**Gets the amount of data queued for sending on all links 
+ * of the process, that is not yet sent. Can be called from any thread.
+ * \return Total size in bytes
+ */
+size_t mtc_fd_link_get_total_unsent_size(void);
+
+/**Frees the IO vectors idle links of the calling thread keep for 
+ * reuse. Call it before a thread that used links exits, as the 
+ * vectors are lost otherwise. Links keep working afterwards.
+ */
+void mtc_fd_link_iov_pool_clear(void);
+
+///Max. no. of file descriptors mtc_fd_link_poll_fill() uses
+#define MTC_FD_LINK_MAX_POLLFDS 3
+
+/**Fills poll() entries for the file descriptors the link is 
+ * currently waiting on, so that the link can be driven by poll() 
+ * directly instead of an event manager. 
+ * 
+ * Data held back by mtc_fd_link_cork() or a batching window is 
+ * sent in the step, as the caller is blocked waiting on the link.
+ * \param link The link
+ * \param fds Array of at least MTC_FD_LINK_MAX_POLLFDS entries
+ * \return No. of entries filled, 0 if the link is broken or its 
+ *         events are disabled.
+ */
+int mtc_fd_link_poll_fill(MtcLink *link, struct pollfd *fds);
+
+/**Does the IO poll() found the link ready for, calling 
+ * the callbacks of its event source like an event manager would.
+ * \param link The link
+ * \param fds The entries filled by mtc_fd_link_poll_fill(), 
+ *        with revents set by poll(). The link must not have been 
+ *        changed in between.
+ */
+void mtc_fd_link_poll_dispatch(MtcLink *link, struct pollfd *fds);
+
+/**Replaces the messages queued for sending by private copies, 
+ * so that the link does not share memory with any other object 
+ * and can be handed over to another thread. 
+ * Partially sent messages continue from where they were.
+ * Done functions of the messages are called with 
+ * MTC_FD_LINK_DONE_HANDED_OVER, see MtcFDLinkDoneFunc.
+ * \param link The link
+ */
+void mtc_fd_link_privatize(MtcLink *link);
+
+/**Saves the state of the link, so that another process can 
+ * continue using the connection with mtc_fd_link_import().
+ * 
+ * The state contains the part of the incoming message already read 
+ * and all data queued for sending, including messages pushed by 
+ * other threads (see mtc_fd_link_get_remote()). The file descriptors 
+ * are not part of the state and must be passed separately, 
+ * e.g. over a Unix domain socket.
+ * 
+ * The link must not be used anymore afterwards, except to 
+ * destroy it once its file descriptors are handed over. 
+ * Destroying it calls done functions of the exported messages with 
+ * MTC_FD_LINK_DONE_HANDED_OVER, see MtcFDLinkDoneFunc.
+ * \param link The link. It must be open in both directions.
+ * \param len Location to store size of the state
+ * \return The state, to be freed with mtc_free(), or NULL if the link
+ *         is broken or stopped.
+ */
+void *mtc_fd_link_export(MtcLink *link, size_t *len);
+
+/**Creates a link from the state saved by mtc_fd_link_export().
+ * The link continues reading and sending exactly where the 
+ * exported link stopped. 
+ * \param state The saved state
+ * \param len Size of the state
+ * \param out_fd The file descriptor for sending
+ * \param in_fd The file descriptor for receiving
+ * \return A new link which closes the file descriptors when destroyed,
+ *         or NULL if the state is invalid.
+ */
+MtcLink *mtc_fd_link_import
+	(const void *state, size_t len, int out_fd, int in_fd);
+
+///A queue through which any thread can send messages over an MtcFDLink
+typedef struct _MtcFDLinkRemote MtcFDLinkRemote;
+
+/**Gets the queue through which other threads can send messages 
+ * over the link. The queue is created on first use.
+ * 
+ * Messages pushed to the queue are moved to the send queue of the 
+ * link in one batch by the thread running the link's event loop.
+ * \param link The link. Must be called from the thread using the link.
+ * \return The queue, with a new reference.
+ */
+MtcFDLinkRemote *mtc_fd_link_get_remote(MtcLink *link);
+
+/**Increments the reference count by 1. Can be called from any thread.
+ * \param remote The queue
+ */
+void mtc_fd_link_remote_ref(MtcFDLinkRemote *remote);
+
+/**Decrements the reference count by 1. Can be called from any thread.
+ * \param remote The queue
+ */
+void mtc_fd_link_remote_unref(MtcFDLinkRemote *remote);
+
+/**Creates a copy of the message which shares no memory with the 
+ * original, so that it can be handed over to another thread.
+ * \param msg The message
+ * \return A new message with its own copy of every block
+ */
+MtcMsg *mtc_sta_msg_dup(MtcMsg *msg);
+
+/**Takes over the reference the link holds on the message being 
+ * passed to the received callback, so that the callback can hand 
+ * the message to another thread without copying it. Received 
+ * messages share no memory with anything else.
+ * \param link The link. Must be called from its received callback.
+ * 
+eturn The received message, or NULL if already taken or 
+ *         not called from the received callback.
+ */
+MtcMsg *mtc_fd_link_take_received(MtcLink *link);
+
+/**Schedules a message to be sent through the link. 
+ * Can be called from any thread, without locking.
+ * 
+ * The reference to the message held by the caller is handed over to
+ * the link's thread. As reference counts are not atomic, the message 
+ * must share no memory with anything the calling thread still uses. 
+ * Pass a private copy made with mtc_sta_msg_dup(). This also applies 
+ * to mails from mtc_simple_router_serialize_mail(), which share 
+ * blocks of the address and the payload.
+ * \param remote The queue
+ * \param msg The message to send
+ * \param stop Whether to stop the link after sending the message
+ * \return 0 on success, -1 if the link is already destroyed, in which
+ *         case the caller keeps its reference.
+ */
+int mtc_fd_link_remote_queue
+	(MtcFDLinkRemote *remote, MtcMsg *msg, int stop);
+
 /**
  * \}
  */
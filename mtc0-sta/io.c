@@ -24,6 +24,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/uio.h>
+#include <time.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 
 //Initializes the reader
@@ -126,6 +130,99 @@ MtcIOStatus mtc_reader_v_read(MtcReaderV *self)
 	}
 }
 
+//Wakes up an event loop from another thread
+
+void mtc_wakeup_init(MtcWakeup *self)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	self->fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (self->fds[0] < 0)
+		mtc_error("eventfd(): %s", strerror(errno));
+	self->fds[1] = self->fds[0];
+#else
+	if (pipe(self->fds) < 0)
+		mtc_error("pipe(): %s", strerror(errno));
+	mtc_fd_set_blocking(self->fds[0], 0);
+	mtc_fd_set_blocking(self->fds[1], 0);
+#endif
+}
+
+void mtc_wakeup_notify(MtcWakeup *self)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t val = 1;
+	
+	while (write(self->fds[1], &val, sizeof(val)) < 0 && errno == EINTR)
+		;
+#else
+	char val = 0;
+	
+	//A full pipe is readable anyway
+	while (write(self->fds[1], &val, 1) < 0 && errno == EINTR)
+		;
+#endif
+}
+
+void mtc_wakeup_drain(MtcWakeup *self)
+{
+	uint64_t buf[8];
+	
+	while (read(self->fds[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+void mtc_wakeup_destroy(MtcWakeup *self)
+{
+	close(self->fds[0]);
+	if (self->fds[1] != self->fds[0])
+		close(self->fds[1]);
+}
+
+//Message utilities
+
+MtcMsg *mtc_sta_msg_dup(MtcMsg *msg)
+{
+	uint32_t n_blocks, i;
+	MtcMBlock *blocks, *res_blocks;
+	uint32_t *sizes = NULL;
+	MtcMsg *res;
+	
+	n_blocks = mtc_msg_get_n_blocks(msg);
+	blocks = mtc_msg_get_blocks(msg);
+	
+	if (n_blocks > 1)
+	{
+		sizes = (uint32_t *) mtc_alloc(sizeof(uint32_t) * (n_blocks - 1));
+		for (i = 1; i < n_blocks; i++)
+			sizes[i - 1] = blocks[i].size;
+	}
+	
+	res = mtc_msg_try_new_allocd(blocks[0].size, n_blocks - 1, sizes);
+	if (! res)
+		mtc_error("Failed to allocate message structure");
+	
+	if (sizes)
+		mtc_free(sizes);
+	
+	res_blocks = mtc_msg_get_blocks(res);
+	for (i = 0; i < n_blocks; i++)
+		memcpy(res_blocks[i].mem, blocks[i].mem, blocks[i].size);
+	
+	return res;
+}
+
+//Time utilities
+
+int64_t mtc_sta_get_time(void)
+{
+	struct timespec ts;
+	
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		mtc_error("clock_gettime(): %s", strerror(errno));
+	
+	return ((int64_t) ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
 //File descriptor utilities
 
 //Sets whether IO operations on fd should block
@@ -151,6 +248,10 @@ int mtc_fd_set_blocking(int fd, int val)
 	else
 		return res;
 	
+	//Nothing to do if already set
+	if (res == (val > 0))
+		return res;
+	
 	//Set back the flags
 	if (fcntl(fd, F_SETFL, stat_flags) < 0)
 		mtc_error("Failed to set file descriptor flags for file descriptor %d: %s",
@@ -78,6 +78,33 @@ void mtc_reader_v_init(MtcReaderV *self, struct iovec *blocks, int n_blocks, int
 //Reads some data. 
 MtcIOStatus mtc_reader_v_read(MtcReaderV *self);
 
+//Wakes up an event loop from another thread
+typedef struct
+{
+	//fds[0] is polled, fds[1] is written to. 
+	//Both are the same when eventfd is used.
+	int fds[2];
+} MtcWakeup;
+
+//Initializes the wakeup object
+void mtc_wakeup_init(MtcWakeup *self);
+
+//Makes fds[0] readable. Can be called from any thread.
+void mtc_wakeup_notify(MtcWakeup *self);
+
+//Makes fds[0] not readable again. Call it before taking the pushed 
+//items, so that an item pushed in between leaves fds[0] readable 
+//rather than waiting for the next push.
+void mtc_wakeup_drain(MtcWakeup *self);
+
+//Closes the file descriptors
+void mtc_wakeup_destroy(MtcWakeup *self);
+
+//Time utilities
+
+//Gets time from a monotonic clock, in microseconds
+int64_t mtc_sta_get_time(void);
+
 //File descriptor utilities
 
 //Sets whether IO operations on fd should block
@@ -0,0 +1,303 @@
+/* peer_group.c
+ * Load balancing among equivalent peers of simple router
+ * 
+ * Copyright 2013 Akash Rawal
+ * This file is part of MTC-Standalone.
+ * 
+ * MTC-Standalone is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * MTC-Standalone is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MTC-Standalone.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+typedef struct
+{
+	MtcPeerGroup *group;
+	MtcPeer *peer;
+	MtcPeerResetNotify notify;
+} MtcPeerGroupMember;
+
+struct _MtcPeerGroup
+{
+	int refcount;
+	
+	MtcPeerGroupPolicy policy;
+	
+	//Members
+	MtcPeerGroupMember **members;
+	int alen, len;
+	
+	//Next member for round robin
+	int cursor;
+	
+	//State of random number generator
+	uint32_t seed;
+};
+
+//Member management
+
+static void mtc_peer_group_member_destroy(MtcPeerGroupMember *member)
+{
+	MtcPeerGroup *group = member->group;
+	int i, idx;
+	
+	//Remove from array, preserving order for round robin
+	for (idx = 0; idx < group->len; idx++)
+	{
+		if (group->members[idx] == member)
+			break;
+	}
+	group->len--;
+	for (i = idx; i < group->len; i++)
+		group->members[i] = group->members[i + 1];
+	if (group->cursor > idx)
+		group->cursor--;
+	if (group->cursor >= group->len)
+		group->cursor = 0;
+	
+	mtc_peer_reset_notify_remove(&(member->notify));
+	mtc_peer_unref(member->peer);
+	mtc_free(member);
+}
+
+static void mtc_peer_group_member_reset_notify(MtcPeerResetNotify *notify)
+{
+	MtcPeerGroupMember *member = mtc_encl_struct
+		(notify, MtcPeerGroupMember, notify);
+	
+	mtc_peer_group_member_destroy(member);
+}
+
+static int mtc_peer_group_find(MtcPeerGroup *group, MtcPeer *peer)
+{
+	int i;
+	
+	for (i = 0; i < group->len; i++)
+	{
+		if (group->members[i]->peer == peer)
+			return i;
+	}
+	
+	return -1;
+}
+
+//Selection policies
+
+static uint32_t mtc_peer_group_random(MtcPeerGroup *group)
+{
+	//xorshift32
+	uint32_t x = group->seed;
+	
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	group->seed = x;
+	
+	return x;
+}
+
+static MtcPeer *mtc_peer_group_pick_round_robin(MtcPeerGroup *group)
+{
+	int i, idx;
+	
+	for (i = 0; i < group->len; i++)
+	{
+		idx = (group->cursor + i) % group->len;
+		if (mtc_simple_peer_is_connected(group->members[idx]->peer))
+		{
+			group->cursor = (idx + 1) % group->len;
+			return group->members[idx]->peer;
+		}
+	}
+	
+	return NULL;
+}
+
+static MtcPeer *mtc_peer_group_pick_least_queued(MtcPeerGroup *group)
+{
+	MtcPeer *res = NULL;
+	size_t res_size = 0;
+	int i;
+	
+	for (i = 0; i < group->len; i++)
+	{
+		MtcPeer *peer = group->members[i]->peer;
+		size_t size;
+		
+		if (! mtc_simple_peer_is_connected(peer))
+			continue;
+		
+		size = mtc_simple_peer_get_unsent_size(peer);
+		if ((! res) || size < res_size)
+		{
+			res = peer;
+			res_size = size;
+		}
+	}
+	
+	return res;
+}
+
+static MtcPeer *mtc_peer_group_pick_two_choices(MtcPeerGroup *group)
+{
+	MtcPeer *a, *b;
+	
+	if (group->len < 2)
+		return mtc_peer_group_pick_least_queued(group);
+	
+	a = group->members[mtc_peer_group_random(group) % group->len]->peer;
+	b = group->members[mtc_peer_group_random(group) % group->len]->peer;
+	
+	if (! mtc_simple_peer_is_connected(a))
+		a = NULL;
+	if (! mtc_simple_peer_is_connected(b))
+		b = NULL;
+	
+	//Both choices are disconnected, look at all of them
+	if ((! a) && (! b))
+		return mtc_peer_group_pick_least_queued(group);
+	
+	if (! a)
+		return b;
+	if (! b)
+		return a;
+	
+	if (mtc_simple_peer_get_unsent_size(b) < mtc_simple_peer_get_unsent_size(a))
+		return b;
+	else
+		return a;
+}
+
+//Public API
+
+MtcPeerGroup *mtc_peer_group_new(MtcPeerGroupPolicy policy)
+{
+	MtcPeerGroup *group;
+	
+	group = (MtcPeerGroup *) mtc_alloc(sizeof(MtcPeerGroup));
+	
+	group->refcount = 1;
+	group->policy = policy;
+	group->members = NULL;
+	group->alen = 0;
+	group->len = 0;
+	group->cursor = 0;
+	group->seed = ((uint32_t) (size_t) group) | 1;
+	
+	return group;
+}
+
+void mtc_peer_group_ref(MtcPeerGroup *group)
+{
+	group->refcount++;
+}
+
+void mtc_peer_group_unref(MtcPeerGroup *group)
+{
+	group->refcount--;
+	
+	if (group->refcount <= 0)
+	{
+		while (group->len)
+			mtc_peer_group_member_destroy(group->members[0]);
+		
+		if (group->members)
+			mtc_free(group->members);
+		
+		mtc_free(group);
+	}
+}
+
+void mtc_peer_group_add(MtcPeerGroup *group, MtcPeer *peer)
+{
+	MtcPeerGroupMember *member;
+	
+	if (mtc_peer_group_find(group, peer) >= 0)
+		return;
+	
+	//Disconnected peers are never reset again, don't hold them
+	if (! mtc_simple_peer_is_connected(peer))
+		return;
+	
+	//Resize array if necessary
+	if (group->len == group->alen)
+	{
+		MtcPeerGroupMember **new_members;
+		int new_alen, i;
+		
+		new_alen = group->alen ? group->alen * 2 : 4;
+		new_members = (MtcPeerGroupMember **) mtc_alloc
+			(sizeof(MtcPeerGroupMember *) * new_alen);
+		for (i = 0; i < group->len; i++)
+			new_members[i] = group->members[i];
+		
+		if (group->members)
+			mtc_free(group->members);
+		group->members = new_members;
+		group->alen = new_alen;
+	}
+	
+	member = (MtcPeerGroupMember *) mtc_alloc(sizeof(MtcPeerGroupMember));
+	member->group = group;
+	member->peer = peer;
+	mtc_peer_ref(peer);
+	member->notify.cb = mtc_peer_group_member_reset_notify;
+	mtc_peer_add_reset_notify(peer, &(member->notify));
+	
+	group->members[group->len] = member;
+	group->len++;
+}
+
+void mtc_peer_group_remove(MtcPeerGroup *group, MtcPeer *peer)
+{
+	int idx;
+	
+	idx = mtc_peer_group_find(group, peer);
+	if (idx >= 0)
+		mtc_peer_group_member_destroy(group->members[idx]);
+}
+
+int mtc_peer_group_get_size(MtcPeerGroup *group)
+{
+	return group->len;
+}
+
+MtcPeer *mtc_peer_group_pick(MtcPeerGroup *group)
+{
+	switch (group->policy)
+	{
+	case MTC_PEER_GROUP_LEAST_QUEUED:
+		return mtc_peer_group_pick_least_queued(group);
+	case MTC_PEER_GROUP_TWO_CHOICES:
+		return mtc_peer_group_pick_two_choices(group);
+	default:
+		return mtc_peer_group_pick_round_robin(group);
+	}
+}
+
+MtcPeer *mtc_peer_group_sendto(MtcPeerGroup *group, 
+	MtcMBlock addr, MtcDest *reply_dest, MtcMsg *payload)
+{
+	MtcPeer *peer;
+	MtcMsg *mail;
+	
+	peer = mtc_peer_group_pick(group);
+	if (! peer)
+		return NULL;
+	
+	mail = mtc_simple_router_serialize_mail(addr, reply_dest, payload);
+	mtc_simple_peer_queue_mail(peer, mail, 0);
+	mtc_msg_unref(mail);
+	
+	return peer;
+}
@@ -0,0 +1,99 @@
+/* peer_group.h
+ * Load balancing among equivalent peers of simple router
+ * 
+ * Copyright 2013 Akash Rawal
+ * This file is part of MTC-Standalone.
+ * 
+ * MTC-Standalone is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * MTC-Standalone is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MTC-Standalone.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \addtogroup mtc_peer_group
+ * \{
+ * 
+ * A peer group holds several peers of simple router that lead to 
+ * equivalent destinations, and picks one of them for every mail sent.
+ */
+
+///Policy used by a peer group to pick a peer
+typedef enum
+{
+	///Connected peers are used in turn
+	MTC_PEER_GROUP_ROUND_ROBIN = 0,
+	///The connected peer with least amount of unsent data is used
+	MTC_PEER_GROUP_LEAST_QUEUED = 1,
+	///Out of two randomly chosen connected peers, the one with 
+	///less unsent data is used
+	MTC_PEER_GROUP_TWO_CHOICES = 2
+} MtcPeerGroupPolicy;
+
+///A group of equivalent peers
+typedef struct _MtcPeerGroup MtcPeerGroup;
+
+/**Creates a new empty peer group.
+ * \param policy How to pick a peer
+ * \return A new peer group
+ */
+MtcPeerGroup *mtc_peer_group_new(MtcPeerGroupPolicy policy);
+
+/**Increments the reference count by 1
+ * \param group A peer group
+ */
+void mtc_peer_group_ref(MtcPeerGroup *group);
+
+/**Decrements the reference count by 1
+ * \param group A peer group
+ */
+void mtc_peer_group_unref(MtcPeerGroup *group);
+
+/**Adds a peer to the group. A strong reference is held on the peer
+ * until it is removed from the group or reset.
+ * \param group A peer group
+ * \param peer A peer belonging to simple router
+ */
+void mtc_peer_group_add(MtcPeerGroup *group, MtcPeer *peer);
+
+/**Removes a peer from the group.
+ * \param group A peer group
+ * \param peer A peer in the group
+ */
+void mtc_peer_group_remove(MtcPeerGroup *group, MtcPeer *peer);
+
+/**Gets no. of peers in the group
+ * \param group A peer group
+ * \return No. of peers in the group
+ */
+int mtc_peer_group_get_size(MtcPeerGroup *group);
+
+/**Picks a connected peer from the group according to its policy.
+ * \param group A peer group
+ * \return A peer, or NULL if no peer in the group is connected.
+ *         No reference is added.
+ */
+MtcPeer *mtc_peer_group_pick(MtcPeerGroup *group);
+
+/**Sends a mail to a peer picked from the group.
+ * \param group A peer group
+ * \param addr Destination address
+ * \param reply_dest Destination for the reply, or NULL
+ * \param payload The message to send
+ * \return The peer the mail was queued on, or NULL if no peer in
+ *         the group is connected. No reference is added.
+ */
+MtcPeer *mtc_peer_group_sendto(MtcPeerGroup *group, 
+	MtcMBlock addr, MtcDest *reply_dest, MtcMsg *payload);
+
+/**
+ * \}
+ */
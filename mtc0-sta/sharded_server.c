@@ -0,0 +1,941 @@
+/* sharded_server.c
+ * A multi-threaded server with one event loop and router per thread
+ * 
+ * Copyright 2013 Akash Rawal
+ * This file is part of MTC-Standalone.
+ * 
+ * MTC-Standalone is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * MTC-Standalone is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MTC-Standalone.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <pthread.h>
+
+//Hash table of objects keyed by 64-bit IDs
+
+typedef struct _MtcIdEntry MtcIdEntry;
+struct _MtcIdEntry
+{
+	MtcIdEntry *next;
+	uint64_t id;
+};
+
+typedef struct
+{
+	MtcIdEntry **buckets;
+	int n_buckets, len;
+} MtcIdTable;
+
+#define MTC_ID_TABLE_MIN 16
+
+#define mtc_id_table_bucket(table, id) \
+	((table)->buckets + ((id) & ((table)->n_buckets - 1)))
+
+static void mtc_id_table_init(MtcIdTable *table)
+{
+	int i;
+	
+	table->n_buckets = MTC_ID_TABLE_MIN;
+	table->len = 0;
+	table->buckets = (MtcIdEntry **) mtc_alloc
+		(sizeof(MtcIdEntry *) * table->n_buckets);
+	for (i = 0; i < table->n_buckets; i++)
+		table->buckets[i] = NULL;
+}
+
+static void mtc_id_table_destroy(MtcIdTable *table)
+{
+	mtc_free(table->buckets);
+}
+
+static MtcIdEntry *mtc_id_table_lookup(MtcIdTable *table, uint64_t id)
+{
+	MtcIdEntry *iter;
+	
+	for (iter = *mtc_id_table_bucket(table, id); iter; iter = iter->next)
+	{
+		if (iter->id == id)
+			break;
+	}
+	
+	return iter;
+}
+
+static void mtc_id_table_insert(MtcIdTable *table, MtcIdEntry *entry)
+{
+	MtcIdEntry **bucket;
+	
+	//Grow the table to keep chains short
+	if (table->len >= table->n_buckets)
+	{
+		MtcIdEntry **old_buckets = table->buckets, *iter, *next;
+		int old_n_buckets = table->n_buckets, i;
+		
+		table->n_buckets *= 2;
+		table->buckets = (MtcIdEntry **) mtc_alloc
+			(sizeof(MtcIdEntry *) * table->n_buckets);
+		for (i = 0; i < table->n_buckets; i++)
+			table->buckets[i] = NULL;
+		
+		for (i = 0; i < old_n_buckets; i++)
+		{
+			for (iter = old_buckets[i]; iter; iter = next)
+			{
+				next = iter->next;
+				bucket = mtc_id_table_bucket(table, iter->id);
+				iter->next = *bucket;
+				*bucket = iter;
+			}
+		}
+		
+		mtc_free(old_buckets);
+	}
+	
+	bucket = mtc_id_table_bucket(table, entry->id);
+	entry->next = *bucket;
+	*bucket = entry;
+	table->len++;
+}
+
+static void mtc_id_table_remove(MtcIdTable *table, MtcIdEntry *entry)
+{
+	MtcIdEntry **iter;
+	
+	for (iter = mtc_id_table_bucket(table, entry->id); *iter; 
+		iter = &((*iter)->next))
+	{
+		if (*iter == entry)
+		{
+			*iter = entry->next;
+			table->len--;
+			break;
+		}
+	}
+}
+
+static MtcIdEntry *mtc_id_table_any(MtcIdTable *table)
+{
+	int i;
+	
+	for (i = 0; i < table->n_buckets; i++)
+	{
+		if (table->buckets[i])
+			return table->buckets[i];
+	}
+	
+	return NULL;
+}
+
+//Structures
+
+//Entry of the routing table, tells which shard a peer is on
+typedef struct
+{
+	MtcIdEntry parent;
+	
+	int shard;
+} MtcShardRoute;
+
+//A peer accepted by a shard
+typedef struct
+{
+	MtcIdEntry parent;
+	
+	MtcShard *shard;
+	MtcPeer *peer;
+	MtcPeerResetNotify notify;
+} MtcShardPeer;
+
+//Work to be done by a shard
+typedef enum
+{
+	MTC_SHARD_ITEM_SEND,
+	MTC_SHARD_ITEM_INVOKE,
+	MTC_SHARD_ITEM_ATTACH,
+	MTC_SHARD_ITEM_STOP
+} MtcShardItemType;
+
+typedef struct _MtcShardItem MtcShardItem;
+struct _MtcShardItem
+{
+	MtcShardItem *next;
+	
+	MtcShardItemType type;
+	
+	//For MTC_SHARD_ITEM_SEND and MTC_SHARD_ITEM_ATTACH
+	uint64_t peer_id;
+	MtcMsg *mail;
+	MtcSimplePeerState *state;
+	
+	//For MTC_SHARD_ITEM_INVOKE
+	MtcShardFunc func;
+	void *data;
+};
+
+struct _MtcShard
+{
+	//Event source for the inbox
+	MtcEventSource parent;
+	
+	MtcShardedServer *server;
+	int idx;
+	
+	//Thread
+	pthread_t thread;
+	int running;
+	
+	//Event loop and router
+	struct event_base *base;
+	MtcEventMgr *mgr;
+	MtcRouter *router;
+	MtcSimpleListener *listener;
+	MtcEventBackend *listener_backend;
+	
+	//Peers of this shard
+	MtcIdTable peers;
+	
+	//Inbox, for work sent from other threads
+	pthread_mutex_t lock;
+	MtcShardItem *head, *tail;
+	MtcWakeup wakeup;
+	MtcEventTestPollFD test;
+	MtcEventBackend *inbox_backend;
+};
+
+struct _MtcShardedServer
+{
+	int refcount;
+	
+	MtcShard **shards;
+	int n_shards;
+	int running;
+	
+	MtcShardAcceptedFunc accepted;
+	void *data;
+	
+	//Routing table
+	pthread_mutex_t lock;
+	MtcIdTable routes;
+	uint64_t next_id;
+};
+
+//Routing table
+
+static uint64_t mtc_sharded_server_add_route
+	(MtcShardedServer *server, int shard)
+{
+	MtcShardRoute *route;
+	uint64_t id;
+	
+	route = (MtcShardRoute *) mtc_alloc(sizeof(MtcShardRoute));
+	route->shard = shard;
+	
+	pthread_mutex_lock(&(server->lock));
+	id = server->next_id++;
+	route->parent.id = id;
+	mtc_id_table_insert(&(server->routes), (MtcIdEntry *) route);
+	pthread_mutex_unlock(&(server->lock));
+	
+	return id;
+}
+
+static void mtc_sharded_server_remove_route
+	(MtcShardedServer *server, uint64_t id)
+{
+	MtcIdEntry *route;
+	
+	pthread_mutex_lock(&(server->lock));
+	route = mtc_id_table_lookup(&(server->routes), id);
+	if (route)
+		mtc_id_table_remove(&(server->routes), route);
+	pthread_mutex_unlock(&(server->lock));
+	
+	if (route)
+		mtc_free(route);
+}
+
+static void mtc_sharded_server_set_route
+	(MtcShardedServer *server, uint64_t id, int shard)
+{
+	MtcShardRoute *route;
+	
+	pthread_mutex_lock(&(server->lock));
+	route = (MtcShardRoute *) mtc_id_table_lookup(&(server->routes), id);
+	if (route)
+		route->shard = shard;
+	pthread_mutex_unlock(&(server->lock));
+}
+
+static int mtc_sharded_server_find_route
+	(MtcShardedServer *server, uint64_t id)
+{
+	MtcShardRoute *route;
+	int res = -1;
+	
+	pthread_mutex_lock(&(server->lock));
+	route = (MtcShardRoute *) mtc_id_table_lookup(&(server->routes), id);
+	if (route)
+		res = route->shard;
+	pthread_mutex_unlock(&(server->lock));
+	
+	return res;
+}
+
+//Peers of a shard
+
+static void mtc_shard_peer_destroy(MtcShardPeer *sp)
+{
+	MtcShard *shard = sp->shard;
+	
+	mtc_id_table_remove(&(shard->peers), (MtcIdEntry *) sp);
+	mtc_sharded_server_remove_route(shard->server, sp->parent.id);
+	
+	mtc_peer_reset_notify_remove(&(sp->notify));
+	mtc_peer_unref(sp->peer);
+	mtc_free(sp);
+}
+
+static void mtc_shard_peer_reset_notify(MtcPeerResetNotify *notify)
+{
+	MtcShardPeer *sp = mtc_encl_struct(notify, MtcShardPeer, notify);
+	
+	mtc_shard_peer_destroy(sp);
+}
+
+//Adds the peer to the shard, steals the reference
+static void mtc_shard_add_peer(MtcShard *shard, MtcPeer *peer, uint64_t id)
+{
+	MtcShardedServer *server = shard->server;
+	MtcShardPeer *sp;
+	
+	sp = (MtcShardPeer *) mtc_alloc(sizeof(MtcShardPeer));
+	sp->shard = shard;
+	sp->peer = peer;
+	sp->notify.cb = mtc_shard_peer_reset_notify;
+	mtc_peer_add_reset_notify(sp->peer, &(sp->notify));
+	
+	sp->parent.id = id;
+	mtc_id_table_insert(&(shard->peers), (MtcIdEntry *) sp);
+	
+	if (server->accepted)
+		(* server->accepted)
+			(shard, sp->peer, sp->parent.id, server->data);
+}
+
+static void mtc_shard_accepted_cb(MtcSimpleListener *listener, int fd)
+{
+	MtcShard *shard = (MtcShard *) listener->data;
+	MtcPeer *peer;
+	uint64_t id;
+	
+	peer = mtc_simple_router_add(shard->router, fd, 1);
+	id = mtc_sharded_server_add_route(shard->server, shard->idx);
+	
+	mtc_shard_add_peer(shard, peer, id);
+}
+
+static void mtc_shard_disconnect_all(MtcShard *shard)
+{
+	MtcShardPeer *sp;
+	
+	while ((sp = (MtcShardPeer *) mtc_id_table_any(&(shard->peers))))
+	{
+		MtcPeer *peer = sp->peer;
+		uint64_t id = sp->parent.id;
+		
+		//Resetting the peer destroys the entry, 
+		//but a peer already disconnected is not reset again.
+		mtc_peer_ref(peer);
+		mtc_simple_peer_disconnect(peer);
+		sp = (MtcShardPeer *) mtc_id_table_lookup(&(shard->peers), id);
+		if (sp)
+			mtc_shard_peer_destroy(sp);
+		mtc_peer_unref(peer);
+	}
+}
+
+//Inbox
+
+static void mtc_shard_push(MtcShard *shard, MtcShardItem *item)
+{
+	int was_empty;
+	
+	item->next = NULL;
+	
+	pthread_mutex_lock(&(shard->lock));
+	was_empty = shard->head ? 0 : 1;
+	if (shard->head)
+		shard->tail->next = item;
+	else
+		shard->head = item;
+	shard->tail = item;
+	pthread_mutex_unlock(&(shard->lock));
+	
+	if (was_empty)
+		mtc_wakeup_notify(&(shard->wakeup));
+}
+
+static void mtc_shard_deliver(MtcShard *shard, MtcShardItem *item)
+{
+	MtcShardPeer *sp;
+	int route;
+	
+	sp = (MtcShardPeer *) mtc_id_table_lookup
+		(&(shard->peers), item->peer_id);
+	if (sp)
+	{
+		mtc_simple_peer_queue_mail(sp->peer, item->mail, 0);
+	}
+	else
+	{
+		//The peer may have moved to another shard meanwhile
+		route = mtc_sharded_server_find_route(shard->server, item->peer_id);
+		if (route >= 0 && route != shard->idx)
+		{
+			mtc_shard_push(shard->server->shards[route], item);
+			return;
+		}
+	}
+	
+	mtc_msg_unref(item->mail);
+	mtc_free(item);
+}
+
+static void mtc_shard_event
+	(MtcEventSource *source, MtcEventFlags event)
+{
+	MtcShard *shard = (MtcShard *) source;
+	MtcShardItem *iter, *next;
+	
+	if (! ((event & MTC_EVENT_CHECK) && (shard->test.revents & MTC_POLLIN)))
+		return;
+	
+	mtc_wakeup_drain(&(shard->wakeup));
+	
+	pthread_mutex_lock(&(shard->lock));
+	iter = shard->head;
+	shard->head = shard->tail = NULL;
+	pthread_mutex_unlock(&(shard->lock));
+	
+	for (; iter; iter = next)
+	{
+		next = iter->next;
+		
+		switch (iter->type)
+		{
+		case MTC_SHARD_ITEM_SEND:
+			mtc_shard_deliver(shard, iter);
+			break;
+		case MTC_SHARD_ITEM_INVOKE:
+			(* iter->func)(shard, iter->data);
+			mtc_free(iter);
+			break;
+		case MTC_SHARD_ITEM_ATTACH:
+			mtc_shard_add_peer(shard, 
+				mtc_simple_router_attach(shard->router, iter->state),
+				iter->peer_id);
+			mtc_free(iter);
+			break;
+		case MTC_SHARD_ITEM_STOP:
+			mtc_shard_disconnect_all(shard);
+			event_base_loopbreak(shard->base);
+			mtc_free(iter);
+			break;
+		}
+	}
+}
+
+static MtcEventSourceVTable mtc_shard_vtable =
+{
+	mtc_shard_event,
+	MTC_EVENT_CHECK
+};
+
+//Shards
+
+static MtcShard *mtc_shard_new(MtcShardedServer *server, int idx)
+{
+	MtcShard *shard;
+	
+	shard = (MtcShard *) mtc_alloc(sizeof(MtcShard));
+	
+	mtc_event_source_init((MtcEventSource *) shard, &mtc_shard_vtable);
+	
+	shard->server = server;
+	shard->idx = idx;
+	shard->running = 0;
+	
+	//Event loop and router
+	shard->base = event_base_new();
+	shard->mgr = mtc_lev_event_mgr_new(shard->base, 1);
+	shard->router = mtc_simple_router_new();
+	mtc_router_set_event_mgr(shard->router, shard->mgr);
+	shard->listener = NULL;
+	shard->listener_backend = NULL;
+	
+	mtc_id_table_init(&(shard->peers));
+	
+	//Inbox
+	pthread_mutex_init(&(shard->lock), NULL);
+	shard->head = shard->tail = NULL;
+	mtc_wakeup_init(&(shard->wakeup));
+	mtc_event_test_pollfd_init
+		(&(shard->test), shard->wakeup.fds[0], MTC_POLLIN);
+	mtc_event_source_prepare
+		((MtcEventSource *) shard, (MtcEventTest *) &(shard->test));
+	shard->inbox_backend = mtc_event_mgr_back
+		(shard->mgr, (MtcEventSource *) shard);
+	
+	return shard;
+}
+
+static void mtc_shard_clear_listener(MtcShard *shard)
+{
+	if (shard->listener)
+	{
+		mtc_event_backend_destroy(shard->listener_backend);
+		mtc_simple_listener_unref(shard->listener);
+		shard->listener = NULL;
+		shard->listener_backend = NULL;
+	}
+}
+
+static void mtc_shard_set_listener(MtcShard *shard, int fd)
+{
+	shard->listener = mtc_simple_listener_new(fd);
+	mtc_simple_listener_set_close_fd(shard->listener, 1);
+	shard->listener->accepted = mtc_shard_accepted_cb;
+	shard->listener->data = shard;
+	mtc_simple_listener_set_recheck_interval
+		(shard->listener, MTC_SIMPLE_LISTENER_RECHECK_INTERVAL);
+	shard->listener_backend = mtc_event_mgr_back
+		(shard->mgr, (MtcEventSource *) shard->listener);
+	mtc_simple_listener_set_active(shard->listener, 1);
+}
+
+static void mtc_shard_destroy(MtcShard *shard)
+{
+	MtcShardItem *iter, *next;
+	
+	//Peers
+	mtc_shard_disconnect_all(shard);
+	mtc_id_table_destroy(&(shard->peers));
+	
+	//Listener
+	mtc_shard_clear_listener(shard);
+	
+	//Inbox
+	mtc_event_backend_destroy(shard->inbox_backend);
+	for (iter = shard->head; iter; iter = next)
+	{
+		next = iter->next;
+		if (iter->type == MTC_SHARD_ITEM_SEND)
+			mtc_msg_unref(iter->mail);
+		else if (iter->type == MTC_SHARD_ITEM_ATTACH)
+		{
+			//Migrated after the shard stopped
+			mtc_simple_peer_state_free(iter->state);
+			mtc_sharded_server_remove_route(shard->server, iter->peer_id);
+		}
+		mtc_free(iter);
+	}
+	mtc_wakeup_destroy(&(shard->wakeup));
+	pthread_mutex_destroy(&(shard->lock));
+	
+	//Router and event loop
+	mtc_router_set_event_mgr(shard->router, NULL);
+	mtc_router_unref(shard->router);
+	mtc_event_mgr_unref(shard->mgr);
+	
+	mtc_event_source_destroy((MtcEventSource *) shard);
+	
+	mtc_free(shard);
+}
+
+static void *mtc_shard_main(void *arg)
+{
+	MtcShard *shard = (MtcShard *) arg;
+	
+	event_base_dispatch(shard->base);
+	
+	mtc_fd_link_iov_pool_clear();
+	
+	return NULL;
+}
+
+//Listening sockets
+
+static int mtc_sharded_server_open_socket
+	(const struct sockaddr *addr, socklen_t addr_len, int reuse_port)
+{
+	int fd, one = 1;
+	
+	fd = socket(addr->sa_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	
+	if (addr->sa_family != AF_UNIX)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef SO_REUSEPORT
+	if (reuse_port 
+		&& setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+		goto fail;
+#endif
+	
+	if (bind(fd, addr, addr_len) < 0)
+		goto fail;
+	if (listen(fd, SOMAXCONN) < 0)
+		goto fail;
+	
+	return fd;
+	
+fail:
+	{
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+	}
+	return -1;
+}
+
+//Public API
+
+MtcShardedServer *mtc_sharded_server_new(int n_shards)
+{
+	MtcShardedServer *server;
+	int i;
+	
+	if (n_shards < 1)
+		mtc_error("Invalid no. of shards %d", n_shards);
+	
+	server = (MtcShardedServer *) mtc_alloc(sizeof(MtcShardedServer));
+	
+	server->refcount = 1;
+	server->n_shards = n_shards;
+	server->running = 0;
+	server->accepted = NULL;
+	server->data = NULL;
+	
+	pthread_mutex_init(&(server->lock), NULL);
+	mtc_id_table_init(&(server->routes));
+	server->next_id = 1;
+	
+	server->shards = (MtcShard **) mtc_alloc(sizeof(MtcShard *) * n_shards);
+	for (i = 0; i < n_shards; i++)
+		server->shards[i] = mtc_shard_new(server, i);
+	
+	return server;
+}
+
+void mtc_sharded_server_ref(MtcShardedServer *server)
+{
+	server->refcount++;
+}
+
+void mtc_sharded_server_unref(MtcShardedServer *server)
+{
+	server->refcount--;
+	
+	if (server->refcount <= 0)
+	{
+		int i;
+		
+		mtc_sharded_server_stop(server);
+		
+		for (i = 0; i < server->n_shards; i++)
+			mtc_shard_destroy(server->shards[i]);
+		mtc_free(server->shards);
+		
+		if (server->routes.len)
+			mtc_error("Peers still remaining with sharded server "
+			          "in destruction");
+		mtc_id_table_destroy(&(server->routes));
+		pthread_mutex_destroy(&(server->lock));
+		
+		mtc_free(server);
+	}
+}
+
+int mtc_sharded_server_listen(MtcShardedServer *server, 
+	const struct sockaddr *addr, socklen_t addr_len)
+{
+	struct sockaddr_storage bound;
+	socklen_t bound_len = sizeof(bound);
+	int reuse_port = 0, i, fd;
+	
+	if (server->running || server->shards[0]->listener)
+		mtc_error("Sharded server %p is already listening", server);
+	
+#ifdef SO_REUSEPORT
+	if (addr->sa_family != AF_UNIX)
+		reuse_port = 1;
+#endif
+	
+	fd = mtc_sharded_server_open_socket(addr, addr_len, reuse_port);
+	if (fd < 0)
+		return -1;
+	
+	if (reuse_port)
+	{
+		//Make sure all sockets get the same port when 
+		//the port is chosen by the kernel
+		if (getsockname(fd, (struct sockaddr *) &bound, &bound_len) < 0)
+		{
+			close(fd);
+			return -1;
+		}
+	}
+	
+	mtc_shard_set_listener(server->shards[0], fd);
+	
+	for (i = 1; i < server->n_shards; i++)
+	{
+		if (reuse_port)
+			fd = mtc_sharded_server_open_socket
+				((struct sockaddr *) &bound, bound_len, 1);
+		else
+			fd = dup(server->shards[0]->listener->test.fd);
+		
+		if (fd < 0)
+		{
+			int saved_errno = errno;
+			
+			//Do not leave some shards listening
+			for (i--; i >= 0; i--)
+				mtc_shard_clear_listener(server->shards[i]);
+			
+			errno = saved_errno;
+			return -1;
+		}
+		
+		mtc_shard_set_listener(server->shards[i], fd);
+	}
+	
+	return 0;
+}
+
+void mtc_sharded_server_set_accepted(MtcShardedServer *server,
+	MtcShardAcceptedFunc accepted, void *data)
+{
+	server->accepted = accepted;
+	server->data = data;
+}
+
+void mtc_sharded_server_start(MtcShardedServer *server)
+{
+	int i, res;
+	
+	if (server->running)
+		return;
+	
+	for (i = 0; i < server->n_shards; i++)
+	{
+		MtcShard *shard = server->shards[i];
+		
+		res = pthread_create(&(shard->thread), NULL, mtc_shard_main, shard);
+		if (res != 0)
+			mtc_error("pthread_create(): %s", strerror(res));
+		shard->running = 1;
+	}
+	
+	server->running = 1;
+}
+
+void mtc_sharded_server_stop(MtcShardedServer *server)
+{
+	int i;
+	
+	if (! server->running)
+		return;
+	
+	for (i = 0; i < server->n_shards; i++)
+	{
+		MtcShardItem *item = (MtcShardItem *) 
+			mtc_alloc(sizeof(MtcShardItem));
+		
+		item->type = MTC_SHARD_ITEM_STOP;
+		mtc_shard_push(server->shards[i], item);
+	}
+	
+	for (i = 0; i < server->n_shards; i++)
+	{
+		MtcShard *shard = server->shards[i];
+		
+		pthread_join(shard->thread, NULL);
+		shard->running = 0;
+	}
+	
+	server->running = 0;
+}
+
+int mtc_sharded_server_get_n_shards(MtcShardedServer *server)
+{
+	return server->n_shards;
+}
+
+MtcShard *mtc_sharded_server_get_shard(MtcShardedServer *server, int idx)
+{
+	if (idx < 0 || idx >= server->n_shards)
+		mtc_error("Invalid shard index %d", idx);
+	
+	return server->shards[idx];
+}
+
+MtcShard *mtc_sharded_server_get_current(MtcShardedServer *server)
+{
+	pthread_t self = pthread_self();
+	int i;
+	
+	for (i = 0; i < server->n_shards; i++)
+	{
+		MtcShard *shard = server->shards[i];
+		
+		if (shard->running && pthread_equal(shard->thread, self))
+			return shard;
+	}
+	
+	return NULL;
+}
+
+int mtc_sharded_server_sendto(MtcShardedServer *server, 
+	uint64_t peer_id, MtcMBlock addr, MtcMsg *payload)
+{
+	MtcShard *shard, *current;
+	MtcShardItem *item;
+	MtcMsg *mail;
+	int route;
+	
+	route = mtc_sharded_server_find_route(server, peer_id);
+	if (route < 0)
+		return -1;
+	
+	shard = server->shards[route];
+	mail = mtc_simple_router_serialize_mail(addr, NULL, payload);
+	
+	//Peers of the calling thread are sent to directly
+	current = mtc_sharded_server_get_current(server);
+	if (current == shard)
+	{
+		MtcShardPeer *sp = (MtcShardPeer *) mtc_id_table_lookup
+			(&(shard->peers), peer_id);
+		
+		//A peer being migrated here is not attached yet, 
+		//the mail then goes through the inbox behind it.
+		if (sp)
+		{
+			mtc_simple_peer_queue_mail(sp->peer, mail, 0);
+			mtc_msg_unref(mail);
+			
+			return 0;
+		}
+	}
+	
+	//Hand over a private copy to the other thread
+	item = (MtcShardItem *) mtc_alloc(sizeof(MtcShardItem));
+	item->type = MTC_SHARD_ITEM_SEND;
+	item->peer_id = peer_id;
+	item->mail = mtc_sta_msg_dup(mail);
+	mtc_msg_unref(mail);
+	
+	mtc_shard_push(shard, item);
+	
+	return 0;
+}
+
+void mtc_sharded_server_invoke(MtcShardedServer *server, int idx,
+	MtcShardFunc func, void *data)
+{
+	MtcShardItem *item;
+	
+	item = (MtcShardItem *) mtc_alloc(sizeof(MtcShardItem));
+	item->type = MTC_SHARD_ITEM_INVOKE;
+	item->func = func;
+	item->data = data;
+	
+	mtc_shard_push(mtc_sharded_server_get_shard(server, idx), item);
+}
+
+int mtc_shard_get_index(MtcShard *shard)
+{
+	return shard->idx;
+}
+
+MtcShardedServer *mtc_shard_get_server(MtcShard *shard)
+{
+	return shard->server;
+}
+
+MtcRouter *mtc_shard_get_router(MtcShard *shard)
+{
+	return shard->router;
+}
+
+MtcEventMgr *mtc_shard_get_event_mgr(MtcShard *shard)
+{
+	return shard->mgr;
+}
+
+MtcPeer *mtc_shard_lookup(MtcShard *shard, uint64_t peer_id)
+{
+	MtcShardPeer *sp;
+	
+	sp = (MtcShardPeer *) mtc_id_table_lookup(&(shard->peers), peer_id);
+	
+	return sp ? sp->peer : NULL;
+}
+
+int mtc_shard_migrate(MtcShard *shard, uint64_t peer_id, int dest)
+{
+	MtcShardedServer *server = shard->server;
+	MtcShardPeer *sp;
+	MtcShardItem *item;
+	MtcSimplePeerState *state;
+	
+	if (dest < 0 || dest >= server->n_shards)
+		mtc_error("Invalid shard index %d", dest);
+	if (dest == shard->idx)
+		return 0;
+	
+	sp = (MtcShardPeer *) mtc_id_table_lookup(&(shard->peers), peer_id);
+	if (! sp)
+		return -1;
+	
+	//Forget the peer without dropping its route
+	mtc_id_table_remove(&(shard->peers), (MtcIdEntry *) sp);
+	mtc_peer_reset_notify_remove(&(sp->notify));
+	
+	state = mtc_simple_peer_detach(sp->peer);
+	mtc_peer_unref(sp->peer);
+	mtc_free(sp);
+	
+	if (! state)
+	{
+		mtc_sharded_server_remove_route(server, peer_id);
+		return -1;
+	}
+	
+	//Attach the peer in the other thread. The route is changed 
+	//only afterwards, so mails sent to the peer in the meantime 
+	//are forwarded through the inboxes behind the attach request.
+	item = (MtcShardItem *) mtc_alloc(sizeof(MtcShardItem));
+	item->type = MTC_SHARD_ITEM_ATTACH;
+	item->peer_id = peer_id;
+	item->state = state;
+	
+	mtc_shard_push(server->shards[dest], item);
+	
+	mtc_sharded_server_set_route(server, peer_id, dest);
+	
+	return 0;
+}
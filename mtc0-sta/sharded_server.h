@@ -0,0 +1,203 @@
+/* sharded_server.h
+ * A multi-threaded server with one event loop and router per thread
+ * 
+ * Copyright 2013 Akash Rawal
+ * This file is part of MTC-Standalone.
+ * 
+ * MTC-Standalone is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * MTC-Standalone is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MTC-Standalone.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \addtogroup mtc_sharded_server
+ * \{
+ * 
+ * A sharded server runs several threads called shards. Every shard
+ * has its own event loop, simple router and listening socket, 
+ * and the kernel spreads incoming connections over the shards.
+ * 
+ * Every accepted peer gets an ID which can be used from any thread 
+ * to send mails to the peer using mtc_sharded_server_sendto().
+ * 
+ * MTC objects are not thread-safe. Objects belonging to a shard, 
+ * like its router and peers, must only be used from the thread of the
+ * shard, e.g. from the accepted callback or from a function run with
+ * mtc_sharded_server_invoke().
+ */
+
+///A multi-threaded server
+typedef struct _MtcShardedServer MtcShardedServer;
+
+///A thread of a sharded server
+typedef struct _MtcShard MtcShard;
+
+/**Callback called in the shard's thread when a connection is accepted.
+ * \param shard The shard that accepted the connection
+ * \param peer The new peer, belonging to router of the shard
+ * \param peer_id ID of the peer, unique within the server
+ * \param data User data
+ */
+typedef void (*MtcShardAcceptedFunc)
+	(MtcShard *shard, MtcPeer *peer, uint64_t peer_id, void *data);
+
+/**Function to run in a shard's thread
+ * \param shard The shard
+ * \param data User data
+ */
+typedef void (*MtcShardFunc)(MtcShard *shard, void *data);
+
+/**Creates a new sharded server. The threads are not started yet.
+ * \param n_shards No. of shards, i.e. threads.
+ * \return A new sharded server
+ */
+MtcShardedServer *mtc_sharded_server_new(int n_shards);
+
+/**Increments the reference count by 1
+ * \param server A sharded server
+ */
+void mtc_sharded_server_ref(MtcShardedServer *server);
+
+/**Decrements the reference count by 1. 
+ * The server is stopped before being destroyed.
+ * \param server A sharded server
+ */
+void mtc_sharded_server_unref(MtcShardedServer *server);
+
+/**Creates listening sockets for all shards bound to the same address
+ * using SO_REUSEPORT. Where SO_REUSEPORT cannot be used, e.g. for Unix 
+ * domain sockets, the shards share a single listening socket.
+ * Must be called before mtc_sharded_server_start().
+ * \param server A sharded server
+ * \param addr Address to listen on
+ * \param addr_len Size of the address
+ * \return 0 on success, -1 on failure with errno set.
+ */
+int mtc_sharded_server_listen(MtcShardedServer *server, 
+	const struct sockaddr *addr, socklen_t addr_len);
+
+/**Sets the function to call when a connection is accepted.
+ * Must be called before mtc_sharded_server_start().
+ * \param server A sharded server
+ * \param accepted The callback
+ * \param data User data for the callback
+ */
+void mtc_sharded_server_set_accepted(MtcShardedServer *server,
+	MtcShardAcceptedFunc accepted, void *data);
+
+/**Starts the threads.
+ * \param server A sharded server
+ */
+void mtc_sharded_server_start(MtcShardedServer *server);
+
+/**Disconnects all peers and stops the threads.
+ * Must not be called from a shard's thread.
+ * \param server A sharded server
+ */
+void mtc_sharded_server_stop(MtcShardedServer *server);
+
+/**Gets no. of shards
+ * \param server A sharded server
+ * \return No. of shards
+ */
+int mtc_sharded_server_get_n_shards(MtcShardedServer *server);
+
+/**Gets a shard
+ * \param server A sharded server
+ * \param idx Index of the shard
+ * \return The shard
+ */
+MtcShard *mtc_sharded_server_get_shard(MtcShardedServer *server, int idx);
+
+/**Gets the shard running in the calling thread
+ * \param server A sharded server
+ * \return The shard, or NULL if not called from a shard's thread.
+ */
+MtcShard *mtc_sharded_server_get_current(MtcShardedServer *server);
+
+/**Sends a mail to a peer of the server. Can be called from any thread.
+ * 
+ * When called from another thread than the peer's, a private copy of 
+ * the mail is handed over to the peer's thread. The caller's objects 
+ * are only used in the calling thread.
+ * \param server A sharded server
+ * \param peer_id ID of the peer
+ * \param addr Destination address
+ * \param payload The message to send
+ * \return 0 if the mail is on its way, -1 if there is no such peer.
+ */
+int mtc_sharded_server_sendto(MtcShardedServer *server, 
+	uint64_t peer_id, MtcMBlock addr, MtcMsg *payload);
+
+/**Runs a function in the thread of a shard. Can be called from any 
+ * thread. The function is run asynchronously, even when called 
+ * from the shard's own thread.
+ * \param server A sharded server
+ * \param idx Index of the shard
+ * \param func The function to run
+ * \param data User data for the function
+ */
+void mtc_sharded_server_invoke(MtcShardedServer *server, int idx,
+	MtcShardFunc func, void *data);
+
+/**Gets index of the shard
+ * \param shard A shard
+ * \return Index of the shard
+ */
+int mtc_shard_get_index(MtcShard *shard);
+
+/**Gets the server the shard belongs to
+ * \param shard A shard
+ * \return The server
+ */
+MtcShardedServer *mtc_shard_get_server(MtcShard *shard);
+
+/**Gets the simple router of the shard
+ * \param shard A shard
+ * \return The router
+ */
+MtcRouter *mtc_shard_get_router(MtcShard *shard);
+
+/**Gets the event manager of the shard
+ * \param shard A shard
+ * \return The event manager
+ */
+MtcEventMgr *mtc_shard_get_event_mgr(MtcShard *shard);
+
+/**Gets a peer of the shard by its ID. 
+ * Must be called from the shard's thread.
+ * \param shard A shard
+ * \param peer_id ID of the peer
+ * \return The peer, or NULL if the shard does not have such peer.
+ *         No reference is added.
+ */
+MtcPeer *mtc_shard_lookup(MtcShard *shard, uint64_t peer_id);
+
+/**Moves a peer of the shard to another shard, keeping its ID.
+ * Must be called from the shard's thread.
+ * 
+ * The connections of the peer are detached with 
+ * mtc_simple_peer_detach(), so no data is lost, and attached to the
+ * router of the other shard, where the accepted callback is called 
+ * again for the new peer object. The old peer object is reset.
+ * Mails sent with mtc_sharded_server_sendto() meanwhile are forwarded.
+ * \param shard The shard the peer belongs to
+ * \param peer_id ID of the peer
+ * \param dest Index of the shard to move the peer to
+ * \return 0 on success, -1 if the shard does not have such peer
+ *         or it is disconnected.
+ */
+int mtc_shard_migrate(MtcShard *shard, uint64_t peer_id, int dest);
+
+/**
+ * \}
+ */
@@ -24,9 +24,20 @@
 #include <mtc0-sta/simple_router_declares.h>
 #include <mtc0-sta/simple_router_defines.h>
 
+#include <limits.h>
 
 typedef struct _MtcSimplePeer MtcSimplePeer;
 
+//Timer for closing the peer when idle
+typedef struct
+{
+	MtcEventSource parent;
+	
+	MtcSimplePeer *peer;
+	MtcEventTestTimer timer;
+	MtcEventBackend *backend;
+} MtcSimpleIdle;
+
 struct _MtcSimplePeer
 {
 	MtcPeer parent;
@@ -34,9 +45,80 @@ struct _MtcSimplePeer
 	MtcRing peer_ring;
 	MtcLink *link;
 	MtcEventBackend *backend;
+	
+	//Extra links when the peer is bonded over several connections
+	struct
+	{
+		MtcLink **links;
+		MtcEventBackend **backends;
+		int len;
+		
+		//Link index for each slot of ordering keys, -1 if unassigned. 
+		//Assigned slots never change, so growing the bond does not 
+		//reorder mails. Keys are recorded even before the peer is 
+		//bonded, so that they stay on the primary link.
+		int *slots;
+	} bond;
+	
+	//Topic subscriptions
+	MtcRing subs;
+	
+	//No. of messages received, for telling progress in mtc_simple_sync_wait()
+	unsigned int n_received;
+	
+	//Strand for handing received mails to the dispatcher
+	MtcDispatchStrand *strand;
+	
+	//Present only when the router has an idle timeout
+	MtcSimpleIdle *idle;
+	
+	//Nesting count of mtc_simple_peer_cork()
+	int corked;
+	
+	//Micro-batching settings for all links
+	int64_t batch_delay;
+	size_t batch_bytes;
+	
+	//Queue policy for all links
+	MtcFDLinkQueuePolicy queue_policy;
+	size_t queue_limit;
+};
+
+typedef struct _MtcSimpleTopic MtcSimpleTopic;
+
+struct _MtcSimpleTopic
+{
+	MtcSimpleTopic *next;
+	
+	uint32_t hash;
+	MtcRing subs;
+	char name[];
 };
 
+typedef struct 
+{
+	MtcRing topic_ring;
+	MtcRing peer_ring;
+	MtcSimpleTopic *topic;
+	MtcSimplePeer *peer;
+} MtcSimpleSub;
+
 typedef struct _MtcSimpleRouter MtcSimpleRouter;
+typedef struct _MtcSimpleSyncPoll MtcSimpleSyncPoll;
+
+typedef struct _MtcSimpleRelay MtcSimpleRelay;
+
+struct _MtcSimpleRelay
+{
+	MtcSimpleRelay *next;
+	
+	MtcSimpleRouter *router;
+	MtcSimplePeer *peer;
+	MtcPeerResetNotify notify;
+	
+	size_t prefix_len;
+	char prefix[];
+};
 
 struct _MtcSimpleRouter
 {
@@ -44,17 +126,38 @@ struct _MtcSimpleRouter
 	
 	MtcRing peers;
 	
+	//Relay table, longest prefix first
+	MtcSimpleRelay *relays;
+	
+	//Hash table of topics having subscribers
+	struct
+	{
+		MtcSimpleTopic **buckets;
+		int n_buckets, len;
+	} topics;
+	
+	//Buffers for synchronous IO steps, reused between steps
+	MtcSimpleSyncPoll *sync_poll;
+	
+	//Time limit for synchronous IO steps started by MTC, -1 for none
+	int64_t sync_timeout;
+	
+	//Spinning before blocking in synchronous IO steps
 	struct
 	{
-		struct event_base *base;
-		MtcEventMgr *mgr;
-		MtcEventBackend *backend;
-		MtcSimplePeer *peer;
-	} sync_cache;
+		int64_t max_spin;
+		MtcSimpleBusyPollStats stats;
+	} busy_poll;
+	
+	//Peers idle for this long are closed, 0 for never
+	int64_t idle_timeout;
 	
 	MtcLinkAsyncFlush *flush;
+	
+	MtcDispatcher *dispatcher;
 };
 
+
 //Peer ring management
 
 #define mtc_simple_peer_from_ring(ring) \
@@ -92,331 +195,1767 @@ static void mtc_simple_router_init_ring(MtcSimpleRouter *self)
 	sentinel->prev = sentinel;
 }
 
-//Sync cache management
-static void mtc_simple_router_init_sync_cache(MtcSimpleRouter *self)
+//Relay table management
+
+static void mtc_simple_relay_destroy(MtcSimpleRelay *relay)
+{
+	MtcSimpleRelay **iter;
+	
+	for (iter = &(relay->router->relays); *iter; iter = &((*iter)->next))
+	{
+		if (*iter == relay)
+		{
+			*iter = relay->next;
+			break;
+		}
+	}
+	
+	mtc_peer_reset_notify_remove(&(relay->notify));
+	mtc_peer_unref((MtcPeer *) relay->peer);
+	mtc_free(relay);
+}
+
+static void mtc_simple_relay_reset_notify(MtcPeerResetNotify *notify)
 {
-	self->sync_cache.base = event_base_new();
-	self->sync_cache.mgr = mtc_lev_event_mgr_new
-		(self->sync_cache.base, 1);
-	self->sync_cache.backend = NULL;
-	self->sync_cache.peer = NULL;
+	MtcSimpleRelay *relay = mtc_encl_struct
+		(notify, MtcSimpleRelay, notify);
+	
+	mtc_simple_relay_destroy(relay);
 }
 
-static void mtc_simple_router_clear_sync_cache
-	(MtcSimpleRouter *self, MtcSimplePeer *clear_for)
+static MtcSimpleRelay *mtc_simple_router_find_relay
+	(MtcSimpleRouter *self, MtcMBlock addr, int exact)
 {
-	if (self->sync_cache.peer == clear_for)
+	MtcSimpleRelay *iter;
+	
+	for (iter = self->relays; iter; iter = iter->next)
 	{
-		mtc_event_backend_destroy(self->sync_cache.backend);
-		self->sync_cache.backend = NULL;
-		self->sync_cache.peer = NULL;
+		if (exact ? iter->prefix_len != addr.size 
+			: iter->prefix_len > addr.size)
+			continue;
+		if (memcmp(iter->prefix, addr.mem, iter->prefix_len) == 0)
+			break;
 	}
+	
+	return iter;
+}
+
+static void mtc_simple_router_destroy_relays(MtcSimpleRouter *self)
+{
+	while (self->relays)
+		mtc_simple_relay_destroy(self->relays);
 }
 
-static void mtc_simple_router_set_sync_cache
-	(MtcSimpleRouter *self, MtcSimplePeer *peer)
+//Topic subscription management
+
+#define MTC_TOPICS_MIN 16
+
+#define mtc_simple_sub_from_topic_ring(ring) \
+	((MtcSimpleSub *) \
+		(MTC_PTR_ADD((ring), - offsetof(MtcSimpleSub, topic_ring))))
+
+#define mtc_simple_sub_from_peer_ring(ring) \
+	((MtcSimpleSub *) \
+		(MTC_PTR_ADD((ring), - offsetof(MtcSimpleSub, peer_ring))))
+
+static uint32_t mtc_simple_topic_hash(const char *name)
 {
-	if (self->sync_cache.peer != peer)
+	//FNV-1a
+	uint32_t hash = 2166136261u;
+	
+	for (; *name; name++)
 	{
-		if (self->sync_cache.peer)
-		{
-			mtc_event_backend_destroy(self->sync_cache.backend);
-			self->sync_cache.backend = NULL;
-			self->sync_cache.peer = NULL;
-		}
-		if (peer)
-		{
-			self->sync_cache.peer = peer;
-			self->sync_cache.backend = mtc_event_mgr_back
-				(self->sync_cache.mgr, (MtcEventSource *) 
-				mtc_link_get_event_source(peer->link));
-		}
+		hash ^= (unsigned char) *name;
+		hash *= 16777619u;
 	}
+	
+	return hash;
 }
 
-static void mtc_simple_router_destroy_sync_cache
-	(MtcSimpleRouter *self)
+static void mtc_simple_ring_insert(MtcRing *sentinel, MtcRing *ring)
 {
-	mtc_simple_router_set_sync_cache(self, NULL);
-	mtc_event_mgr_unref(self->sync_cache.mgr);
+	ring->next = sentinel;
+	ring->prev = sentinel->prev;
+	ring->next->prev = ring;
+	ring->prev->next = ring;
 }
 
-//IO management
-static void mtc_simple_peer_set_backend
-	(MtcSimplePeer *peer, MtcEventMgr *mgr)
+static void mtc_simple_ring_remove(MtcRing *ring)
 {
-	if (peer->backend)
+	ring->next->prev = ring->prev;
+	ring->prev->next = ring->next;
+	ring->next = ring;
+	ring->prev = ring;
+}
+
+static MtcSimpleTopic *mtc_simple_router_find_topic
+	(MtcSimpleRouter *self, const char *name, uint32_t hash)
+{
+	MtcSimpleTopic *iter;
+	
+	if (! self->topics.n_buckets)
+		return NULL;
+	
+	iter = self->topics.buckets[hash & (self->topics.n_buckets - 1)];
+	for (; iter; iter = iter->next)
 	{
-		mtc_event_backend_destroy(peer->backend);
-		peer->backend = NULL;
+		if (iter->hash == hash && strcmp(iter->name, name) == 0)
+			break;
 	}
-	if (mgr)
+	
+	return iter;
+}
+
+static void mtc_simple_router_resize_topics
+	(MtcSimpleRouter *self, int n_buckets)
+{
+	MtcSimpleTopic **buckets, *iter, *next;
+	int i;
+	
+	buckets = (MtcSimpleTopic **) mtc_alloc
+		(sizeof(MtcSimpleTopic *) * n_buckets);
+	for (i = 0; i < n_buckets; i++)
+		buckets[i] = NULL;
+	
+	for (i = 0; i < self->topics.n_buckets; i++)
 	{
-		MtcLinkEventSource *source 
-			= mtc_link_get_event_source(peer->link);
+		for (iter = self->topics.buckets[i]; iter; iter = next)
+		{
+			MtcSimpleTopic **bucket = buckets + (iter->hash & (n_buckets - 1));
 			
-		peer->backend = mtc_event_mgr_back
-			(mgr, (MtcEventSource *) source);
+			next = iter->next;
+			iter->next = *bucket;
+			*bucket = iter;
+		}
 	}
+	
+	if (self->topics.buckets)
+		mtc_free(self->topics.buckets);
+	self->topics.buckets = buckets;
+	self->topics.n_buckets = n_buckets;
 }
 
-static void mtc_simple_peer_close(MtcSimplePeer *peer)
+static MtcSimpleTopic *mtc_simple_router_add_topic
+	(MtcSimpleRouter *self, const char *name, uint32_t hash)
 {
-	if (peer->link)
+	MtcSimpleTopic *topic, **bucket;
+	size_t name_len = strlen(name);
+	
+	//Grow the table to keep chains short
+	if (self->topics.len >= self->topics.n_buckets)
+		mtc_simple_router_resize_topics(self, self->topics.n_buckets ? 
+			self->topics.n_buckets * 2 : MTC_TOPICS_MIN);
+	
+	topic = (MtcSimpleTopic *) mtc_alloc
+		(sizeof(MtcSimpleTopic) + name_len + 1);
+	topic->hash = hash;
+	topic->subs.next = topic->subs.prev = &(topic->subs);
+	memcpy(topic->name, name, name_len + 1);
+	
+	bucket = self->topics.buckets + (hash & (self->topics.n_buckets - 1));
+	topic->next = *bucket;
+	*bucket = topic;
+	self->topics.len++;
+	
+	return topic;
+}
+
+static void mtc_simple_router_remove_topic
+	(MtcSimpleRouter *self, MtcSimpleTopic *topic)
+{
+	MtcSimpleTopic **iter;
+	
+	iter = self->topics.buckets + (topic->hash & (self->topics.n_buckets - 1));
+	for (; *iter; iter = &((*iter)->next))
 	{
-		MtcSimpleRouter *router = (MtcSimpleRouter *) 
-			mtc_peer_get_router(peer);
-		
-		mtc_simple_router_clear_sync_cache(router, peer);
-		
-		mtc_simple_peer_remove(peer);
-		
-		mtc_link_async_flush_add(router->flush, peer->link);
-		mtc_link_unref(peer->link);
-		peer->link = NULL;
+		if (*iter == topic)
+		{
+			*iter = topic->next;
+			break;
+		}
 	}
+	
+	mtc_free(topic);
+	self->topics.len--;
 }
 
-static void mtc_simple_peer_discard(MtcSimplePeer *peer)
+static void mtc_simple_sub_destroy(MtcSimpleSub *sub)
 {
-	if (peer->link)
+	MtcSimpleTopic *topic = sub->topic;
+	
+	mtc_simple_ring_remove(&(sub->topic_ring));
+	mtc_simple_ring_remove(&(sub->peer_ring));
+	
+	//Topics without subscribers are not kept
+	if (topic->subs.next == &(topic->subs))
 	{
 		MtcSimpleRouter *router = (MtcSimpleRouter *) 
-			mtc_peer_get_router(peer);
-		
-		mtc_simple_router_clear_sync_cache(router, peer);
-		
-		mtc_simple_peer_remove(peer);
+			mtc_peer_get_router(sub->peer);
+		mtc_simple_router_remove_topic(router, topic);
+	}
+	
+	mtc_free(sub);
+}
+
+static MtcSimpleSub *mtc_simple_peer_find_sub
+	(MtcSimplePeer *peer, MtcSimpleTopic *topic)
+{
+	MtcRing *r, *sentinel = &(peer->subs);
+	
+	for (r = sentinel->next; r != sentinel; r = r->next)
+	{
+		MtcSimpleSub *sub = mtc_simple_sub_from_peer_ring(r);
 		
-		mtc_simple_peer_set_backend(peer, NULL);
-		mtc_link_set_events_enabled(peer->link, 0);
-		mtc_link_unref(peer->link);
-		peer->link = NULL;
+		if (sub->topic == topic)
+			return sub;
 	}
+	
+	return NULL;
 }
 
-static void mtc_simple_peer_broken_respond(MtcSimplePeer *peer)
+static void mtc_simple_peer_clear_subs(MtcSimplePeer *peer)
 {
-	mtc_simple_peer_discard(peer);
+	MtcRing *sentinel = &(peer->subs);
 	
-	mtc_peer_reset((MtcPeer *) peer);
+	while (sentinel->next != sentinel)
+		mtc_simple_sub_destroy(mtc_simple_sub_from_peer_ring(sentinel->next));
 }
 
-static void mtc_simple_peer_deliver
-	(MtcSimplePeer *peer, MtcLinkInData in_data)
+static void mtc_simple_router_destroy_topics(MtcSimpleRouter *self)
 {
-	MtcSimpleMail mail;
+	if (self->topics.len)
+		mtc_error("Topics still remaining with router in destruction");
 	
-	if (in_data.stop)
-		mtc_simple_peer_broken_respond(peer);
+	if (self->topics.buckets)
+		mtc_free(self->topics.buckets);
+	self->topics.buckets = NULL;
+	self->topics.n_buckets = 0;
+}
+
+//Synchronous IO
+
+//Buffers for polling links of a peer
+struct _MtcSimpleSyncPoll
+{
+	//Links of the peers, no. of poll() entries for each, 
+	//and index of the peer each belongs to
+	MtcLink **links;
+	int *n_entries;
+	int *owners;
+	int n_links, alen;
 	
-	//Deserialize the mail
-	if (MtcSimpleMail__deserialize(in_data.msg, &mail) < 0)
-	{
-		mtc_simple_peer_broken_respond(peer);
-		return;
-	}
+	struct pollfd *fds;
+	int n_fds;
+};
+
+static MtcSimpleSyncPoll *mtc_simple_sync_poll_new(int alen)
+{
+	MtcSimpleSyncPoll *sp;
 	
-	//Deliver mail
-	mtc_router_deliver(mtc_peer_get_router(peer), mail.dest,
-		(MtcPeer *) peer, mail.ret, mail.payload);
+	sp = (MtcSimpleSyncPoll *) mtc_alloc(sizeof(MtcSimpleSyncPoll));
+	sp->links = (MtcLink **) mtc_alloc(sizeof(MtcLink *) * alen);
+	sp->n_entries = (int *) mtc_alloc(sizeof(int) * alen);
+	sp->owners = (int *) mtc_alloc(sizeof(int) * alen);
+	sp->fds = (struct pollfd *) mtc_alloc
+		(sizeof(struct pollfd) * MTC_FD_LINK_MAX_POLLFDS * alen);
+	sp->n_links = 0;
+	sp->n_fds = 0;
+	sp->alen = alen;
 	
-	//Free data
-	MtcSimpleMail__free(&mail);
+	return sp;
 }
 
-static void mtc_simple_peer_received_cb
-	(MtcLink *link, MtcLinkInData in_data, void *data)
+static void mtc_simple_sync_poll_free(MtcSimpleSyncPoll *sp)
 {
-	MtcSimplePeer *peer = (MtcSimplePeer *) data;
+	mtc_free(sp->links);
+	mtc_free(sp->n_entries);
+	mtc_free(sp->owners);
+	mtc_free(sp->fds);
+	mtc_free(sp);
+}
+
+//Adds poll() entries for all links of the peer. 
+//There must be room for peer->bond.len + 1 more links.
+static void mtc_simple_sync_poll_add
+	(MtcSimpleSyncPoll *sp, MtcSimplePeer *peer, int owner)
+{
+	int i, idx;
 	
-	mtc_simple_peer_deliver(peer, in_data);
+	for (i = 0; i <= peer->bond.len; i++)
+	{
+		idx = sp->n_links++;
+		sp->links[idx] = i ? peer->bond.links[i - 1] : peer->link;
+		sp->owners[idx] = owner;
+		sp->n_entries[idx] = mtc_fd_link_poll_fill
+			(sp->links[idx], sp->fds + sp->n_fds);
+		sp->n_fds += sp->n_entries[idx];
+	}
 }
 
-static void mtc_simple_peer_broken_cb
-	(MtcLink *link, void *data)
+//Fills poll() entries for all links of the peer, returns no. of entries
+static int mtc_simple_sync_poll_fill
+	(MtcSimpleSyncPoll *sp, MtcSimplePeer *peer)
 {
-	MtcSimplePeer *peer = (MtcSimplePeer *) data;
+	sp->n_links = 0;
+	sp->n_fds = 0;
+	mtc_simple_sync_poll_add(sp, peer, 0);
 	
-	mtc_simple_peer_broken_respond(peer);
+	return sp->n_fds;
 }
 
-static void mtc_simple_peer_setup_events(MtcSimplePeer *peer)
+//Converts a deadline to a poll() timeout, 0 if the deadline is past. 
+//Rounds up so that the wait does not end early.
+static int mtc_simple_sync_timeout(int64_t deadline)
 {
-	//RULE: called by constructor
-	MtcLinkEventSource *source = mtc_link_get_event_source(peer->link);
+	int64_t remaining;
 	
-	source->received = mtc_simple_peer_received_cb;
-	source->broken = mtc_simple_peer_broken_cb;
-	source->stopped = mtc_simple_peer_broken_cb;
-	source->data = (void *) peer;
+	if (deadline < 0)
+		return -1;
+	
+	remaining = deadline - mtc_sta_get_time();
+	if (remaining <= 0)
+		return 0;
+	if (remaining / 1000 >= INT_MAX)
+		return INT_MAX;
 	
-	mtc_link_set_events_enabled(peer->link, 1);
+	return (remaining + 999) / 1000;
 }
 
-
-//Implementation vtable
-
-static void mtc_simple_router_set_event_mgr
-	(MtcRouter *router, MtcEventMgr *mgr)
+//Does the IO poll() found the links ready for
+static void mtc_simple_sync_poll_dispatch(MtcSimpleSyncPoll *sp)
 {
-	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	int i, n_fds = 0;
 	
-	MtcSimplePeer *iter;
-	MtcRing *r, *sentinel = &(self->peers);
+	//Callbacks may reset the peer, keep the links alive meanwhile
+	for (i = 0; i < sp->n_links; i++)
+		mtc_link_ref(sp->links[i]);
 	
-	for (r = sentinel->next; r != sentinel; r = r->next)
+	for (i = 0; i < sp->n_links; i++)
 	{
-		iter = mtc_simple_peer_from_ring(r);
-		
-		mtc_simple_peer_set_backend(iter, mgr);
+		if (sp->n_entries[i])
+			mtc_fd_link_poll_dispatch(sp->links[i], sp->fds + n_fds);
+		n_fds += sp->n_entries[i];
 	}
+	
+	for (i = 0; i < sp->n_links; i++)
+		mtc_link_unref(sp->links[i]);
 }
 
-static void mtc_simple_peer_sendto(MtcPeer *p, 
-	MtcMBlock addr,
-	MtcDest *reply_dest, MtcMsg *payload)
+//IO management
+//nonblocking tells that fd is already in nonblocking mode
+static MtcLink *mtc_simple_link_new(int fd, int close_fd, int nonblocking)
 {
-	MtcSimplePeer *peer = (MtcSimplePeer *) p;
-	MtcSimpleMail mail;
-	MtcMsg *mail_msg;
+	MtcLink *link;
 	
-	//Don't send if disposed
-	if (! peer->link)
-	{
-		mtc_peer_reset(p);
-		return;
-	}
+	link = mtc_fd_link_new(fd, fd);
+	mtc_fd_link_set_close_fd(link, close_fd);
+	if (! nonblocking)
+		mtc_fd_set_blocking(fd, 0);
 	
-	//Prepare mail
-	mail.dest = addr;
-	mtc_rcmem_ref(addr.mem);
-	if (reply_dest)
+	return link;
+}
+
+//Idle timeout
+
+static void mtc_simple_peer_clear_idle(MtcSimplePeer *peer)
+{
+	if (peer->idle)
 	{
-		mail.ret = mtc_dest_get_addr(reply_dest);
+		if (peer->idle->backend)
+			mtc_event_backend_destroy(peer->idle->backend);
+		mtc_event_source_destroy((MtcEventSource *) peer->idle);
+		mtc_free(peer->idle);
+		peer->idle = NULL;
 	}
-	else
+}
+
+//Gets when any link of the peer last did IO
+static int64_t mtc_simple_peer_get_last_active(MtcSimplePeer *peer)
+{
+	int64_t res, val;
+	int i;
+	
+	res = mtc_fd_link_get_last_active(peer->link);
+	for (i = 0; i < peer->bond.len; i++)
 	{
-		mail.ret.mem = NULL;
-		mail.ret.size = 0;
+		val = mtc_fd_link_get_last_active(peer->bond.links[i]);
+		if (val > res)
+			res = val;
 	}
-	mail.payload = payload;
-	mtc_msg_ref(payload);
-	
-	//Serialize
-	mail_msg = MtcSimpleMail__serialize(&mail);
-	
-	//Send mail
-	mtc_link_queue(peer->link, mail_msg, 0);
 	
-	//Free
-	mtc_msg_unref(mail_msg);
-	MtcSimpleMail__free(&mail);
+	return res;
 }
 
-static int mtc_simple_peer_sync_io_step(MtcPeer *p)
+//Arms the timer for when the peer becomes idle
+static void mtc_simple_idle_arm(MtcSimpleIdle *idle)
 {
-	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	MtcSimplePeer *peer = idle->peer;
 	MtcSimpleRouter *router = (MtcSimpleRouter *) 
 		mtc_peer_get_router(peer);
-	int status;
-	
-	mtc_simple_router_set_sync_cache(router, peer);
-	
-	status = event_base_loop(router->sync_cache.base, EVLOOP_ONCE);
 	
-	if (status < 0)
-		return -1;
-	else if (peer->link)
-		return 0;
-	else
-		return -1;
+	mtc_event_test_timer_init(&(idle->timer), 
+		mtc_simple_peer_get_last_active(peer) + router->idle_timeout, 0);
+	mtc_event_source_prepare
+		((MtcEventSource *) idle, (MtcEventTest *) &(idle->timer));
 }
 
-static void mtc_simple_peer_destroy(MtcPeer *p)
+static void mtc_simple_idle_event
+	(MtcEventSource *source, MtcEventFlags event)
 {
-	MtcSimplePeer *peer = (MtcSimplePeer *) p;
-	
-	mtc_simple_peer_close(peer);
+	MtcSimpleIdle *idle = (MtcSimpleIdle *) source;
+	MtcSimplePeer *peer = idle->peer;
+	MtcSimpleRouter *router = (MtcSimpleRouter *) 
+		mtc_peer_get_router(peer);
 	
-	mtc_peer_destroy(p);
+	if (! ((event & MTC_EVENT_CHECK) && idle->timer.fired))
+		return;
 	
-	mtc_free(p);
+	//IO does not touch the timer, so check whether the peer 
+	//was active since the timer was armed.
+	if (mtc_sta_get_time() - mtc_simple_peer_get_last_active(peer)
+		>= router->idle_timeout)
+		mtc_simple_peer_disconnect((MtcPeer *) peer);
+	else
+		mtc_simple_idle_arm(idle);
 }
 
-static void mtc_simple_router_destroy(MtcRouter *router)
+static MtcEventSourceVTable mtc_simple_idle_vtable =
 {
-	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	mtc_simple_idle_event,
+	MTC_EVENT_CHECK
+};
+
+//Sets up or removes the idle timer according to the router
+static void mtc_simple_peer_setup_idle
+	(MtcSimplePeer *peer, MtcEventMgr *mgr)
+{
+	MtcSimpleRouter *router = (MtcSimpleRouter *) 
+		mtc_peer_get_router(peer);
+	MtcSimpleIdle *idle;
+	
+	if ((! router->idle_timeout) || (! mgr) || (! peer->link))
+	{
+		mtc_simple_peer_clear_idle(peer);
+		return;
+	}
+	
+	if (! peer->idle)
+	{
+		idle = (MtcSimpleIdle *) mtc_alloc(sizeof(MtcSimpleIdle));
+		mtc_event_source_init
+			((MtcEventSource *) idle, &mtc_simple_idle_vtable);
+		idle->peer = peer;
+		idle->backend = NULL;
+		peer->idle = idle;
+	}
+	idle = peer->idle;
+	
+	mtc_simple_idle_arm(idle);
+	if (idle->backend)
+		mtc_event_backend_destroy(idle->backend);
+	idle->backend = mtc_event_mgr_back(mgr, (MtcEventSource *) idle);
+}
+
+static void mtc_simple_peer_set_backend
+	(MtcSimplePeer *peer, MtcEventMgr *mgr)
+{
+	int i;
+	
+	if (peer->backend)
+	{
+		mtc_event_backend_destroy(peer->backend);
+		peer->backend = NULL;
+	}
+	for (i = 0; i < peer->bond.len; i++)
+	{
+		if (peer->bond.backends[i])
+		{
+			mtc_event_backend_destroy(peer->bond.backends[i]);
+			peer->bond.backends[i] = NULL;
+		}
+	}
+	if (mgr)
+	{
+		MtcLinkEventSource *source 
+			= mtc_link_get_event_source(peer->link);
+			
+		peer->backend = mtc_event_mgr_back
+			(mgr, (MtcEventSource *) source);
+		
+		for (i = 0; i < peer->bond.len; i++)
+		{
+			source = mtc_link_get_event_source(peer->bond.links[i]);
+			peer->bond.backends[i] = mtc_event_mgr_back
+				(mgr, (MtcEventSource *) source);
+		}
+	}
+	
+	mtc_simple_peer_setup_idle(peer, mgr);
+}
+
+static void mtc_simple_peer_clear_bond(MtcSimplePeer *peer)
+{
+	if (peer->bond.links)
+	{
+		mtc_free(peer->bond.links);
+		mtc_free(peer->bond.backends);
+	}
+	if (peer->bond.slots)
+		mtc_free(peer->bond.slots);
+	peer->bond.links = NULL;
+	peer->bond.backends = NULL;
+	peer->bond.len = 0;
+	peer->bond.slots = NULL;
+}
+
+static void mtc_simple_peer_clear_strand(MtcSimplePeer *peer)
+{
+	if (peer->strand)
+	{
+		mtc_dispatch_strand_unref(peer->strand);
+		peer->strand = NULL;
+	}
+}
+
+//Corks or uncorks all links of the peer once
+static void mtc_simple_peer_cork_links(MtcSimplePeer *peer, int value)
+{
+	int i;
+	
+	if (value)
+		mtc_fd_link_cork(peer->link);
+	else
+		mtc_fd_link_uncork(peer->link);
+	
+	for (i = 0; i < peer->bond.len; i++)
+	{
+		if (value)
+			mtc_fd_link_cork(peer->bond.links[i]);
+		else
+			mtc_fd_link_uncork(peer->bond.links[i]);
+	}
+}
+
+//Releases the links from any pending cork before they leave the peer
+static void mtc_simple_peer_clear_cork(MtcSimplePeer *peer)
+{
+	if (peer->corked)
+	{
+		mtc_simple_peer_cork_links(peer, 0);
+		peer->corked = 0;
+	}
+}
+
+static void mtc_simple_peer_close(MtcSimplePeer *peer)
+{
+	if (peer->link)
+	{
+		MtcSimpleRouter *router = (MtcSimpleRouter *) 
+			mtc_peer_get_router(peer);
+		int i;
+		
+		mtc_simple_peer_remove(peer);
+		mtc_simple_peer_clear_subs(peer);
+		mtc_simple_peer_clear_strand(peer);
+		mtc_simple_peer_clear_idle(peer);
+		mtc_simple_peer_clear_cork(peer);
+		
+		mtc_link_async_flush_add(router->flush, peer->link);
+		mtc_link_unref(peer->link);
+		peer->link = NULL;
+		
+		for (i = 0; i < peer->bond.len; i++)
+		{
+			mtc_link_async_flush_add(router->flush, peer->bond.links[i]);
+			mtc_link_unref(peer->bond.links[i]);
+		}
+		mtc_simple_peer_clear_bond(peer);
+	}
+}
+
+static void mtc_simple_peer_discard(MtcSimplePeer *peer)
+{
+	if (peer->link)
+	{
+		int i;
+		
+		mtc_simple_peer_remove(peer);
+		mtc_simple_peer_clear_subs(peer);
+		mtc_simple_peer_clear_strand(peer);
+		mtc_simple_peer_clear_idle(peer);
+		mtc_simple_peer_clear_cork(peer);
+		
+		mtc_simple_peer_set_backend(peer, NULL);
+		mtc_link_set_events_enabled(peer->link, 0);
+		mtc_link_unref(peer->link);
+		peer->link = NULL;
+		
+		for (i = 0; i < peer->bond.len; i++)
+		{
+			mtc_link_set_events_enabled(peer->bond.links[i], 0);
+			mtc_link_unref(peer->bond.links[i]);
+		}
+		mtc_simple_peer_clear_bond(peer);
+	}
+}
+
+//Picks the link to send over. Nonnegative keys always map to the same 
+//link, negative key picks the link with least unsent data.
+static MtcLink *mtc_simple_peer_pick_link(MtcSimplePeer *peer, int key)
+{
+	size_t res_size;
+	int i, res, *slot;
+	
+	if (key < 0 && ! peer->bond.len)
+		return peer->link;
+	
+	if (key >= 0)
+	{
+		if (! peer->bond.slots)
+		{
+			peer->bond.slots = (int *) mtc_alloc
+				(sizeof(int) * MTC_SIMPLE_BOND_SLOTS);
+			for (i = 0; i < MTC_SIMPLE_BOND_SLOTS; i++)
+				peer->bond.slots[i] = -1;
+		}
+		
+		slot = peer->bond.slots + (key % MTC_SIMPLE_BOND_SLOTS);
+		if (*slot >= 0)
+			return *slot ? peer->bond.links[*slot - 1] : peer->link;
+	}
+	else
+		slot = NULL;
+	
+	//Least unsent data, which also favours links added recently
+	res = 0;
+	res_size = mtc_fd_link_get_unsent_size(peer->link);
+	for (i = 0; i < peer->bond.len; i++)
+	{
+		size_t size = mtc_fd_link_get_unsent_size(peer->bond.links[i]);
+		
+		if (size < res_size)
+		{
+			res = i + 1;
+			res_size = size;
+		}
+	}
+	
+	if (slot)
+		*slot = res;
+	
+	return res ? peer->bond.links[res - 1] : peer->link;
+}
+
+static void mtc_simple_peer_broken_respond(MtcSimplePeer *peer)
+{
+	mtc_simple_peer_discard(peer);
+	
+	mtc_peer_reset((MtcPeer *) peer);
+}
+
+//Hands a received mail to a handler thread
+static void mtc_simple_peer_dispatch
+	(MtcSimplePeer *peer, MtcLink *link, MtcMsg *mail_msg)
+{
+	MtcSimpleRouter *router = (MtcSimpleRouter *) 
+		mtc_peer_get_router(peer);
+	MtcMsg *msg;
+	
+	if (! peer->strand)
+	{
+		MtcFDLinkRemote *remote = mtc_simple_peer_get_remote
+			((MtcPeer *) peer);
+		
+		peer->strand = mtc_dispatch_strand_new
+			(router->dispatcher, remote);
+		if (remote)
+			mtc_fd_link_remote_unref(remote);
+	}
+	
+	//The received message is private, so it is handed over as it is
+	msg = mtc_fd_link_take_received(link);
+	if (! msg)
+		msg = mtc_sta_msg_dup(mail_msg);
+	
+	mtc_dispatch_strand_push(peer->strand, msg);
+}
+
+static void mtc_simple_peer_deliver
+	(MtcSimplePeer *peer, MtcLink *link, MtcLinkInData in_data)
+{
+	MtcSimpleRouter *router = (MtcSimpleRouter *) 
+		mtc_peer_get_router(peer);
+	MtcSimpleMail mail;
+	MtcSimpleRelay *relay;
+	
+	if (in_data.stop)
+		mtc_simple_peer_broken_respond(peer);
+	
+	//Without relay entries, the handler thread deserializes the mail
+	if (router->dispatcher && (! router->relays))
+	{
+		mtc_simple_peer_dispatch(peer, link, in_data.msg);
+		return;
+	}
+	
+	//Deserialize the mail
+	if (MtcSimpleMail__deserialize(in_data.msg, &mail) < 0)
+	{
+		mtc_simple_peer_broken_respond(peer);
+		return;
+	}
+	
+	relay = mtc_simple_router_find_relay(router, mail.dest, 0);
+	if (relay && relay->peer == peer)
+	{
+		//Sending it back would bounce it between the peers forever
+		mtc_warn("Mail from peer %p matches a relay entry pointing "
+		         "back to it, dropping mail.", peer);
+	}
+	else if (relay)
+	{
+		//Forward the mail as it was received, 
+		//the received blocks are queued on the other link directly.
+		mtc_simple_peer_queue_mail((MtcPeer *) relay->peer, in_data.msg, 0);
+	}
+	else if (router->dispatcher)
+	{
+		//Nothing may refer to the message once it is handed over
+		MtcSimpleMail__free(&mail);
+		mtc_simple_peer_dispatch(peer, link, in_data.msg);
+		return;
+	}
+	else
+	{
+		//Deliver mail
+		mtc_router_deliver((MtcRouter *) router, mail.dest,
+			(MtcPeer *) peer, mail.ret, mail.payload);
+	}
+	
+	//Free data
+	MtcSimpleMail__free(&mail);
+}
+
+static void mtc_simple_peer_received_cb
+	(MtcLink *link, MtcLinkInData in_data, void *data)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) data;
+	
+	peer->n_received++;
+	mtc_simple_peer_deliver(peer, link, in_data);
+}
+
+static void mtc_simple_peer_broken_cb
+	(MtcLink *link, void *data)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) data;
+	
+	mtc_simple_peer_broken_respond(peer);
+}
+
+//Lets the kernel busy poll the device queue when reading from the link
+static void mtc_simple_link_set_busy_poll(MtcLink *link, int64_t usec)
+{
+#ifdef SO_BUSY_POLL
+	int val = usec > INT_MAX ? INT_MAX : (int) usec;
+	
+	//Not a socket, or not permitted: spinning in userspace still works
+	setsockopt(mtc_fd_link_get_in_fd(link), SOL_SOCKET, SO_BUSY_POLL, 
+		&val, sizeof(int));
+#endif
+}
+
+static void mtc_simple_peer_setup_events
+	(MtcSimplePeer *peer, MtcLink *link)
+{
+	//RULE: called by constructor and when adding a link to bond
+	MtcLinkEventSource *source = mtc_link_get_event_source(link);
+	MtcSimpleRouter *router = (MtcSimpleRouter *) 
+		mtc_peer_get_router(peer);
+	
+	source->received = mtc_simple_peer_received_cb;
+	source->broken = mtc_simple_peer_broken_cb;
+	source->stopped = mtc_simple_peer_broken_cb;
+	source->data = (void *) peer;
+	
+	mtc_link_set_events_enabled(link, 1);
+	
+	if (router->busy_poll.max_spin)
+		mtc_simple_link_set_busy_poll(link, router->busy_poll.max_spin);
+}
+
+
+//Implementation vtable
+
+static void mtc_simple_router_set_event_mgr
+	(MtcRouter *router, MtcEventMgr *mgr)
+{
+	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	
+	MtcSimplePeer *iter;
+	MtcRing *r, *sentinel = &(self->peers);
+	
+	for (r = sentinel->next; r != sentinel; r = r->next)
+	{
+		iter = mtc_simple_peer_from_ring(r);
+		
+		mtc_simple_peer_set_backend(iter, mgr);
+	}
+}
+
+static void mtc_simple_peer_sendto(MtcPeer *p, 
+	MtcMBlock addr,
+	MtcDest *reply_dest, MtcMsg *payload)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	MtcMsg *mail_msg;
+	
+	//Don't send if disposed
+	if (! peer->link)
+	{
+		mtc_peer_reset(p);
+		return;
+	}
+	
+	//Serialize
+	mail_msg = mtc_simple_router_serialize_mail(addr, reply_dest, payload);
+	
+	//Send mail
+	mtc_link_queue(peer->link, mail_msg, 0);
+	
+	//Free
+	mtc_msg_unref(mail_msg);
+}
+
+int64_t mtc_simple_get_time(void)
+{
+	return mtc_sta_get_time();
+}
+
+//Spins on poll() without sleeping, for up to the adaptive budget. 
+//Returns result of the last poll().
+static int mtc_simple_router_spin(MtcSimpleRouter *self, 
+	struct pollfd *fds, int n_fds, int64_t start, int64_t deadline)
+{
+	int64_t limit = start + self->busy_poll.stats.budget;
+	int status;
+	
+	if (deadline >= 0 && deadline < limit)
+		limit = deadline;
+	
+	do
+	{
+		status = poll(fds, n_fds, 0);
+		if (status != 0)
+			return status;
+	} while (mtc_sta_get_time() < limit);
+	
+	return 0;
+}
+
+//Adapts the spin budget to the time the links took to become ready
+static void mtc_simple_router_feed_busy_poll
+	(MtcSimpleRouter *self, int64_t wait)
+{
+	MtcSimpleBusyPollStats *stats = &(self->busy_poll.stats);
+	
+	//Moving average with weight 1/8 for the new sample
+	stats->avg_wait += (wait - stats->avg_wait) / 8;
+	
+	//Spin long enough to catch most responses, 
+	//but don't spin at all if they are usually slower than max_spin
+	stats->budget = stats->avg_wait * 2;
+	if (stats->budget > self->busy_poll.max_spin)
+		stats->budget = 0;
+}
+
+MtcSimpleSyncStatus mtc_simple_peer_sync_io_step_until
+	(MtcPeer *p, int64_t deadline)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	MtcSimpleRouter *router = (MtcSimpleRouter *) 
+		mtc_peer_get_router(peer);
+	MtcSimpleSyncPoll *sp;
+	int n_fds, timeout = -1, status = 0;
+	int64_t start = 0;
+	MtcSimpleSyncStatus res = MTC_SIMPLE_SYNC_OK;
+	
+	if (! peer->link)
+		return MTC_SIMPLE_SYNC_FAIL;
+	
+	if (deadline >= 0 || router->busy_poll.max_spin)
+		start = mtc_sta_get_time();
+	if (deadline >= 0 && deadline <= start)
+		return MTC_SIMPLE_SYNC_TIMEOUT;
+	
+	//Take the buffers, callbacks may start another step
+	sp = router->sync_poll;
+	router->sync_poll = NULL;
+	if (sp && sp->alen < peer->bond.len + 1)
+	{
+		mtc_simple_sync_poll_free(sp);
+		sp = NULL;
+	}
+	if (! sp)
+		sp = mtc_simple_sync_poll_new(peer->bond.len + 1);
+	
+	//Poll the links directly, without going through an event manager
+	n_fds = mtc_simple_sync_poll_fill(sp, peer);
+	if (n_fds)
+	{
+		//Spin first in busy poll mode
+		if (router->busy_poll.max_spin && router->busy_poll.stats.budget)
+		{
+			status = mtc_simple_router_spin
+				(router, sp->fds, n_fds, start, deadline);
+			if (status > 0)
+				router->busy_poll.stats.n_hits++;
+			else if (status == 0)
+				router->busy_poll.stats.n_misses++;
+		}
+		
+		//Then sleep
+		if (status == 0)
+		{
+			timeout = mtc_simple_sync_timeout(deadline);
+			status = poll(sp->fds, n_fds, timeout);
+		}
+		
+		if (status > 0 && router->busy_poll.max_spin)
+			mtc_simple_router_feed_busy_poll
+				(router, mtc_sta_get_time() - start);
+		
+		if (status > 0)
+			mtc_simple_sync_poll_dispatch(sp);
+		else if (status == 0)
+			res = MTC_SIMPLE_SYNC_TIMEOUT;
+		else if (errno != EINTR)
+			res = MTC_SIMPLE_SYNC_FAIL;
+	}
+	
+	//Give the buffers back
+	if (router->sync_poll)
+		mtc_simple_sync_poll_free(sp);
+	else
+		router->sync_poll = sp;
+	
+	if (! peer->link)
+		return MTC_SIMPLE_SYNC_FAIL;
+	
+	return res;
+}
+
+MtcSimpleSyncStatus mtc_simple_sync_wait(MtcPeer **peers, int n_peers, 
+	int quorum, int64_t deadline, int *ready)
+{
+	MtcSimpleSyncPoll *sp = NULL;
+	MtcSimpleSyncStatus res;
+	int i, n_ready, n_live, n_links, timeout, status;
+	unsigned int *n_received;
+	
+	n_received = (unsigned int *) mtc_alloc
+		(sizeof(unsigned int) * (n_peers ? n_peers : 1));
+	for (i = 0; i < n_peers; i++)
+	{
+		ready[i] = 0;
+		mtc_peer_ref(peers[i]);
+	}
+	
+	while (1)
+	{
+		//Count peers that can still make progress
+		n_ready = n_live = n_links = 0;
+		for (i = 0; i < n_peers; i++)
+		{
+			MtcSimplePeer *peer = (MtcSimplePeer *) peers[i];
+			
+			if (ready[i])
+				n_ready++;
+			else if (peer->link)
+			{
+				n_live++;
+				n_links += peer->bond.len + 1;
+			}
+		}
+		
+		if (n_ready >= quorum)
+		{
+			res = MTC_SIMPLE_SYNC_OK;
+			break;
+		}
+		if (n_ready + n_live < quorum)
+		{
+			res = MTC_SIMPLE_SYNC_FAIL;
+			break;
+		}
+		
+		timeout = mtc_simple_sync_timeout(deadline);
+		if (timeout == 0)
+		{
+			res = MTC_SIMPLE_SYNC_TIMEOUT;
+			break;
+		}
+		
+		//Poll links of all peers not ready yet together
+		if (sp && sp->alen < n_links)
+		{
+			mtc_simple_sync_poll_free(sp);
+			sp = NULL;
+		}
+		if (! sp)
+			sp = mtc_simple_sync_poll_new(n_links);
+		sp->n_links = 0;
+		sp->n_fds = 0;
+		for (i = 0; i < n_peers; i++)
+		{
+			MtcSimplePeer *peer = (MtcSimplePeer *) peers[i];
+			
+			if ((! ready[i]) && peer->link)
+				mtc_simple_sync_poll_add(sp, peer, i);
+		}
+		
+		//Nothing to wait for, the remaining peers are idle
+		if (! sp->n_fds)
+		{
+			res = MTC_SIMPLE_SYNC_FAIL;
+			break;
+		}
+		
+		status = poll(sp->fds, sp->n_fds, timeout);
+		
+		if (status < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			res = MTC_SIMPLE_SYNC_FAIL;
+			break;
+		}
+		else if (status == 0)
+			continue;
+		
+		//Do the IO. Only received messages count as progress, 
+		//requests becoming writable do not.
+		for (i = 0; i < n_peers; i++)
+			n_received[i] = ((MtcSimplePeer *) peers[i])->n_received;
+		mtc_simple_sync_poll_dispatch(sp);
+		for (i = 0; i < n_peers; i++)
+		{
+			if (((MtcSimplePeer *) peers[i])->n_received != n_received[i])
+				ready[i] = 1;
+		}
+	}
+	
+	if (sp)
+		mtc_simple_sync_poll_free(sp);
+	mtc_free(n_received);
+	for (i = 0; i < n_peers; i++)
+		mtc_peer_unref(peers[i]);
+	
+	return res;
+}
+
+static int mtc_simple_peer_sync_io_step(MtcPeer *p)
+{
+	MtcSimpleRouter *router = (MtcSimpleRouter *) mtc_peer_get_router(p);
+	int64_t deadline = -1;
+	
+	if (router->sync_timeout >= 0)
+		deadline = mtc_sta_get_time() + router->sync_timeout;
+	
+	if (mtc_simple_peer_sync_io_step_until(p, deadline) 
+		== MTC_SIMPLE_SYNC_OK)
+		return 0;
+	else
+		return -1;
+}
+
+void mtc_simple_router_set_busy_poll(MtcRouter *router, int64_t max_spin)
+{
+	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	MtcRing *r, *sentinel = &(self->peers);
+	int i;
+	
+	if (max_spin < 0)
+		max_spin = 0;
+	
+	self->busy_poll.max_spin = max_spin;
+	memset(&(self->busy_poll.stats), 0, sizeof(MtcSimpleBusyPollStats));
+	self->busy_poll.stats.budget = max_spin;
+	self->busy_poll.stats.avg_wait = max_spin / 2;
+	
+	for (r = sentinel->next; r != sentinel; r = r->next)
+	{
+		MtcSimplePeer *peer = mtc_simple_peer_from_ring(r);
+		
+		mtc_simple_link_set_busy_poll(peer->link, max_spin);
+		for (i = 0; i < peer->bond.len; i++)
+			mtc_simple_link_set_busy_poll(peer->bond.links[i], max_spin);
+	}
+}
+
+void mtc_simple_router_get_busy_poll_stats
+	(MtcRouter *router, MtcSimpleBusyPollStats *stats)
+{
+	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	
+	*stats = self->busy_poll.stats;
+}
+
+void mtc_simple_router_set_idle_timeout(MtcRouter *router, int64_t usec)
+{
+	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	MtcRing *r, *sentinel = &(self->peers);
+	MtcEventMgr *mgr = mtc_router_get_event_mgr(router);
+	
+	self->idle_timeout = usec > 0 ? usec : 0;
+	
+	for (r = sentinel->next; r != sentinel; r = r->next)
+		mtc_simple_peer_setup_idle(mtc_simple_peer_from_ring(r), mgr);
+}
+
+void mtc_simple_router_set_sync_timeout(MtcRouter *router, int64_t usec)
+{
+	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	
+	self->sync_timeout = usec >= 0 ? usec : -1;
+}
+
+static void mtc_simple_peer_destroy(MtcPeer *p)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	
+	mtc_simple_peer_close(peer);
+	mtc_simple_peer_clear_strand(peer);
+	mtc_simple_peer_clear_idle(peer);
+	
+	mtc_peer_destroy(p);
+	
+	mtc_free(p);
+}
+
+static void mtc_simple_router_destroy(MtcRouter *router)
+{
+	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	
+	MtcRing *sentinel = &(self->peers);
+	
+	if (sentinel->next != sentinel)
+		mtc_error("Peers still remaining with router in destruction");
+	
+	mtc_simple_router_destroy_relays(self);
+	mtc_simple_router_destroy_topics(self);
+	
+	mtc_link_async_flush_unref(self->flush);
+	
+	if (self->sync_poll)
+		mtc_simple_sync_poll_free(self->sync_poll);
+	
+	if (self->dispatcher)
+		mtc_dispatcher_unref(self->dispatcher);
+}
+
+MtcRouterVTable	mtc_simple_router_vtable =
+{
+	mtc_simple_router_set_event_mgr,
+	mtc_simple_peer_sendto,
+	mtc_simple_peer_sync_io_step,
+	mtc_simple_peer_destroy,
+	mtc_simple_router_destroy
+};
+
+MtcRouter *mtc_simple_router_new()
+{
+	MtcSimpleRouter *self = (MtcSimpleRouter *) mtc_router_create
+		(sizeof(MtcSimpleRouter), &mtc_simple_router_vtable);
+		
+	mtc_simple_router_init_ring(self);
+	self->relays = NULL;
+	self->topics.buckets = NULL;
+	self->topics.n_buckets = 0;
+	self->topics.len = 0;
+	self->flush = mtc_link_async_flush_new();
+	self->dispatcher = NULL;
+	self->sync_poll = NULL;
+	self->sync_timeout = -1;
+	self->busy_poll.max_spin = 0;
+	memset(&(self->busy_poll.stats), 0, sizeof(MtcSimpleBusyPollStats));
+	self->idle_timeout = 0;
+	
+	return (MtcRouter *) self;
+}
+
+//Creates a peer using the given link, steals the reference.
+static MtcSimplePeer *mtc_simple_peer_new
+	(MtcSimpleRouter *self, MtcLink *link)
+{
+	MtcRouter *router = (MtcRouter *) self;
+	
+	MtcSimplePeer *peer = (MtcSimplePeer *)
+		mtc_alloc(sizeof(MtcSimplePeer));
+	
+	//Parent's constructor
+	mtc_peer_init((MtcPeer *) peer, router);
+	
+	//Set link
+	peer->link = link;
+	peer->bond.links = NULL;
+	peer->bond.backends = NULL;
+	peer->bond.len = 0;
+	peer->bond.slots = NULL;
+	
+	//Add to router
+	mtc_simple_peer_insert(peer, self);
+	peer->subs.next = peer->subs.prev = &(peer->subs);
+	peer->strand = NULL;
+	peer->n_received = 0;
+	peer->idle = NULL;
+	peer->corked = 0;
+	peer->batch_delay = 0;
+	peer->batch_bytes = 0;
+	peer->queue_policy = MTC_FD_LINK_QUEUE_KEEP_ALL;
+	peer->queue_limit = 0;
+	
+	//Setup events
+	peer->backend = NULL;
+	mtc_simple_peer_setup_events(peer, peer->link);
+	mtc_simple_peer_set_backend
+		(peer, mtc_router_get_event_mgr(router));
+	
+	return peer;
+}
+
+//Adds the given link to the bond of the peer, steals the reference.
+static void mtc_simple_peer_bond(MtcSimplePeer *peer, MtcLink *link)
+{
+	MtcSimpleRouter *router = (MtcSimpleRouter *) 
+		mtc_peer_get_router(peer);
+	MtcLink **links;
+	MtcEventBackend **backends;
+	MtcEventMgr *mgr;
+	int i;
+	
+	//Grow the arrays
+	links = (MtcLink **) mtc_alloc
+		(sizeof(MtcLink *) * (peer->bond.len + 1));
+	backends = (MtcEventBackend **) mtc_alloc
+		(sizeof(MtcEventBackend *) * (peer->bond.len + 1));
+	for (i = 0; i < peer->bond.len; i++)
+	{
+		links[i] = peer->bond.links[i];
+		backends[i] = peer->bond.backends[i];
+	}
+	if (peer->bond.links)
+	{
+		mtc_free(peer->bond.links);
+		mtc_free(peer->bond.backends);
+	}
+	peer->bond.links = links;
+	peer->bond.backends = backends;
+	
+	//Set link
+	links[i] = link;
+	backends[i] = NULL;
+	peer->bond.len++;
+	
+	//Setup events
+	mtc_simple_peer_setup_events(peer, links[i]);
+	if (peer->corked)
+		mtc_fd_link_cork(links[i]);
+	if (peer->batch_delay)
+		mtc_fd_link_set_batching
+			(links[i], peer->batch_delay, peer->batch_bytes);
+	if (peer->queue_policy != MTC_FD_LINK_QUEUE_KEEP_ALL)
+		mtc_fd_link_set_queue_policy
+			(links[i], peer->queue_policy, peer->queue_limit);
+	mgr = mtc_router_get_event_mgr((MtcRouter *) router);
+	if (mgr)
+		backends[i] = mtc_event_mgr_back(mgr, 
+			(MtcEventSource *) mtc_link_get_event_source(links[i]));
+}
+
+MtcPeer *mtc_simple_router_add(MtcRouter *router, int fd, int close_fd)
+{
+	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	
+	return (MtcPeer *) mtc_simple_peer_new
+		(self, mtc_simple_link_new(fd, close_fd, 0));
+}
+
+MtcPeer *mtc_simple_router_add_nonblocking(MtcRouter *router, int fd)
+{
+	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	
+	return (MtcPeer *) mtc_simple_peer_new
+		(self, mtc_simple_link_new(fd, 1, 1));
+}
+
+int mtc_simple_router_add_link(MtcPeer *p, int fd, int close_fd)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
 	
-	MtcRing *sentinel = &(self->peers);
+	if (! peer->link)
+		return -1;
 	
-	if (sentinel->next != sentinel)
-		mtc_error("Peers still remaining with router in destruction");
+	mtc_simple_peer_bond(peer, mtc_simple_link_new(fd, close_fd, 0));
 	
-	mtc_link_async_flush_unref(self->flush);
+	return 0;
+}
+
+int mtc_simple_peer_get_n_links(MtcPeer *p)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	
+	if (! peer->link)
+		return 0;
 	
-	mtc_simple_router_destroy_sync_cache(self);
+	return peer->bond.len + 1;
 }
 
-MtcRouterVTable	mtc_simple_router_vtable =
+void mtc_simple_peer_sendto_bonded(MtcPeer *p, int key, 
+	MtcMBlock addr, MtcDest *reply_dest, MtcMsg *payload)
 {
-	mtc_simple_router_set_event_mgr,
-	mtc_simple_peer_sendto,
-	mtc_simple_peer_sync_io_step,
-	mtc_simple_peer_destroy,
-	mtc_simple_router_destroy
-};
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	MtcMsg *mail_msg;
+	
+	//Don't send if disposed
+	if (! peer->link)
+	{
+		mtc_peer_reset(p);
+		return;
+	}
+	
+	mail_msg = mtc_simple_router_serialize_mail(addr, reply_dest, payload);
+	mtc_link_queue(mtc_simple_peer_pick_link(peer, key), mail_msg, 0);
+	mtc_msg_unref(mail_msg);
+}
 
-MtcRouter *mtc_simple_router_new()
+void mtc_simple_peer_disconnect(MtcPeer *p)
 {
-	MtcSimpleRouter *self = (MtcSimpleRouter *) mtc_router_create
-		(sizeof(MtcSimpleRouter), &mtc_simple_router_vtable);
-		
-	mtc_simple_router_init_ring(self);
-	self->flush = mtc_link_async_flush_new();
-	mtc_simple_router_init_sync_cache(self);
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
 	
-	return (MtcRouter *) self;
+	mtc_simple_peer_broken_respond(peer);
 }
 
-MtcPeer *mtc_simple_router_add(MtcRouter *router, int fd, int close_fd)
+int mtc_simple_peer_is_connected(MtcPeer *p)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	
+	return peer->link ? 1 : 0;
+}
+
+
+void mtc_simple_router_add_relay
+	(MtcRouter *router, MtcMBlock prefix, MtcPeer *p)
 {
 	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	MtcSimpleRelay *relay, **iter;
 	
-	MtcSimplePeer *peer = (MtcSimplePeer *)
-		mtc_alloc(sizeof(MtcSimplePeer));
+	if (mtc_peer_get_router(peer) != router)
+		mtc_error("Peer %p does not belong to router %p", peer, router);
 	
-	//Parent's constructor
-	mtc_peer_init((MtcPeer *) peer, router);
+	//Replace any existing entry
+	mtc_simple_router_remove_relay(router, prefix);
 	
-	//Create link
-	peer->link = mtc_fd_link_new(fd, fd);
-	mtc_fd_link_set_close_fd(peer->link, fd);
-	mtc_fd_set_blocking(fd, 0);
+	//Disconnected peers are never reset again, don't hold them
+	if (! peer->link)
+		return;
 	
-	//Add to router
-	mtc_simple_peer_insert(peer, self);
+	relay = (MtcSimpleRelay *) mtc_alloc
+		(sizeof(MtcSimpleRelay) + prefix.size);
 	
-	//Setup events
-	peer->backend = NULL;
-	mtc_simple_peer_setup_events(peer);
-	mtc_simple_peer_set_backend
-		(peer, mtc_router_get_event_mgr(router));
+	relay->router = self;
+	relay->peer = peer;
+	mtc_peer_ref(p);
+	relay->notify.cb = mtc_simple_relay_reset_notify;
+	mtc_peer_add_reset_notify(p, &(relay->notify));
+	relay->prefix_len = prefix.size;
+	memcpy(relay->prefix, prefix.mem, prefix.size);
 	
-	return (MtcPeer *) peer;
+	//Insert keeping longest prefixes first
+	for (iter = &(self->relays); *iter; iter = &((*iter)->next))
+	{
+		if ((*iter)->prefix_len <= relay->prefix_len)
+			break;
+	}
+	relay->next = *iter;
+	*iter = relay;
 }
 
-void mtc_simple_peer_disconnect(MtcPeer *p)
+void mtc_simple_router_remove_relay(MtcRouter *router, MtcMBlock prefix)
+{
+	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	MtcSimpleRelay *relay;
+	
+	relay = mtc_simple_router_find_relay(self, prefix, 1);
+	if (relay)
+		mtc_simple_relay_destroy(relay);
+}
+
+MtcMsg *mtc_simple_router_serialize_mail
+	(MtcMBlock addr, MtcDest *reply_dest, MtcMsg *payload)
+{
+	MtcSimpleMail mail;
+	MtcMsg *mail_msg;
+	
+	//Prepare mail
+	mail.dest = addr;
+	mtc_rcmem_ref(addr.mem);
+	if (reply_dest)
+	{
+		mail.ret = mtc_dest_get_addr(reply_dest);
+	}
+	else
+	{
+		mail.ret.mem = NULL;
+		mail.ret.size = 0;
+	}
+	mail.payload = payload;
+	mtc_msg_ref(payload);
+	
+	//Serialize
+	mail_msg = MtcSimpleMail__serialize(&mail);
+	
+	//Free
+	MtcSimpleMail__free(&mail);
+	
+	return mail_msg;
+}
+
+int mtc_simple_peer_queue_mail(MtcPeer *p, MtcMsg *mail, size_t limit)
 {
 	MtcSimplePeer *peer = (MtcSimplePeer *) p;
 	
-	mtc_simple_peer_broken_respond(peer);
+	if (! peer->link)
+		return 0;
+	
+	if (limit && mtc_fd_link_get_unsent_size(peer->link) > limit)
+		return 0;
+	
+	mtc_link_queue(peer->link, mail, 0);
+	
+	return 1;
 }
 
-int mtc_simple_peer_is_connected(MtcPeer *p)
+int mtc_simple_peer_queue_mail_with_opts
+	(MtcPeer *p, MtcMsg *mail, const MtcFDLinkQueueOpts *opts)
 {
 	MtcSimplePeer *peer = (MtcSimplePeer *) p;
 	
-	return peer->link ? 1 : 0;
+	if (! peer->link)
+		return 0;
+	
+	mtc_fd_link_queue_with_opts(peer->link, mail, opts);
+	
+	return 1;
+}
+
+size_t mtc_simple_peer_get_unsent_size(MtcPeer *p)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	size_t res;
+	int i;
+	
+	if (! peer->link)
+		return 0;
+	
+	res = mtc_fd_link_get_unsent_size(peer->link);
+	for (i = 0; i < peer->bond.len; i++)
+		res += mtc_fd_link_get_unsent_size(peer->bond.links[i]);
+	
+	return res;
+}
+
+void mtc_simple_peer_cork(MtcPeer *p)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	
+	if (! peer->link)
+		return;
+	
+	peer->corked++;
+	if (peer->corked == 1)
+		mtc_simple_peer_cork_links(peer, 1);
+}
+
+void mtc_simple_peer_uncork(MtcPeer *p)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	
+	if (! peer->corked)
+		return;
+	
+	peer->corked--;
+	if (! peer->corked)
+		mtc_simple_peer_cork_links(peer, 0);
+}
+
+void mtc_simple_peer_set_batching
+	(MtcPeer *p, int64_t max_delay, size_t max_bytes)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	int i;
+	
+	peer->batch_delay = max_delay > 0 ? max_delay : 0;
+	peer->batch_bytes = max_bytes;
+	
+	if (! peer->link)
+		return;
+	
+	mtc_fd_link_set_batching(peer->link, max_delay, max_bytes);
+	for (i = 0; i < peer->bond.len; i++)
+		mtc_fd_link_set_batching(peer->bond.links[i], max_delay, max_bytes);
+}
+
+void mtc_simple_peer_set_queue_policy
+	(MtcPeer *p, MtcFDLinkQueuePolicy policy, size_t limit)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	int i;
+	
+	peer->queue_policy = policy;
+	peer->queue_limit = limit;
+	
+	if (! peer->link)
+		return;
+	
+	mtc_fd_link_set_queue_policy(peer->link, policy, limit);
+	for (i = 0; i < peer->bond.len; i++)
+		mtc_fd_link_set_queue_policy(peer->bond.links[i], policy, limit);
+}
+
+void mtc_simple_router_set_dispatcher
+	(MtcRouter *router, MtcDispatcher *dispatcher)
+{
+	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	MtcRing *r, *sentinel = &(self->peers);
+	
+	if (dispatcher)
+		mtc_dispatcher_ref(dispatcher);
+	if (self->dispatcher)
+		mtc_dispatcher_unref(self->dispatcher);
+	self->dispatcher = dispatcher;
+	
+	//Strands belong to the old dispatcher
+	for (r = sentinel->next; r != sentinel; r = r->next)
+		mtc_simple_peer_clear_strand(mtc_simple_peer_from_ring(r));
+}
+
+MtcFDLinkRemote *mtc_simple_peer_get_remote(MtcPeer *p)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	
+	if (! peer->link)
+		return NULL;
+	
+	return mtc_fd_link_get_remote(peer->link);
+}
+
+int mtc_simple_router_broadcast(MtcPeer **peers, int n_peers, 
+	MtcMBlock addr, MtcDest *reply_dest, MtcMsg *payload, size_t limit)
+{
+	MtcMsg *mail;
+	int i, n_queued = 0;
+	
+	if (n_peers <= 0)
+		return 0;
+	
+	mail = mtc_simple_router_serialize_mail(addr, reply_dest, payload);
+	
+	for (i = 0; i < n_peers; i++)
+		n_queued += mtc_simple_peer_queue_mail(peers[i], mail, limit);
+	
+	mtc_msg_unref(mail);
+	
+	return n_queued;
+}
+
+void mtc_simple_peer_subscribe(MtcPeer *p, const char *topic_name)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	MtcSimpleRouter *router = (MtcSimpleRouter *) 
+		mtc_peer_get_router(peer);
+	MtcSimpleTopic *topic;
+	MtcSimpleSub *sub;
+	uint32_t hash;
+	
+	//Disconnected peers cannot subscribe
+	if (! peer->link)
+		return;
+	
+	hash = mtc_simple_topic_hash(topic_name);
+	topic = mtc_simple_router_find_topic(router, topic_name, hash);
+	if (! topic)
+		topic = mtc_simple_router_add_topic(router, topic_name, hash);
+	else if (mtc_simple_peer_find_sub(peer, topic))
+		return;
+	
+	sub = (MtcSimpleSub *) mtc_alloc(sizeof(MtcSimpleSub));
+	sub->topic = topic;
+	sub->peer = peer;
+	mtc_simple_ring_insert(&(topic->subs), &(sub->topic_ring));
+	mtc_simple_ring_insert(&(peer->subs), &(sub->peer_ring));
+}
+
+void mtc_simple_peer_unsubscribe(MtcPeer *p, const char *topic_name)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	MtcSimpleRouter *router = (MtcSimpleRouter *) 
+		mtc_peer_get_router(peer);
+	MtcSimpleTopic *topic;
+	MtcSimpleSub *sub;
+	
+	topic = mtc_simple_router_find_topic
+		(router, topic_name, mtc_simple_topic_hash(topic_name));
+	if (! topic)
+		return;
+	
+	sub = mtc_simple_peer_find_sub(peer, topic);
+	if (sub)
+		mtc_simple_sub_destroy(sub);
+}
+
+int mtc_simple_router_publish(MtcRouter *router, const char *topic_name,
+	MtcMBlock addr, MtcDest *reply_dest, MtcMsg *payload, size_t limit)
+{
+	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	MtcSimpleTopic *topic;
+	MtcRing *r, *sentinel;
+	MtcMsg *mail;
+	int n_queued = 0;
+	
+	topic = mtc_simple_router_find_topic
+		(self, topic_name, mtc_simple_topic_hash(topic_name));
+	if (! topic)
+		return 0;
+	
+	mail = mtc_simple_router_serialize_mail(addr, reply_dest, payload);
+	
+	sentinel = &(topic->subs);
+	for (r = sentinel->next; r != sentinel; r = r->next)
+	{
+		MtcSimpleSub *sub = mtc_simple_sub_from_topic_ring(r);
+		
+		n_queued += mtc_simple_peer_queue_mail
+			((MtcPeer *) sub->peer, mail, limit);
+	}
+	
+	mtc_msg_unref(mail);
+	
+	return n_queued;
+}
+
+MtcSimplePeerState *mtc_simple_peer_detach(MtcPeer *p)
+{
+	MtcSimplePeer *peer = (MtcSimplePeer *) p;
+	MtcSimplePeerState *state;
+	MtcRing *r;
+	int i;
+	
+	if (! peer->link)
+		return NULL;
+	
+	state = (MtcSimplePeerState *) mtc_alloc(sizeof(MtcSimplePeerState));
+	
+	//Remember subscriptions
+	state->n_topics = 0;
+	for (r = peer->subs.next; r != &(peer->subs); r = r->next)
+		state->n_topics++;
+	state->topics = NULL;
+	if (state->n_topics)
+		state->topics = (char **) mtc_alloc
+			(sizeof(char *) * state->n_topics);
+	i = 0;
+	for (r = peer->subs.next; r != &(peer->subs); r = r->next)
+	{
+		const char *name = mtc_simple_sub_from_peer_ring(r)->topic->name;
+		
+		state->topics[i] = (char *) mtc_alloc(strlen(name) + 1);
+		strcpy(state->topics[i], name);
+		i++;
+	}
+	
+	//Take the links out of the event loop
+	mtc_simple_peer_remove(peer);
+	mtc_simple_peer_clear_subs(peer);
+	mtc_simple_peer_clear_strand(peer);
+	mtc_simple_peer_clear_idle(peer);
+	mtc_simple_peer_clear_cork(peer);
+	mtc_simple_peer_set_backend(peer, NULL);
+	
+	state->n_links = peer->bond.len + 1;
+	state->links = (MtcLink **) mtc_alloc(sizeof(MtcLink *) * state->n_links);
+	state->links[0] = peer->link;
+	for (i = 0; i < peer->bond.len; i++)
+		state->links[i + 1] = peer->bond.links[i];
+	state->slots = peer->bond.slots;
+	peer->bond.slots = NULL;
+	peer->link = NULL;
+	mtc_simple_peer_clear_bond(peer);
+	
+	for (i = 0; i < state->n_links; i++)
+	{
+		MtcLinkEventSource *source 
+			= mtc_link_get_event_source(state->links[i]);
+		
+		mtc_link_set_events_enabled(state->links[i], 0);
+		source->received = NULL;
+		source->broken = NULL;
+		source->stopped = NULL;
+		source->data = NULL;
+		
+		//Queued messages may share memory with other objects
+		mtc_fd_link_privatize(state->links[i]);
+	}
+	
+	//The peer object stays behind, disconnected
+	mtc_peer_reset(p);
+	
+	return state;
+}
+
+static void mtc_simple_peer_state_free_topics(MtcSimplePeerState *state)
+{
+	int i;
+	
+	for (i = 0; i < state->n_topics; i++)
+		mtc_free(state->topics[i]);
+	if (state->topics)
+		mtc_free(state->topics);
+}
+
+MtcPeer *mtc_simple_router_attach
+	(MtcRouter *router, MtcSimplePeerState *state)
+{
+	MtcSimpleRouter *self = (MtcSimpleRouter *) router;
+	MtcSimplePeer *peer;
+	int i;
+	
+	peer = mtc_simple_peer_new(self, state->links[0]);
+	for (i = 1; i < state->n_links; i++)
+		mtc_simple_peer_bond(peer, state->links[i]);
+	peer->bond.slots = state->slots;
+	
+	for (i = 0; i < state->n_topics; i++)
+		mtc_simple_peer_subscribe((MtcPeer *) peer, state->topics[i]);
+	
+	mtc_simple_peer_state_free_topics(state);
+	mtc_free(state->links);
+	mtc_free(state);
+	
+	return (MtcPeer *) peer;
 }
 
+void mtc_simple_peer_state_free(MtcSimplePeerState *state)
+{
+	int i;
+	
+	for (i = 0; i < state->n_links; i++)
+		mtc_link_unref(state->links[i]);
+	if (state->slots)
+		mtc_free(state->slots);
+	
+	mtc_simple_peer_state_free_topics(state);
+	mtc_free(state->links);
+	mtc_free(state);
+}
@@ -41,6 +41,58 @@ MtcRouter *mtc_simple_router_new();
  */
 MtcPeer *mtc_simple_router_add(MtcRouter *router, int fd, int close_fd);
 
+/**Adds a new connection to simple router, like 
+ * mtc_simple_router_add(), for a file descriptor already in 
+ * nonblocking mode, e.g. accepted with accept4() and SOCK_NONBLOCK.
+ * This saves changing the mode with fcntl().
+ * \param router A simple router
+ * \param fd A connection in nonblocking mode. 
+ *        It is closed when the peer is destroyed.
+ * \return A new peer corresponding to the connection
+ */
+MtcPeer *mtc_simple_router_add_nonblocking(MtcRouter *router, int fd);
+
+/**Adds another connection to an existing peer, bonding it. 
+ * 
+ * A bonded peer receives mails over all its connections.
+ * Mails sent with mtc_simple_peer_sendto_bonded() are spread over 
+ * them, while other mails always use the first connection.
+ * If any connection breaks the peer is disconnected.
+ * The other end must treat the connections as one peer too.
+ * \param peer A peer belonging to simple router
+ * \param fd A connection to the same remote end
+ * \param close_fd 1 to close the file descriptor 
+ *        when peer is destroyed, 0 otherwise
+ * \return 0 on success, -1 if the peer is disconnected.
+ */
+int mtc_simple_router_add_link(MtcPeer *peer, int fd, int close_fd);
+
+/**Gets no. of connections of the peer
+ * \param peer A peer belonging to simple router
+ * \return No. of connections, 0 if the peer is disconnected.
+ */
+int mtc_simple_peer_get_n_links(MtcPeer *peer);
+
+/**Sends a mail over one of the connections of a bonded peer.
+ * 
+ * Nonnegative keys are hashed into a fixed number of slots. The first 
+ * mail for a slot picks the connection with least unsent data, and 
+ * the slot keeps that connection from then on, also when more 
+ * connections are added later or the peer is moved to another router 
+ * using mtc_simple_peer_detach(). Keys used before the peer is bonded 
+ * stay on the first connection.
+ * \param peer A peer belonging to simple router
+ * \param key Ordering key. Mails with the same nonnegative key are 
+ *        always sent over the same connection, so they are delivered
+ *        in order. Negative to use the connection with least 
+ *        unsent data, without any ordering guarantee.
+ * \param addr Destination address
+ * \param reply_dest Destination for the reply, or NULL
+ * \param payload The message to send
+ */
+void mtc_simple_peer_sendto_bonded(MtcPeer *peer, int key, 
+	MtcMBlock addr, MtcDest *reply_dest, MtcMsg *payload);
+
 /**Closes connection to the peer. 
  * \param peer A peer belonging to simple router
  */
@@ -52,6 +104,348 @@ void mtc_simple_peer_disconnect(MtcPeer *peer);
  */
 int mtc_simple_peer_is_connected(MtcPeer *peer);
 
+/**Gets the amount of data queued for the peer that is not yet sent.
+ * \param peer A peer belonging to simple router
+ * \return No. of bytes not yet sent, 0 if the peer is disconnected.
+ */
+size_t mtc_simple_peer_get_unsent_size(MtcPeer *peer);
+
+/**Holds off sending to the peer, so that a burst of mails sent 
+ * meanwhile goes out in as few system calls as possible once the peer 
+ * is uncorked. Applies to all connections of a bonded peer. 
+ * Calls may be nested. See mtc_fd_link_cork().
+ * 
+ * Disconnecting the peer releases the cork.
+ * \param peer A peer belonging to simple router
+ */
+void mtc_simple_peer_cork(MtcPeer *peer);
+
+/**Undoes one mtc_simple_peer_cork(). Mails start going out on the 
+ * next event loop iteration after the last call.
+ * \param peer A peer belonging to simple router
+ */
+void mtc_simple_peer_uncork(MtcPeer *peer);
+
+/**Enables coalescing of mails sent to the peer into batches, 
+ * on all connections of the peer. See mtc_fd_link_set_batching().
+ * \param peer A peer belonging to simple router
+ * \param max_delay Longest time to hold a mail in microseconds, 
+ *        0 to disable batching (the default)
+ * \param max_bytes Amount of unsent data that closes the window early, 
+ *        0 for no limit
+ */
+void mtc_simple_peer_set_batching
+	(MtcPeer *peer, int64_t max_delay, size_t max_bytes);
+
+/**Serializes a mail the way simple router sends it.
+ * The result can be queued on any number of peers using
+ * mtc_simple_peer_queue_mail().
+ * \param addr Destination address
+ * \param reply_dest Destination for the reply, or NULL
+ * \param payload The message to send
+ * \return The serialized mail. Release it with mtc_msg_unref().
+ */
+MtcMsg *mtc_simple_router_serialize_mail
+	(MtcMBlock addr, MtcDest *reply_dest, MtcMsg *payload);
+
+/**Queues an already serialized mail to be sent to the peer. 
+ * The message is shared, not copied.
+ * \param peer A peer belonging to simple router
+ * \param mail A mail returned by mtc_simple_router_serialize_mail()
+ * \param limit If nonzero, the mail is not queued when the peer has 
+ *        more than this many bytes waiting to be sent.
+ * \return 1 if the mail was queued, 0 if the peer is disconnected or 
+ *         over the limit.
+ */
+int mtc_simple_peer_queue_mail(MtcPeer *peer, MtcMsg *mail, size_t limit);
+
+/**Queues an already serialized mail with options, over the first 
+ * connection of the peer. See mtc_fd_link_queue_with_opts().
+ * \param peer A peer belonging to simple router
+ * \param mail A mail returned by mtc_simple_router_serialize_mail()
+ * \param opts Options, or NULL for defaults
+ * \return 1 if the mail was queued, 0 if the peer is disconnected.
+ *         The mail may still be dropped by the queue policy.
+ */
+int mtc_simple_peer_queue_mail_with_opts
+	(MtcPeer *peer, MtcMsg *mail, const MtcFDLinkQueueOpts *opts);
+
+/**Sets how mails queued for the peer are dropped, on all connections 
+ * of the peer. See mtc_fd_link_set_queue_policy().
+ * \param peer A peer belonging to simple router
+ * \param policy The policy
+ * \param limit Max. amount of unsent data in bytes per connection, 
+ *        for the policies that use it
+ */
+void mtc_simple_peer_set_queue_policy
+	(MtcPeer *peer, MtcFDLinkQueuePolicy policy, size_t limit);
+
+/**Gets the queue through which other threads can send mails to the 
+ * peer. See mtc_fd_link_get_remote(). Mails pushed to the queue go 
+ * over the first connection of the peer.
+ * \param peer A peer belonging to simple router. 
+ *        Must be called from the thread using the router.
+ * \return The queue with a new reference, or NULL if the peer is 
+ *         disconnected.
+ */
+MtcFDLinkRemote *mtc_simple_peer_get_remote(MtcPeer *peer);
+
+/**Sets a dispatcher to handle received mails in other threads. 
+ * 
+ * Instead of being delivered with mtc_router_deliver(), mails that are 
+ * not relayed are handed to the dispatcher, one strand per peer, so 
+ * mails from a peer are handled in the order they were received.
+ * Received mails are handed over without being copied, and unless 
+ * the router has relay entries, without being deserialized in the 
+ * router's thread. Malformed mails are then dropped by the handler 
+ * thread instead of breaking the connection.
+ * Replies sent from the handlers go over the first connection of 
+ * the peer.
+ * \param router A simple router
+ * \param dispatcher The dispatcher, or NULL to deliver mails normally.
+ *        A reference is taken.
+ */
+void mtc_simple_router_set_dispatcher
+	(MtcRouter *router, MtcDispatcher *dispatcher);
+
+///Result of a synchronous IO step
+typedef enum
+{
+	///Some IO was done
+	MTC_SIMPLE_SYNC_OK = 0,
+	///Connection to the peer failed
+	MTC_SIMPLE_SYNC_FAIL = -1,
+	///The deadline was reached before any IO could be done
+	MTC_SIMPLE_SYNC_TIMEOUT = -2
+} MtcSimpleSyncStatus;
+
+/**Gets current time from a monotonic clock, for use with deadlines.
+ * \return Current time in microseconds
+ */
+int64_t mtc_simple_get_time(void);
+
+/**Waits until IO can be done on the connections of the peer and 
+ * does it, like the synchronous IO step used by MTC, 
+ * but returns when the deadline is reached.
+ * \param peer A peer belonging to simple router
+ * \param deadline Time (see mtc_simple_get_time()) after which to give 
+ *        up, or -1 to wait indefinitely.
+ * \return MTC_SIMPLE_SYNC_OK after doing some IO, 
+ *         MTC_SIMPLE_SYNC_TIMEOUT if the deadline was reached first, 
+ *         MTC_SIMPLE_SYNC_FAIL if the peer is disconnected.
+ */
+MtcSimpleSyncStatus mtc_simple_peer_sync_io_step_until
+	(MtcPeer *peer, int64_t deadline);
+
+/**Waits on several peers at once, for example to send a request to 
+ * several replicas and wait for the first reply or a quorum of them. 
+ * 
+ * The links of all peers are polled together, and IO is done on 
+ * those ready, like mtc_simple_peer_sync_io_step_until() does. 
+ * A peer counts as ready once a message is received from it. Sending 
+ * queued requests does not count. The caller checks whether what it 
+ * waits for has arrived, and calls the function again for peers 
+ * still pending.
+ * \param peers Peers belonging to simple routers, not necessarily 
+ *        the same router
+ * \param n_peers No. of peers
+ * \param quorum No. of peers that must become ready
+ * \param deadline Time (see mtc_simple_get_time()) after which to give 
+ *        up, or -1 to wait indefinitely.
+ * \param ready Array of n_peers elements, set to nonzero for the peers 
+ *        from which a message was received
+ * \return MTC_SIMPLE_SYNC_OK when quorum peers are ready, 
+ *         MTC_SIMPLE_SYNC_TIMEOUT if the deadline was reached first, 
+ *         MTC_SIMPLE_SYNC_FAIL if too many peers are disconnected 
+ *         or idle to reach the quorum.
+ */
+MtcSimpleSyncStatus mtc_simple_sync_wait(MtcPeer **peers, int n_peers, 
+	int quorum, int64_t deadline, int *ready);
+
+/**Sets a timeout after which peers that did no IO are disconnected, 
+ * releasing their connections and buffers. 
+ * 
+ * Every peer has a timer on the timer wheel of the event manager 
+ * (see MtcEventTestTimer). IO does not touch the timer; when it fires, 
+ * the peer is disconnected if it has been idle long enough, otherwise 
+ * the timer is armed again for when it would be. 
+ * Needs a libevent based event manager set on the router.
+ * \param router A simple router
+ * \param usec Timeout in microseconds, 0 to never disconnect 
+ *        idle peers (default)
+ */
+void mtc_simple_router_set_idle_timeout(MtcRouter *router, int64_t usec);
+
+/**Sets a time limit for every synchronous IO step MTC does on peers 
+ * of the router. A step that times out fails, so the blocking call 
+ * that made it fails instead of waiting on a stalled peer forever. 
+ * The peer stays connected.
+ * \param router A simple router
+ * \param usec Time limit in microseconds, or -1 for no limit (default)
+ */
+void mtc_simple_router_set_sync_timeout(MtcRouter *router, int64_t usec);
+
+///State of busy polling in synchronous IO steps
+typedef struct
+{
+	///No. of steps in which the links became ready while spinning
+	uint64_t n_hits;
+	///No. of steps that spun and then had to sleep
+	uint64_t n_misses;
+	///Average time the links took to become ready, in microseconds
+	int64_t avg_wait;
+	///Current spin budget in microseconds
+	int64_t budget;
+} MtcSimpleBusyPollStats;
+
+/**Enables busy polling in synchronous IO steps on peers of the router. 
+ * Instead of sleeping in poll() right away, a step checks the links 
+ * repeatedly without sleeping for a while, which avoids the wakeup 
+ * latency when the response arrives quickly, at the cost of CPU time. 
+ * 
+ * The spin time adapts to how long the links take to become ready: 
+ * twice the average, or no spinning at all when that exceeds max_spin. 
+ * SO_BUSY_POLL is also set on the sockets where supported.
+ * \param router A simple router
+ * \param max_spin Max. time to spin in microseconds, 0 to disable
+ */
+void mtc_simple_router_set_busy_poll(MtcRouter *router, int64_t max_spin);
+
+/**Gets the state of busy polling
+ * \param router A simple router
+ * \param stats Location to store the state
+ */
+void mtc_simple_router_get_busy_poll_stats
+	(MtcRouter *router, MtcSimpleBusyPollStats *stats);
+
+/**Sends a mail to several peers, serializing it only once. 
+ * All peers share the same queued message.
+ * \param peers Array of peers belonging to simple routers
+ * \param n_peers No. of peers in the array
+ * \param addr Destination address
+ * \param reply_dest Destination for the reply, or NULL
+ * \param payload The message to send
+ * \param limit If nonzero, peers having more than this many bytes 
+ *        waiting to be sent are skipped.
+ * \return No. of peers the mail was queued on
+ */
+int mtc_simple_router_broadcast(MtcPeer **peers, int n_peers, 
+	MtcMBlock addr, MtcDest *reply_dest, MtcMsg *payload, size_t limit);
+
+/**Subscribes the peer to a topic. 
+ * Mails published to the topic using mtc_simple_router_publish() 
+ * will be sent to the peer. Subscribing twice has no effect.
+ * Subscriptions are removed when the peer is disconnected.
+ * \param peer A peer belonging to simple router
+ * \param topic Name of the topic
+ */
+void mtc_simple_peer_subscribe(MtcPeer *peer, const char *topic);
+
+/**Removes subscription of the peer to a topic.
+ * \param peer A peer belonging to simple router
+ * \param topic Name of the topic
+ */
+void mtc_simple_peer_unsubscribe(MtcPeer *peer, const char *topic);
+
+/**Sends a mail to all peers subscribed to a topic, 
+ * serializing it only once.
+ * \param router A simple router
+ * \param topic Name of the topic
+ * \param addr Destination address
+ * \param reply_dest Destination for the reply, or NULL
+ * \param payload The message to send
+ * \param limit If nonzero, peers having more than this many bytes 
+ *        waiting to be sent are skipped.
+ * \return No. of peers the mail was queued on
+ */
+int mtc_simple_router_publish(MtcRouter *router, const char *topic,
+	MtcMBlock addr, MtcDest *reply_dest, MtcMsg *payload, size_t limit);
+
+/**Adds an entry to the relay table of the router. 
+ * 
+ * Mails received from any peer whose destination address starts with
+ * the given prefix are forwarded to the given peer as they were 
+ * received, without being delivered to the router or serialized again.
+ * When several entries match, the one with longest prefix is used.
+ * Mails received from the peer of the matching entry itself are 
+ * dropped instead of being sent back.
+ * 
+ * Reply addresses are forwarded unchanged, so they refer to objects 
+ * reachable through the sending peer. Replies are not routed back 
+ * automatically: the receiving peer sends them to this router, which 
+ * relays them only if another entry matches the reply address, 
+ * e.g. a prefix that the sending peer uses for its reply addresses.
+ * 
+ * The entry is removed automatically when the peer is reset.
+ * \param router A simple router
+ * \param prefix Prefix of destination addresses to forward. 
+ *        The memory is copied.
+ * \param peer The peer to forward mails to. It must belong to 
+ *        the same router.
+ */
+void mtc_simple_router_add_relay
+	(MtcRouter *router, MtcMBlock prefix, MtcPeer *peer);
+
+/**Removes an entry from the relay table of the router.
+ * \param router A simple router
+ * \param prefix The prefix the entry was added with
+ */
+void mtc_simple_router_remove_relay(MtcRouter *router, MtcMBlock prefix);
+
+///No. of slots ordering keys of bonded peers are hashed into
+#define MTC_SIMPLE_BOND_SLOTS 64
+
+///Connections of a peer detached from its router
+typedef struct _MtcSimplePeerState MtcSimplePeerState;
+
+struct _MtcSimplePeerState
+{
+	///Links of the peer, the first one is the primary link. 
+	///A reference is held on all of them.
+	MtcLink **links;
+	///No. of links
+	int n_links;
+	
+	///Index of the link for each of MTC_SIMPLE_BOND_SLOTS slots of 
+	///ordering keys, -1 if unassigned, allocated using mtc_alloc(). 
+	///NULL if no ordering keys were used.
+	int *slots;
+	
+	///Names of the topics the peer is subscribed to, 
+	///allocated using mtc_alloc().
+	char **topics;
+	///No. of topics
+	int n_topics;
+};
+
+/**Detaches the connections of the peer from its router, so that 
+ * they can be attached to another router, 
+ * possibly running in another thread.
+ * 
+ * Unsent data, partially received messages and topic subscriptions 
+ * are kept, so no data is lost. Queued messages are copied so that 
+ * the connections do not share memory with anything else.
+ * Afterwards the peer is disconnected and reset.
+ * \param peer A peer belonging to simple router
+ * \return The connections of the peer, or NULL if the peer 
+ *         is disconnected.
+ */
+MtcSimplePeerState *mtc_simple_peer_detach(MtcPeer *peer);
+
+/**Adds connections detached from another router as a new peer.
+ * \param router A simple router
+ * \param state Connections returned by mtc_simple_peer_detach(),
+ *        or put together the same way, which are freed.
+ * \return A new peer
+ */
+MtcPeer *mtc_simple_router_attach
+	(MtcRouter *router, MtcSimplePeerState *state);
+
+/**Closes connections detached from a router without attaching them.
+ * \param state Connections returned by mtc_simple_peer_detach()
+ */
+void mtc_simple_peer_state_free(MtcSimplePeerState *state);
+
 /**
  * \}
  */
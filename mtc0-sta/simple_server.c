@@ -31,6 +31,7 @@ struct _MtcPeerRing
 typedef struct 
 {
 	MtcPeerRing ring;
+	MtcPeerSet *peer_set;
 	MtcPeer *peer;
 	MtcPeerResetNotify notify;
 } MtcPeerHolder;
@@ -41,18 +42,56 @@ struct _MtcPeerSet
 	
 	MtcPeerRing sentinel;
 	MtcRouter *simple_router;
+	
+	//Holders kept for reuse, linked through ring.next
+	MtcPeerRing *spare;
+	int n_spare;
+	
+	//No. of peers and its limit, 0 for no limit
+	int n_peers, max_peers;
+	
+	//Listeners adding peers to this set
+	MtcSimpleListener *listeners;
 };
 
+static void mtc_simple_listener_check_limits(MtcSimpleListener *listener);
+
+//Max. no. of holders kept for reuse
+#define MTC_PEER_SET_SPARE_MAX 64
+
 static void mtc_peer_holder_destroy(MtcPeerHolder *holder)
 {
 	MtcPeerRing *ring = &(holder->ring);
+	MtcPeerSet *peer_set = holder->peer_set;
 	
 	ring->next->prev = ring->prev;
 	ring->prev->next = ring->next;
 	
 	mtc_peer_reset_notify_remove(&(holder->notify));
 	mtc_peer_unref(holder->peer);
-	mtc_free(holder);
+	peer_set->n_peers--;
+	
+	if (peer_set->n_spare < MTC_PEER_SET_SPARE_MAX)
+	{
+		ring->next = peer_set->spare;
+		peer_set->spare = ring;
+		peer_set->n_spare++;
+	}
+	else
+	{
+		mtc_free(holder);
+	}
+	
+	//Listeners paused by the limit may resume
+	{
+		MtcSimpleListener *iter;
+		
+		for (iter = peer_set->listeners; iter; iter = iter->next_in_set)
+		{
+			if (iter->paused)
+				mtc_simple_listener_check_limits(iter);
+		}
+	}
 }
 
 static void mtc_peer_holder_reset_notify(MtcPeerResetNotify *notify)
@@ -63,13 +102,24 @@ static void mtc_peer_holder_reset_notify(MtcPeerResetNotify *notify)
 	mtc_peer_holder_destroy(holder);
 }
 
-void mtc_peer_set_add(MtcPeerSet *peer_set, int fd, int close_fd)
+//Adds the peer to the set, steals the reference
+static void mtc_peer_set_add_peer(MtcPeerSet *peer_set, MtcPeer *peer)
 {
-	//Create new holder
-	MtcPeerHolder *holder = (MtcPeerHolder *) 
-		mtc_alloc(sizeof(MtcPeerHolder));
+	MtcPeerHolder *holder;
 	MtcPeerRing *ring, *sentinel;
 	
+	//Create new holder, reusing a spare one if any
+	if (peer_set->spare)
+	{
+		holder = (MtcPeerHolder *) peer_set->spare;
+		peer_set->spare = peer_set->spare->next;
+		peer_set->n_spare--;
+	}
+	else
+	{
+		holder = (MtcPeerHolder *) mtc_alloc(sizeof(MtcPeerHolder));
+	}
+	
 	//Add to ring
 	sentinel = &(peer_set->sentinel);
 	ring = &(holder->ring);
@@ -79,11 +129,42 @@ void mtc_peer_set_add(MtcPeerSet *peer_set, int fd, int close_fd)
 	ring->prev->next = ring;
 	
 	//Initialize
-	holder->peer = mtc_simple_router_add(peer_set->simple_router, fd, close_fd);
+	peer_set->n_peers++;
+	holder->peer_set = peer_set;
+	holder->peer = peer;
 	holder->notify.cb = mtc_peer_holder_reset_notify;
 	mtc_peer_add_reset_notify(holder->peer, &(holder->notify));
 }
 
+void mtc_peer_set_add(MtcPeerSet *peer_set, int fd, int close_fd)
+{
+	mtc_peer_set_add_peer(peer_set, 
+		mtc_simple_router_add(peer_set->simple_router, fd, close_fd));
+}
+
+int mtc_peer_set_broadcast(MtcPeerSet *peer_set, 
+	MtcMBlock addr, MtcDest *reply_dest, MtcMsg *payload, size_t limit)
+{
+	MtcPeerRing *ring, *sentinel = &(peer_set->sentinel);
+	MtcMsg *mail;
+	int n_queued = 0;
+	
+	if (sentinel->next == sentinel)
+		return 0;
+	
+	mail = mtc_simple_router_serialize_mail(addr, reply_dest, payload);
+	
+	for (ring = sentinel->next; ring != sentinel; ring = ring->next)
+	{
+		MtcPeerHolder *holder = (MtcPeerHolder *) ring;
+		
+		n_queued += mtc_simple_peer_queue_mail(holder->peer, mail, limit);
+	}
+	
+	mtc_msg_unref(mail);
+	
+	return n_queued;
+}
 
 MtcPeerSet *mtc_peer_set_new(MtcRouter *simple_router)
 {
@@ -97,10 +178,30 @@ MtcPeerSet *mtc_peer_set_new(MtcRouter *simple_router)
 	sentinel->next = sentinel->prev = sentinel;
 	peer_set->simple_router = simple_router;
 	mtc_router_ref(simple_router);
+	peer_set->spare = NULL;
+	peer_set->n_spare = 0;
+	peer_set->n_peers = 0;
+	peer_set->max_peers = 0;
+	peer_set->listeners = NULL;
 	
 	return peer_set;
 }
 
+int mtc_peer_set_get_size(MtcPeerSet *peer_set)
+{
+	return peer_set->n_peers;
+}
+
+void mtc_peer_set_set_max_peers(MtcPeerSet *peer_set, int val)
+{
+	MtcSimpleListener *iter;
+	
+	peer_set->max_peers = val > 0 ? val : 0;
+	
+	for (iter = peer_set->listeners; iter; iter = iter->next_in_set)
+		mtc_simple_listener_check_limits(iter);
+}
+
 void mtc_peer_set_ref(MtcPeerSet *peer_set)
 {
 	peer_set->refcount++;
@@ -113,8 +214,15 @@ void mtc_peer_set_unref(MtcPeerSet *peer_set)
 	if (peer_set->refcount <= 0)
 	{
 		MtcPeerRing *sentinel = &(peer_set->sentinel);
+		MtcPeerRing *next;
+		
 		while (sentinel->next != sentinel)
 			mtc_peer_holder_destroy((MtcPeerHolder *) sentinel->next);
+		for (; peer_set->spare; peer_set->spare = next)
+		{
+			next = peer_set->spare->next;
+			mtc_free(peer_set->spare);
+		}
 		
 		mtc_router_unref(peer_set->simple_router);
 		
@@ -125,25 +233,172 @@ void mtc_peer_set_unref(MtcPeerSet *peer_set)
 
 //MtcSimpleListener
 
+//Whether any limit on accepting connections is hit
+static int mtc_simple_listener_over_limit(MtcSimpleListener *listener)
+{
+	MtcPeerSet *peer_set = listener->peer_set;
+	
+	if (peer_set && peer_set->max_peers 
+		&& peer_set->n_peers >= peer_set->max_peers)
+		return 1;
+	
+	if (listener->memory_limit 
+		&& mtc_fd_link_get_total_unsent_size() > listener->memory_limit)
+		return 1;
+	
+	return 0;
+}
+
+//Test to prepare while paused. Timer tests are only used when 
+//asked for, as event managers other than libevent's lack them.
+static MtcEventTest *mtc_simple_listener_paused_test
+	(MtcSimpleListener *listener)
+{
+	if (listener->recheck_interval > 0)
+		return (MtcEventTest *) &(listener->recheck);
+	else
+		return NULL;
+}
+
+//Stops polling the socket, connections wait in the backlog meanwhile
+static void mtc_simple_listener_pause(MtcSimpleListener *listener)
+{
+	if (listener->paused)
+		return;
+	
+	listener->paused = 1;
+	listener->paused_since = mtc_sta_get_time();
+	listener->stats.n_paused++;
+	
+	//Check the limits periodically instead, if enabled
+	if (listener->recheck_interval > 0)
+		mtc_event_test_timer_init(&(listener->recheck), 
+			listener->paused_since + listener->recheck_interval, 
+			listener->recheck_interval);
+	if (listener->active)
+		mtc_event_source_prepare
+			((MtcEventSource *) listener, 
+			mtc_simple_listener_paused_test(listener));
+}
+
+static void mtc_simple_listener_resume(MtcSimpleListener *listener)
+{
+	int64_t duration;
+	
+	if (! listener->paused)
+		return;
+	
+	listener->paused = 0;
+	duration = mtc_sta_get_time() - listener->paused_since;
+	listener->stats.paused_time += duration;
+	if (duration > listener->stats.max_paused_time)
+		listener->stats.max_paused_time = duration;
+	
+	if (listener->active)
+		mtc_event_source_prepare
+			((MtcEventSource *) listener, 
+			(MtcEventTest *) &(listener->test));
+}
+
+static void mtc_simple_listener_check_limits(MtcSimpleListener *listener)
+{
+	if (mtc_simple_listener_over_limit(listener))
+		mtc_simple_listener_pause(listener);
+	else
+		mtc_simple_listener_resume(listener);
+}
+
+//Accepts a connection in nonblocking mode
+static int mtc_simple_listener_accept(MtcSimpleListener *listener)
+{
+	int fd;
+	
+#ifdef HAVE_ACCEPT4
+	fd = accept4(listener->test.fd, NULL, NULL, 
+		SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd >= 0 || errno != ENOSYS)
+		return fd;
+#endif
+	
+	fd = accept(listener->test.fd, NULL, NULL);
+	if (fd >= 0)
+	{
+		mtc_fd_set_blocking(fd, 0);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	
+	return fd;
+}
+
 static void mtc_simple_listener_event
 	(MtcEventSource *source, MtcEventFlags event)
 {
 	MtcSimpleListener *listener = (MtcSimpleListener *) source;
 	
+	if ((event & MTC_EVENT_CHECK) && listener->recheck.fired)
+	{
+		mtc_simple_listener_check_limits(listener);
+		return;
+	}
+	
 	if ((event & MTC_EVENT_CHECK) && listener->active)
 	{
-		int fd;
+		int fd, i;
+		
+		listener->stats.n_wakeups++;
 		
-		fd = accept(listener->test.fd, NULL, NULL);
+		//Callback may drop the last reference
+		mtc_simple_listener_ref(listener);
 		
-		if (fd == -1)
+		//Accept all waiting connections, up to the budget
+		for (i = 0; i < listener->accept_budget; i++)
 		{
-			if (MTC_IO_TEMP_ERROR(errno))
-				mtc_error("accept(): %s", strerror(errno));
-			return;
+			//Callback may deactivate the listener
+			if (! listener->active)
+				break;
+			
+			//Leave connections in the backlog when overloaded
+			if (mtc_simple_listener_over_limit(listener))
+			{
+				mtc_simple_listener_pause(listener);
+				break;
+			}
+			
+			fd = mtc_simple_listener_accept(listener);
+			
+			if (fd == -1)
+			{
+				//No more connections waiting
+				if (MTC_IO_TEMP_ERROR(errno))
+					break;
+				
+				//Connection was closed before we got it
+				if (errno == ECONNABORTED || errno == EPROTO)
+					continue;
+				
+				listener->stats.n_failed++;
+				
+				//Out of file descriptors or memory, 
+				//pause until the limits are checked again
+				if (errno == EMFILE || errno == ENFILE 
+					|| errno == ENOBUFS || errno == ENOMEM)
+				{
+					mtc_simple_listener_pause(listener);
+					break;
+				}
+				
+				mtc_warn("accept(): %s", strerror(errno));
+				break;
+			}
+			
+			listener->stats.n_accepted++;
+			(* listener->accepted) (listener, fd);
 		}
 		
-		(* listener->accepted) (listener, fd);
+		if (i == listener->accept_budget)
+			listener->stats.n_budget_exhausted++;
+		
+		mtc_simple_listener_unref(listener);
 	}
 }
 
@@ -173,6 +428,15 @@ MtcSimpleListener *mtc_simple_listener_new(int svr_fd)
 	listener->accepted = NULL;
 	listener->data = NULL;
 	
+	listener->accept_budget = MTC_SIMPLE_LISTENER_ACCEPT_BUDGET;
+	listener->memory_limit = 0;
+	listener->paused = 0;
+	listener->paused_since = 0;
+	listener->recheck_interval = 0;
+	mtc_event_test_timer_init(&(listener->recheck), -1, 0);
+	listener->next_in_set = NULL;
+	memset(&(listener->stats), 0, sizeof(MtcSimpleListenerStats));
+	
 	return listener;
 }
 
@@ -189,7 +453,7 @@ void mtc_simple_listener_unref(MtcSimpleListener *listener)
 		if (listener->close_fd)
 			close(listener->test.fd);
 		if (listener->peer_set)
-			mtc_peer_set_unref(listener->peer_set);
+			mtc_simple_listener_unset_peer_set(listener);
 		
 		mtc_event_source_destroy((MtcEventSource *) listener);
 		
@@ -203,15 +467,19 @@ void mtc_simple_listener_set_active
 	if ((! listener->active) && val)
 	{
 		listener->active = 1;
-		mtc_event_source_prepare
-			((MtcEventSource *) listener, 
-			(MtcEventTest *) &(listener->test));
+		if (listener->paused)
+			mtc_event_source_prepare
+				((MtcEventSource *) listener, 
+				mtc_simple_listener_paused_test(listener));
+		else
+			mtc_event_source_prepare
+				((MtcEventSource *) listener, 
+				(MtcEventTest *) &(listener->test));
 	}
 	else if (listener->active && (! val))
 	{
 		listener->active = 0;
-		mtc_event_source_prepare
-			((MtcEventSource *) listener, NULL);
+		mtc_event_source_prepare((MtcEventSource *) listener, NULL);
 	}
 }
 
@@ -221,10 +489,50 @@ void mtc_simple_listener_set_close_fd
 	listener->close_fd = val ? 1 : 0;
 }
 
+void mtc_simple_listener_set_memory_limit
+	(MtcSimpleListener *listener, size_t val)
+{
+	listener->memory_limit = val;
+	mtc_simple_listener_check_limits(listener);
+}
+
+void mtc_simple_listener_set_recheck_interval
+	(MtcSimpleListener *listener, int64_t usec)
+{
+	listener->recheck_interval = usec > 0 ? usec : 0;
+	
+	//Apply to a listener already paused
+	if (listener->paused)
+	{
+		if (listener->recheck_interval > 0)
+			mtc_event_test_timer_init(&(listener->recheck), 
+				mtc_sta_get_time() + listener->recheck_interval, 
+				listener->recheck_interval);
+		if (listener->active)
+			mtc_event_source_prepare
+				((MtcEventSource *) listener, 
+				mtc_simple_listener_paused_test(listener));
+	}
+}
+
+void mtc_simple_listener_update(MtcSimpleListener *listener)
+{
+	mtc_simple_listener_check_limits(listener);
+}
+
+void mtc_simple_listener_set_accept_budget
+	(MtcSimpleListener *listener, int val)
+{
+	listener->accept_budget = val > 0 ? val : 1;
+}
+
 static void mtc_simple_listener_add_peer_cb
 	(MtcSimpleListener *listener, int fd)
 {
-	mtc_peer_set_add(listener->peer_set, fd, 1);
+	MtcPeerSet *peer_set = listener->peer_set;
+	
+	mtc_peer_set_add_peer(peer_set, mtc_simple_router_add_nonblocking
+		(peer_set->simple_router, fd));
 }
 
 void mtc_simple_listener_set_peer_set
@@ -234,15 +542,509 @@ void mtc_simple_listener_set_peer_set
 	listener->peer_set = peer_set;
 	listener->data = NULL;
 	mtc_peer_set_ref(peer_set);
+	listener->next_in_set = peer_set->listeners;
+	peer_set->listeners = listener;
+	mtc_simple_listener_check_limits(listener);
 	mtc_simple_listener_set_active(listener, 1);
 }
 
 void mtc_simple_listener_unset_peer_set
 	(MtcSimpleListener *listener)
 {
+	MtcSimpleListener **iter;
+	
 	mtc_simple_listener_set_active(listener, 0);
+	for (iter = &(listener->peer_set->listeners); *iter; 
+		iter = &((*iter)->next_in_set))
+	{
+		if (*iter == listener)
+		{
+			*iter = listener->next_in_set;
+			break;
+		}
+	}
+	listener->next_in_set = NULL;
 	mtc_peer_set_unref(listener->peer_set);
 	listener->peer_set = NULL;
 	listener->accepted = NULL;
 	listener->data = NULL;
 }
+
+
+//Handing over to another process
+
+//Record header: type and payload size, 
+//file descriptors are attached to it.
+#define MTC_HANDOFF_HDR_SIZE 8
+
+//Type of record carrying a link
+#define MTC_HANDOFF_LINK 3
+
+//Maximum no. of file descriptors in a record
+#define MTC_HANDOFF_MAX_FDS 2
+
+static int mtc_handoff_write(int sock, const void *data, size_t len)
+{
+	ssize_t res;
+	
+	while (len > 0)
+	{
+		res = write(sock, data, len);
+		if (res < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data = MTC_PTR_ADD(data, res);
+		len -= res;
+	}
+	
+	return 0;
+}
+
+static int mtc_handoff_read(int sock, void *data, size_t len)
+{
+	ssize_t res;
+	
+	while (len > 0)
+	{
+		res = read(sock, data, len);
+		if (res < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		else if (res == 0)
+		{
+			errno = ECONNRESET;
+			return -1;
+		}
+		data = MTC_PTR_ADD(data, res);
+		len -= res;
+	}
+	
+	return 0;
+}
+
+static int mtc_handoff_send_record(int sock, uint32_t type, 
+	const void *payload, uint32_t len, int *fds, int n_fds)
+{
+	char hdr[MTC_HANDOFF_HDR_SIZE];
+	char control[CMSG_SPACE(sizeof(int) * MTC_HANDOFF_MAX_FDS)];
+	struct msghdr packet;
+	struct iovec vector;
+	ssize_t res;
+	
+	mtc_uint32_copy_to_le(hdr, &type);
+	mtc_uint32_copy_to_le(hdr + 4, &len);
+	
+	vector.iov_base = hdr;
+	vector.iov_len = MTC_HANDOFF_HDR_SIZE;
+	memset(&packet, 0, sizeof(struct msghdr));
+	packet.msg_iov = &vector;
+	packet.msg_iovlen = 1;
+	
+	//File descriptors travel with the first byte of the header
+	if (n_fds)
+	{
+		struct cmsghdr *cmsg;
+		
+		memset(control, 0, sizeof(control));
+		packet.msg_control = control;
+		packet.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+		cmsg = CMSG_FIRSTHDR(&packet);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+	}
+	
+	do
+	{
+		res = sendmsg(sock, &packet, 0);
+	} while (res < 0 && errno == EINTR);
+	if (res < 0)
+		return -1;
+	
+	if (mtc_handoff_write(sock, hdr + res, MTC_HANDOFF_HDR_SIZE - res) < 0)
+		return -1;
+	
+	return mtc_handoff_write(sock, payload, len);
+}
+
+//Receives a record. Payload is to be freed with mtc_free().
+static int mtc_handoff_receive_record(int sock, uint32_t *type,
+	void **payload, uint32_t *len, int *fds, int *n_fds)
+{
+	char hdr[MTC_HANDOFF_HDR_SIZE];
+	char control[CMSG_SPACE(sizeof(int) * MTC_HANDOFF_MAX_FDS)];
+	struct msghdr packet;
+	struct iovec vector;
+	struct cmsghdr *cmsg;
+	ssize_t res;
+	
+	vector.iov_base = hdr;
+	vector.iov_len = MTC_HANDOFF_HDR_SIZE;
+	memset(&packet, 0, sizeof(struct msghdr));
+	packet.msg_iov = &vector;
+	packet.msg_iovlen = 1;
+	packet.msg_control = control;
+	packet.msg_controllen = sizeof(control);
+	
+	do
+	{
+#ifdef MSG_CMSG_CLOEXEC
+		res = recvmsg(sock, &packet, MSG_CMSG_CLOEXEC);
+#else
+		res = recvmsg(sock, &packet, 0);
+#endif
+	} while (res < 0 && errno == EINTR);
+	if (res < 0)
+		return -1;
+	else if (res == 0)
+	{
+		errno = ECONNRESET;
+		return -1;
+	}
+	
+	*n_fds = 0;
+	for (cmsg = CMSG_FIRSTHDR(&packet); cmsg; 
+		cmsg = CMSG_NXTHDR(&packet, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET 
+			&& cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			*n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *n_fds);
+		}
+	}
+	
+	if (mtc_handoff_read(sock, hdr + res, MTC_HANDOFF_HDR_SIZE - res) < 0)
+		goto fail;
+	
+	mtc_uint32_copy_from_le(hdr, type);
+	mtc_uint32_copy_from_le(hdr + 4, len);
+	
+	*payload = NULL;
+	if (*len)
+	{
+		*payload = mtc_tryalloc(*len);
+		if (! *payload)
+		{
+			errno = ENOMEM;
+			goto fail;
+		}
+		if (mtc_handoff_read(sock, *payload, *len) < 0)
+		{
+			mtc_free(*payload);
+			goto fail;
+		}
+	}
+	
+	return 0;
+	
+fail:
+	{
+		int saved_errno = errno, i;
+		for (i = 0; i < *n_fds; i++)
+			close(fds[i]);
+		errno = saved_errno;
+	}
+	return -1;
+}
+
+int mtc_handoff_send_listener(int sock, MtcSimpleListener *listener)
+{
+	if (mtc_handoff_send_record(sock, MTC_HANDOFF_LISTENER, 
+		NULL, 0, &(listener->test.fd), 1) < 0)
+		return -1;
+	
+	//The other process accepts connections from now on
+	mtc_simple_listener_set_active(listener, 0);
+	
+	return 0;
+}
+
+//Sends the peer and its links
+static int mtc_handoff_send_state(int sock, MtcSimplePeerState *state)
+{
+	char *payload, *iter;
+	uint32_t len, val;
+	int i, res;
+	void **link_states;
+	size_t *link_lens;
+	
+	//Save state of the links first, so that 
+	//a peer with a broken link is left out as a whole
+	link_states = (void **) mtc_alloc(sizeof(void *) * state->n_links);
+	link_lens = (size_t *) mtc_alloc(sizeof(size_t) * state->n_links);
+	for (i = 0; i < state->n_links; i++)
+	{
+		link_states[i] = mtc_fd_link_export(state->links[i], link_lens + i);
+		if (! link_states[i])
+			break;
+	}
+	if (i < state->n_links)
+	{
+		while (i-- > 0)
+			mtc_free(link_states[i]);
+		res = 0;
+		goto end;
+	}
+	
+	//Peer record: no. of links and topics, topics, 
+	//no. of key slots and key slots
+	len = 12;
+	for (i = 0; i < state->n_topics; i++)
+		len += 4 + strlen(state->topics[i]);
+	if (state->slots)
+		len += 4 * MTC_SIMPLE_BOND_SLOTS;
+	iter = payload = (char *) mtc_alloc(len);
+	val = state->n_links;
+	mtc_uint32_copy_to_le(iter, &val);
+	val = state->n_topics;
+	mtc_uint32_copy_to_le(iter + 4, &val);
+	iter += 8;
+	for (i = 0; i < state->n_topics; i++)
+	{
+		val = strlen(state->topics[i]);
+		mtc_uint32_copy_to_le(iter, &val);
+		memcpy(iter + 4, state->topics[i], val);
+		iter += 4 + val;
+	}
+	val = state->slots ? MTC_SIMPLE_BOND_SLOTS : 0;
+	mtc_uint32_copy_to_le(iter, &val);
+	iter += 4;
+	for (i = 0; state->slots && i < MTC_SIMPLE_BOND_SLOTS; i++)
+	{
+		val = (uint32_t) state->slots[i];
+		mtc_uint32_copy_to_le(iter, &val);
+		iter += 4;
+	}
+	res = mtc_handoff_send_record
+		(sock, MTC_HANDOFF_PEER, payload, len, NULL, 0);
+	mtc_free(payload);
+	
+	//Link records
+	for (i = 0; i < state->n_links; i++)
+	{
+		int fds[2], n_fds = 1;
+		
+		fds[0] = mtc_fd_link_get_out_fd(state->links[i]);
+		fds[1] = mtc_fd_link_get_in_fd(state->links[i]);
+		if (fds[1] != fds[0])
+			n_fds = 2;
+		
+		if (res == 0)
+			res = mtc_handoff_send_record(sock, MTC_HANDOFF_LINK, 
+				link_states[i], link_lens[i], fds, n_fds);
+		mtc_free(link_states[i]);
+	}
+	
+end:
+	mtc_free(link_states);
+	mtc_free(link_lens);
+	
+	//Our copies of file descriptors are closed now
+	mtc_simple_peer_state_free(state);
+	
+	return res;
+}
+
+int mtc_handoff_send_peer_set(int sock, MtcPeerSet *peer_set)
+{
+	MtcPeerRing *sentinel = &(peer_set->sentinel);
+	MtcSimplePeerState *state;
+	
+	while (sentinel->next != sentinel)
+	{
+		MtcPeerHolder *holder = (MtcPeerHolder *) sentinel->next;
+		MtcPeer *peer = holder->peer;
+		
+		//Detaching resets the peer which removes the holder
+		mtc_peer_ref(peer);
+		state = mtc_simple_peer_detach(peer);
+		if (sentinel->next == (MtcPeerRing *) holder)
+			mtc_peer_holder_destroy(holder);
+		mtc_peer_unref(peer);
+		
+		if (state && mtc_handoff_send_state(sock, state) < 0)
+			return -1;
+	}
+	
+	return 0;
+}
+
+int mtc_handoff_send_end(int sock)
+{
+	return mtc_handoff_send_record(sock, MTC_HANDOFF_END, NULL, 0, NULL, 0);
+}
+
+//Receives links of a peer
+static MtcPeer *mtc_handoff_receive_peer
+	(int sock, MtcRouter *router, const char *payload, uint32_t len)
+{
+	MtcSimplePeerState *state;
+	uint32_t n_links, n_topics, val, i;
+	const char *iter = payload, *lim = payload + len;
+	
+	if (len < 8)
+		goto invalid;
+	mtc_uint32_copy_from_le(iter, &n_links);
+	mtc_uint32_copy_from_le(iter + 4, &n_topics);
+	iter += 8;
+	if (n_links == 0 || n_topics > len / 4)
+		goto invalid;
+	
+	state = (MtcSimplePeerState *) mtc_alloc(sizeof(MtcSimplePeerState));
+	state->links = (MtcLink **) mtc_alloc(sizeof(MtcLink *) * n_links);
+	state->n_links = 0;
+	state->slots = NULL;
+	state->topics = NULL;
+	if (n_topics)
+		state->topics = (char **) mtc_alloc(sizeof(char *) * n_topics);
+	state->n_topics = 0;
+	
+	//Topics
+	for (i = 0; i < n_topics; i++)
+	{
+		if (lim - iter < 4)
+			goto invalid_state;
+		mtc_uint32_copy_from_le(iter, &val);
+		iter += 4;
+		if (val > lim - iter)
+			goto invalid_state;
+		
+		state->topics[i] = (char *) mtc_alloc(val + 1);
+		memcpy(state->topics[i], iter, val);
+		state->topics[i][val] = 0;
+		state->n_topics++;
+		iter += val;
+	}
+	
+	//Key slots
+	if (lim - iter < 4)
+		goto invalid_state;
+	mtc_uint32_copy_from_le(iter, &val);
+	iter += 4;
+	if (val != 0 && val != MTC_SIMPLE_BOND_SLOTS)
+		goto invalid_state;
+	if (val)
+	{
+		if (lim - iter < 4 * MTC_SIMPLE_BOND_SLOTS)
+			goto invalid_state;
+		state->slots = (int *) mtc_alloc
+			(sizeof(int) * MTC_SIMPLE_BOND_SLOTS);
+		for (i = 0; i < MTC_SIMPLE_BOND_SLOTS; i++)
+		{
+			mtc_uint32_copy_from_le(iter, &val);
+			iter += 4;
+			state->slots[i] = (int32_t) val;
+			if (state->slots[i] < -1 || state->slots[i] >= (int) n_links)
+				goto invalid_state;
+		}
+	}
+	
+	//Links
+	for (i = 0; i < n_links; i++)
+	{
+		uint32_t type, link_len;
+		void *link_state;
+		int fds[MTC_HANDOFF_MAX_FDS], n_fds;
+		MtcLink *link = NULL;
+		
+		if (mtc_handoff_receive_record
+			(sock, &type, &link_state, &link_len, fds, &n_fds) < 0)
+			goto fail;
+		
+		if (type == MTC_HANDOFF_LINK && n_fds >= 1)
+			link = mtc_fd_link_import(link_state, link_len, 
+				fds[0], fds[n_fds - 1]);
+		if (link_state)
+			mtc_free(link_state);
+		
+		if (! link)
+		{
+			while (n_fds-- > 0)
+				close(fds[n_fds]);
+			goto invalid_state;
+		}
+		
+		state->links[state->n_links++] = link;
+	}
+	
+	return mtc_simple_router_attach(router, state);
+	
+invalid_state:
+	errno = EPROTO;
+fail:
+	{
+		int saved_errno = errno;
+		mtc_simple_peer_state_free(state);
+		errno = saved_errno;
+	}
+	return NULL;
+	
+invalid:
+	errno = EPROTO;
+	return NULL;
+}
+
+MtcHandoffType mtc_handoff_receive(int sock, MtcPeerSet *peer_set, 
+	MtcSimpleListener **listener)
+{
+	uint32_t type, len;
+	void *payload;
+	int fds[MTC_HANDOFF_MAX_FDS], n_fds, proto_error = 1;
+	MtcPeer *peer;
+	MtcHandoffType res = MTC_HANDOFF_FAIL;
+	
+	if (mtc_handoff_receive_record
+		(sock, &type, &payload, &len, fds, &n_fds) < 0)
+		return MTC_HANDOFF_FAIL;
+	
+	switch (type)
+	{
+	case MTC_HANDOFF_END:
+		if (n_fds == 0)
+			res = MTC_HANDOFF_END;
+		break;
+	case MTC_HANDOFF_LISTENER:
+		if (n_fds != 1 || len != 0)
+			break;
+		*listener = mtc_simple_listener_new(fds[0]);
+		mtc_simple_listener_set_close_fd(*listener, 1);
+		n_fds = 0;
+		res = MTC_HANDOFF_LISTENER;
+		break;
+	case MTC_HANDOFF_PEER:
+		if (n_fds != 0)
+			break;
+		
+		//Failure here sets errno
+		proto_error = 0;
+		peer = mtc_handoff_receive_peer
+			(sock, peer_set->simple_router, payload, len);
+		if (peer)
+		{
+			mtc_peer_set_add_peer(peer_set, peer);
+			res = MTC_HANDOFF_PEER;
+		}
+		break;
+	}
+	
+	if (payload)
+		mtc_free(payload);
+	
+	if (res == MTC_HANDOFF_FAIL)
+	{
+		while (n_fds-- > 0)
+			close(fds[n_fds]);
+		if (proto_error)
+			errno = EPROTO;
+	}
+	
+	return res;
+}
@@ -55,6 +55,34 @@ void mtc_peer_set_unref(MtcPeerSet *peer_set);
  */
 void mtc_peer_set_add(MtcPeerSet *peer_set, int fd, int close_fd);
 
+/**Gets no. of peers in the collection
+ * \param peer_set an MtcPeerSet
+ * \return No. of peers
+ */
+int mtc_peer_set_get_size(MtcPeerSet *peer_set);
+
+/**Sets max. no. of peers in the collection. Listeners adding peers to 
+ * the collection (see mtc_simple_listener_set_peer_set()) stop 
+ * accepting connections while it is full, and resume when 
+ * a peer is removed.
+ * \param peer_set an MtcPeerSet
+ * \param val Max. no. of peers, 0 for no limit
+ */
+void mtc_peer_set_set_max_peers(MtcPeerSet *peer_set, int val);
+
+/**Sends a mail to all peers in the collection, serializing it once.
+ * See mtc_simple_router_broadcast().
+ * \param peer_set an MtcPeerSet
+ * \param addr Destination address
+ * \param reply_dest Destination for the reply, or NULL
+ * \param payload The message to send
+ * \param limit If nonzero, peers having more than this many bytes 
+ *        waiting to be sent are skipped.
+ * \return No. of peers the mail was queued on
+ */
+int mtc_peer_set_broadcast(MtcPeerSet *peer_set, 
+	MtcMBlock addr, MtcDest *reply_dest, MtcMsg *payload, size_t limit);
+
 
 //MtcSimpleListener
 
@@ -62,6 +90,36 @@ void mtc_peer_set_add(MtcPeerSet *peer_set, int fd, int close_fd);
 ///socket.
 typedef struct _MtcSimpleListener MtcSimpleListener;
 
+///Counters kept by a listener
+typedef struct
+{
+	///No. of connections accepted
+	uint64_t n_accepted;
+	///No. of times the listener found the socket readable
+	uint64_t n_wakeups;
+	///No. of times the accept budget was used up, 
+	///i.e. more connections may have been waiting
+	uint64_t n_budget_exhausted;
+	///No. of times accept() failed with an error other than 
+	///no connection waiting
+	uint64_t n_failed;
+	///No. of times accepting was paused because a limit was hit
+	uint64_t n_paused;
+	///Total time accepting was paused, in microseconds. 
+	///Clients arriving meanwhile wait in the backlog.
+	int64_t paused_time;
+	///Longest pause, in microseconds. This is the longest time 
+	///a client waited in the backlog because of the limits.
+	int64_t max_paused_time;
+} MtcSimpleListenerStats;
+
+///Default max. no. of connections accepted at once
+#define MTC_SIMPLE_LISTENER_ACCEPT_BUDGET 64
+
+///Suggested interval in microseconds at which a paused listener 
+///checks its limits again, see mtc_simple_listener_set_recheck_interval()
+#define MTC_SIMPLE_LISTENER_RECHECK_INTERVAL 100000
+
 struct _MtcSimpleListener
 {
 	MtcEventSource parent;
@@ -74,11 +132,30 @@ struct _MtcSimpleListener
 	
 	/**Callback to be called when a connection is accepted
 	 * \param listener The listener object
-	 * \param fd Newly accepted connection
+	 * \param fd Newly accepted connection, in nonblocking mode
 	 */
 	void (*accepted) (MtcSimpleListener *listener, int fd);
 	///User data
 	void *data;
+	
+	///Max. no. of connections accepted every time the socket 
+	///becomes readable
+	int accept_budget;
+	///Counters, sample n_accepted periodically to get accept rate.
+	MtcSimpleListenerStats stats;
+	
+	///Limit on data queued on all links of the process, 0 for none
+	size_t memory_limit;
+	///Whether accepting is paused because a limit is hit
+	int paused;
+	///When accepting was paused
+	int64_t paused_since;
+	///Interval for checking the limits while paused, 0 for none
+	int64_t recheck_interval;
+	///Timer for checking the limits while paused
+	MtcEventTestTimer recheck;
+	///Next listener adding peers to the same MtcPeerSet
+	MtcSimpleListener *next_in_set;
 };
 
 /**Ceates a new listener listening for connections on given
@@ -129,6 +206,56 @@ void mtc_simple_listener_set_close_fd
 #define mtc_simple_listener_get_close_fd(listener) \
 	((int) ((listener)->close_fd))
 
+/**Sets a limit on data queued for sending on all links of the 
+ * process (see mtc_fd_link_get_total_unsent_size()). 
+ * The listener stops accepting connections while the limit is 
+ * exceeded, leaving clients waiting in the backlog.
+ * 
+ * Accepting is also paused when the process runs out of file 
+ * descriptors or memory. mtc_simple_listener_update() checks the 
+ * limits again and resumes accepting, a paused listener also does it 
+ * periodically if mtc_simple_listener_set_recheck_interval() is used.
+ * \param listener The listener object
+ * \param val Max. no. of bytes, 0 for no limit
+ */
+void mtc_simple_listener_set_memory_limit
+	(MtcSimpleListener *listener, size_t val);
+
+/**Makes a paused listener check its limits again periodically, 
+ * so that it resumes without mtc_simple_listener_update() being called. 
+ * The listener then uses a timer test (see MtcEventTestTimer), 
+ * which needs a libevent based event manager. 
+ * \param listener The listener object
+ * \param usec Interval in microseconds, for example 
+ *        MTC_SIMPLE_LISTENER_RECHECK_INTERVAL. 0 to not check 
+ *        periodically (default)
+ */
+void mtc_simple_listener_set_recheck_interval
+	(MtcSimpleListener *listener, int64_t usec);
+
+/**Checks the limits again and resumes accepting connections 
+ * if none is hit. 
+ * \param listener The listener object
+ */
+void mtc_simple_listener_update(MtcSimpleListener *listener);
+
+/**Gets whether accepting connections is paused because 
+ * a limit is hit
+ * \param listener The listener object
+ * \return Nonzero if paused
+ */
+#define mtc_simple_listener_get_paused(listener) \
+	((int) ((listener)->paused))
+
+/**Sets max. no. of connections accepted every time the socket 
+ * becomes readable, before other events are processed. 
+ * Default is MTC_SIMPLE_LISTENER_ACCEPT_BUDGET.
+ * \param listener The listener object
+ * \param val The budget, at least 1
+ */
+void mtc_simple_listener_set_accept_budget
+	(MtcSimpleListener *listener, int val);
+
 /**Adjusts callback functions so that newly accepted connections are
  * forwarded straight to the provided collection.
  * \param listener The listener object
@@ -145,6 +272,61 @@ void mtc_simple_listener_set_peer_set
 void mtc_simple_listener_unset_peer_set
 	(MtcSimpleListener *listener);
 
+//Handing over to another process
+
+///Type of object received by mtc_handoff_receive()
+typedef enum
+{
+	///An error occurred, errno is set
+	MTC_HANDOFF_FAIL = -1,
+	///No more objects follow
+	MTC_HANDOFF_END = 0,
+	///A listener was received
+	MTC_HANDOFF_LISTENER = 1,
+	///A peer was received and added to the peer set
+	MTC_HANDOFF_PEER = 2
+} MtcHandoffType;
+
+/**Hands a listener over to another process, 
+ * e.g. a new version of the server, over a Unix domain socket.
+ * The listener stops accepting connections afterwards.
+ * \param sock A connected Unix domain stream socket, in blocking mode
+ * \param listener The listener
+ * \return 0 on success, -1 on failure with errno set.
+ */
+int mtc_handoff_send_listener(int sock, MtcSimpleListener *listener);
+
+/**Hands all peers in the collection over to another process, 
+ * over a Unix domain socket.
+ * 
+ * The connections of every peer are detached using 
+ * mtc_simple_peer_detach() and their state is sent using 
+ * mtc_fd_link_export(), so the other process continues reading and 
+ * sending exactly where this one stopped. The peers are reset.
+ * Peers with broken connections are left out.
+ * \param sock A connected Unix domain stream socket, in blocking mode
+ * \param peer_set an MtcPeerSet
+ * \return 0 on success, -1 on failure with errno set.
+ */
+int mtc_handoff_send_peer_set(int sock, MtcPeerSet *peer_set);
+
+/**Tells the other process that nothing more is to be handed over.
+ * \param sock A connected Unix domain stream socket, in blocking mode
+ * \return 0 on success, -1 on failure with errno set.
+ */
+int mtc_handoff_send_end(int sock);
+
+/**Receives the next object handed over by another process. 
+ * Call repeatedly until MTC_HANDOFF_END is returned.
+ * \param sock A connected Unix domain stream socket, in blocking mode
+ * \param peer_set Collection to add received peers to
+ * \param listener Location to store a received listener. It is 
+ *        inactive and closes the file descriptor when destroyed.
+ * \return Type of object received
+ */
+MtcHandoffType mtc_handoff_receive(int sock, MtcPeerSet *peer_set, 
+	MtcSimpleListener **listener);
+
 /**
  * \}
  */